@@ -0,0 +1,102 @@
+#!/bin/bash
+#
+# loopback.sh: run fileclient -> fileserver over loopback at each network
+# nastiness level and report throughput. Needs fileclient and fileserver
+# built against the local stand-in (make without COMP117 set).
+#
+# Settings (environment):
+#   BENCH_LEVELS      network nastiness levels to run    (default "0 1 2 3 4")
+#   BENCH_FILENASTY   file nastiness for both ends        (default 0)
+#   BENCH_FILES       number of files in the source dir   (default 8)
+#   BENCH_SIZE        bytes per file                      (default 65536)
+#   BENCH_SRC         use this source dir instead of generating one
+#   BENCH_PORT        UDP port                            (default 41117)
+#   BENCH_CSV         also append one row per level to this CSV file
+#   BENCH_WORKLOAD    workload name written to the CSV    (default "random")
+#   C150_NASTY_*      override individual nastiness behaviours
+#
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+LEVELS=${BENCH_LEVELS:-"0 1 2 3 4"}
+FILENASTY=${BENCH_FILENASTY:-0}
+FILES=${BENCH_FILES:-8}
+SIZE=${BENCH_SIZE:-65536}
+PORT=${BENCH_PORT:-41117}
+WORKLOAD=${BENCH_WORKLOAD:-random}
+
+WORK=$(mktemp -d /tmp/filecopy-bench.XXXXXX)
+SERVER_PID=
+
+cleanup() {
+    if [ -n "$SERVER_PID" ]; then
+        kill "$SERVER_PID" 2>/dev/null || true
+        wait "$SERVER_PID" 2>/dev/null || true
+    fi
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+if [ -n "$BENCH_SRC" ]; then
+    SRC=$BENCH_SRC
+else
+    SRC=$WORK/src
+    mkdir -p "$SRC"
+    for i in $(seq 1 "$FILES"); do
+        head -c "$SIZE" /dev/urandom > "$SRC/file$i"
+    done
+fi
+
+# The client walks subdirectories too, so count the whole tree
+NFILES=$(find "$SRC" -type f | wc -l)
+NBYTES=$(find "$SRC" -type f -printf '%s\n' | awk '{ s += $1 } END { print s + 0 }')
+
+export C150_PORT=$PORT
+
+if [ -n "$BENCH_CSV" ] && [ ! -s "$BENCH_CSV" ]; then
+    echo "workload,level,filenastiness,files,bytes,wall_s,mb_per_s,packets_per_file,check_s,check_fraction,verify" \
+        > "$BENCH_CSV"
+fi
+
+printf "%-6s %8s %12s %10s %10s %14s %10s %8s\n" \
+    level files bytes "wall(s)" "MB/s" "packets/file" "check(s)" verify
+
+for LEVEL in $LEVELS; do
+    TARGET=$WORK/target$LEVEL
+    STATS=$WORK/stats$LEVEL
+    mkdir -p "$TARGET"
+    rm -f "$STATS"
+
+    ./fileserver "$LEVEL" "$FILENASTY" "$TARGET" > "$WORK/server$LEVEL.log" 2>&1 &
+    SERVER_PID=$!
+    sleep 0.2
+
+    START=$(date +%s.%N)
+    C150_STATS_FILE=$STATS ./fileclient localhost "$LEVEL" "$FILENASTY" "$SRC" \
+        > "$WORK/client$LEVEL.log" 2>&1
+    END=$(date +%s.%N)
+
+    kill "$SERVER_PID" 2>/dev/null || true
+    wait "$SERVER_PID" 2>/dev/null || true
+    SERVER_PID=
+
+    VERIFY=ok
+    diff -r "$SRC" "$TARGET" > /dev/null 2>&1 || VERIFY=FAIL
+
+    WRITTEN=$(sed -n 's/.*written=\([0-9]*\).*/\1/p' "$STATS" | tail -1)
+    CHECK=$(sed -n 's/^Summary: .*, \([0-9.e+-]*\) s in end-to-end checks/\1/p' "$WORK/client$LEVEL.log" | tail -1)
+    awk -v l="$LEVEL" -v n="$NFILES" -v b="$NBYTES" -v s="$START" -v e="$END" \
+        -v w="${WRITTEN:-0}" -v c="${CHECK:-0}" -v v="$VERIFY" \
+        -v fn="$FILENASTY" -v wl="$WORKLOAD" -v csv="$BENCH_CSV" 'BEGIN {
+            t = e - s
+            mbs = (t > 0 ? b / t / 1e6 : 0)
+            ppf = (n > 0 ? w / n : 0)
+            printf "%-6s %8d %12d %10.3f %10.3f %14.1f %10.3f %8s\n", l, n, b, t, mbs, ppf, c, v
+            if (csv != "") {
+                printf "%s,%s,%s,%d,%d,%.3f,%.3f,%.1f,%.3f,%.3f,%s\n",
+                    wl, l, fn, n, b, t, mbs, ppf, c, (t > 0 ? c / t : 0), v >> csv
+            }
+        }'
+done
@@ -0,0 +1,51 @@
+#!/bin/bash
+#
+# matrix.sh: generate each synthetic workload with makedatafile and run
+# bench/loopback.sh on it, collecting one CSV row per workload and level.
+#
+# Settings (environment):
+#   BENCH_LEVELS      network nastiness levels to run    (default "0 2")
+#   BENCH_WORKLOADS   subset of the workloads below       (default all)
+#   BENCH_CSV         output file                         (default bench/results.csv)
+#   BENCH_SEED        makedatafile seed                   (default 117)
+#
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+export BENCH_LEVELS=${BENCH_LEVELS:-"0 2"}
+export BENCH_CSV=${BENCH_CSV:-bench/results.csv}
+SEED=${BENCH_SEED:-117}
+
+# name: count minsize maxsize content
+WORKLOAD_SPECS="
+tiny:200:0:1K:random
+small:50:1K:32K:random
+huge:2:1M:2M:random
+mixed:40:0:1M:random
+compressible:40:0:1M:compressible
+zeros:10:64K:256K:zeros
+"
+
+WORKLOADS=${BENCH_WORKLOADS:-$(echo "$WORKLOAD_SPECS" | cut -d: -f1)}
+
+DATA=$(mktemp -d /tmp/filecopy-data.XXXXXX)
+trap 'rm -rf "$DATA"' EXIT
+
+rm -f "$BENCH_CSV"
+
+for NAME in $WORKLOADS; do
+    SPEC=$(echo "$WORKLOAD_SPECS" | grep "^$NAME:" || true)
+    if [ -z "$SPEC" ]; then
+        echo "Unknown workload $NAME" >&2
+        exit 1
+    fi
+    IFS=: read -r _ COUNT MINSIZE MAXSIZE CONTENT <<< "$SPEC"
+
+    echo "== $NAME: $COUNT files, $MINSIZE..$MAXSIZE, $CONTENT"
+    ./makedatafile "$DATA/$NAME" "$COUNT" "$MINSIZE" "$MAXSIZE" "$CONTENT" "$SEED"
+    BENCH_SRC="$DATA/$NAME" BENCH_WORKLOAD="$NAME" bench/loopback.sh
+done
+
+echo "Results written to $BENCH_CSV"
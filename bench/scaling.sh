@@ -0,0 +1,91 @@
+#!/bin/bash
+#
+# scaling.sh: run several fileclients at once against one fileserver with
+# 1, 2, 4... worker processes sharing the port (fileserver -w) and report
+# aggregate throughput. Needs fileclient, fileserver and makedatafile
+# built against the local stand-in (make without COMP117 set).
+#
+# The kernel picks a worker for each client by hashing its address, so
+# with few clients some workers may sit idle; use more clients than
+# workers for a smoother curve. Speedup is capped by the cores available.
+#
+# Settings (environment):
+#   BENCH_WORKERS     worker counts to run                (default "1 2 4")
+#   BENCH_CLIENTS     clients run at the same time        (default 8)
+#   BENCH_FILES       files per client                    (default 4)
+#   BENCH_SIZE        bytes per file                      (default 1M)
+#   BENCH_LEVEL       network nastiness                   (default 0)
+#   BENCH_FILENASTY   file nastiness; above 0 the server's
+#                     end-to-end checks read files repeatedly (default 1)
+#   BENCH_PORT        UDP port                            (default 41117)
+#
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+WORKERS=${BENCH_WORKERS:-"1 2 4"}
+CLIENTS=${BENCH_CLIENTS:-8}
+FILES=${BENCH_FILES:-4}
+SIZE=${BENCH_SIZE:-1M}
+LEVEL=${BENCH_LEVEL:-0}
+FILENASTY=${BENCH_FILENASTY:-1}
+PORT=${BENCH_PORT:-41117}
+
+WORK=$(mktemp -d /tmp/filecopy-scaling.XXXXXX)
+SERVER_PID=
+
+cleanup() {
+    if [ -n "$SERVER_PID" ]; then
+        kill "$SERVER_PID" 2>/dev/null || true
+        wait "$SERVER_PID" 2>/dev/null || true
+    fi
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+# Each client sends its own subdirectory, so their files land apart
+for c in $(seq 1 "$CLIENTS"); do
+    mkdir -p "$WORK/src$c/client$c"
+    ./makedatafile "$WORK/src$c/client$c" "$FILES" "$SIZE" "$SIZE" random "$c" > /dev/null
+done
+NBYTES=$(find "$WORK"/src* -type f -printf '%s\n' | awk '{ s += $1 } END { print s + 0 }')
+
+export C150_PORT=$PORT
+
+echo "cores: $(nproc), clients: $CLIENTS, bytes: $NBYTES"
+printf "%-8s %10s %10s %10s %8s\n" workers "wall(s)" "MB/s" speedup verify
+
+BASE=
+for W in $WORKERS; do
+    TARGET=$WORK/target$W
+    mkdir -p "$TARGET"
+
+    ./fileserver -w "$W" "$LEVEL" "$FILENASTY" "$TARGET" > "$WORK/server$W.log" 2>&1 &
+    SERVER_PID=$!
+    sleep 0.3
+
+    START=$(date +%s.%N)
+    PIDS=
+    for c in $(seq 1 "$CLIENTS"); do
+        ./fileclient localhost "$LEVEL" "$FILENASTY" "$WORK/src$c" > "$WORK/client$W.$c.log" 2>&1 &
+        PIDS="$PIDS $!"
+    done
+    wait $PIDS
+    END=$(date +%s.%N)
+
+    kill "$SERVER_PID" 2>/dev/null || true
+    wait "$SERVER_PID" 2>/dev/null || true
+    SERVER_PID=
+
+    VERIFY=ok
+    for c in $(seq 1 "$CLIENTS"); do
+        diff -r -q "$WORK/src$c/client$c" "$TARGET/client$c" > /dev/null || VERIFY=FAIL
+    done
+
+    T=$(awk -v s="$START" -v e="$END" 'BEGIN { printf "%.3f", e - s }')
+    BASE=${BASE:-$T}
+    awk -v w="$W" -v b="$NBYTES" -v t="$T" -v base="$BASE" -v v="$VERIFY" 'BEGIN {
+        printf "%-8s %10.3f %10.3f %10.2f %8s\n", w, t, (t > 0 ? b / t / 1e6 : 0), (t > 0 ? base / t : 0), v
+    }'
+done
@@ -0,0 +1,191 @@
+#ifndef __BUFFERPOOL_H_INCLUDED__
+#define __BUFFERPOOL_H_INCLUDED__
+
+/* Reusable, page-aligned buffers for whole files, so that reading,
+   hashing and sending a file do not each allocate and free one.
+
+   A released buffer is cached and handed to the next request it fits
+   without wasting more than half of it. The pool keeps the bytes it holds,
+   in use and cached, within a limit: cached buffers are freed to make
+   room, and a thread asking for more than the limit allows waits until
+   other threads release theirs. A thread never waits on buffers it holds
+   itself, so a lone thread can always make progress, going over the limit
+   if it must. A buffer goes back on the thread that acquired it. */
+
+#include <stdlib.h>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+const size_t bufferPoolAlignment = 4096;
+const size_t bufferPoolGranule = 64 * 1024;       /* Capacities are multiples of this */
+const size_t bufferPoolLimit = (size_t)512 << 20;
+
+struct BufferPoolStats {
+    uint64_t acquires;      /* Buffers handed out */
+    uint64_t allocations;   /* Of those, newly allocated rather than reused */
+    uint64_t frees;         /* Cached buffers given back to the system */
+    uint64_t waits;         /* Acquires that waited for other threads */
+    size_t peakBytes;       /* Most bytes held at once, in use and cached */
+};
+
+class BufferPool;
+
+/* A buffer on loan from a pool, returned when this goes away */
+class PooledBuffer {
+    BufferPool *pool;
+    char *bytes;
+    size_t capacity;
+
+ public:
+    PooledBuffer() : pool(nullptr), bytes(nullptr), capacity(0) {}
+    PooledBuffer(BufferPool *owner, char *data, size_t size) : pool(owner), bytes(data), capacity(size) {}
+    PooledBuffer(PooledBuffer &&other) : pool(other.pool), bytes(other.bytes), capacity(other.capacity) {
+        other.pool = nullptr;
+        other.bytes = nullptr;
+        other.capacity = 0;
+    }
+    PooledBuffer &operator=(PooledBuffer &&other);
+    PooledBuffer(const PooledBuffer &) = delete;
+    PooledBuffer &operator=(const PooledBuffer &) = delete;
+    ~PooledBuffer() { release(); }
+
+    char *data() const { return bytes; }
+    size_t size() const { return capacity; }
+
+    /* Give the buffer back early */
+    void release();
+};
+
+class BufferPool {
+    std::mutex mutex;
+    std::condition_variable released;
+    std::multimap<size_t, char *> cached;   /* By capacity */
+    size_t inUseBytes;
+    size_t cachedBytes;
+    size_t limit;
+    BufferPoolStats stats;
+
+    static thread_local size_t threadBytes;   /* Held by the calling thread, across pools */
+
+    /* Free cached buffers, largest first, until needed more bytes fit */
+    void trim(size_t needed) {
+        while (!cached.empty() && inUseBytes + cachedBytes + needed > limit) {
+            auto largest = std::prev(cached.end());
+            cachedBytes -= largest->first;
+            free(largest->second);
+            cached.erase(largest);
+            stats.frees++;
+        }
+    }
+
+ public:
+    BufferPool(size_t limitBytes = bufferPoolLimit) : inUseBytes(0), cachedBytes(0), limit(limitBytes), stats() {}
+
+    ~BufferPool() {
+        for (auto &entry : cached) {
+            free(entry.second);
+        }
+    }
+
+    /* A buffer of at least size bytes */
+    PooledBuffer acquire(size_t size) {
+        size_t capacity = ((size + bufferPoolGranule - 1) / bufferPoolGranule) * bufferPoolGranule;
+        if (capacity == 0) {
+            capacity = bufferPoolGranule;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        stats.acquires++;
+
+        auto fit = cached.lower_bound(capacity);
+        if (fit != cached.end() && fit->first <= 2 * capacity) {
+            capacity = fit->first;
+            char *bytes = fit->second;
+            cached.erase(fit);
+            cachedBytes -= capacity;
+            inUseBytes += capacity;
+            threadBytes += capacity;
+            return PooledBuffer(this, bytes, capacity);
+        }
+
+        bool waited = false;
+        trim(capacity);
+        while (inUseBytes + capacity > limit && inUseBytes > threadBytes) {
+            waited = true;
+            released.wait(lock);
+            trim(capacity);
+        }
+        stats.waits += waited ? 1 : 0;
+
+        void *bytes = nullptr;
+        if (posix_memalign(&bytes, bufferPoolAlignment, capacity) != 0) {
+            throw std::bad_alloc();
+        }
+        stats.allocations++;
+        inUseBytes += capacity;
+        threadBytes += capacity;
+        stats.peakBytes = std::max(stats.peakBytes, inUseBytes + cachedBytes);
+        return PooledBuffer(this, (char *)bytes, capacity);
+    }
+
+    void giveBack(char *bytes, size_t capacity) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            inUseBytes -= capacity;
+            threadBytes -= capacity;
+            cached.insert(std::make_pair(capacity, bytes));
+            cachedBytes += capacity;
+            trim(0);
+        }
+        released.notify_all();
+    }
+
+    BufferPoolStats getStats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stats;
+    }
+};
+
+thread_local size_t BufferPool::threadBytes = 0;
+
+PooledBuffer &PooledBuffer::operator=(PooledBuffer &&other) {
+    if (this != &other) {
+        release();
+        pool = other.pool;
+        bytes = other.bytes;
+        capacity = other.capacity;
+        other.pool = nullptr;
+        other.bytes = nullptr;
+        other.capacity = 0;
+    }
+    return *this;
+}
+
+void PooledBuffer::release() {
+    if (pool != nullptr) {
+        pool->giveBack(bytes, capacity);
+        pool = nullptr;
+        bytes = nullptr;
+        capacity = 0;
+    }
+}
+
+/* One pool per process */
+BufferPool &sharedBufferPool() {
+    static BufferPool pool;
+    return pool;
+}
+
+/* The shared pool's counters, for the end-of-run summaries */
+std::string bufferPoolSummary() {
+    BufferPoolStats stats = sharedBufferPool().getStats();
+    return "Buffers: " + std::to_string(stats.acquires) + " acquired, " + std::to_string(stats.allocations) +
+           " allocated, " + std::to_string(stats.frees) + " freed, " + std::to_string(stats.waits) +
+           " waits, peak " + std::to_string(stats.peakBytes) + " bytes";
+}
+
+#endif
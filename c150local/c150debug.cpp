@@ -0,0 +1,8 @@
+#include "c150debug.h"
+
+namespace C150NETWORK {
+
+static C150DebugLog debugLog;
+C150DebugLog *c150debug = &debugLog;
+
+}
@@ -0,0 +1,38 @@
+#ifndef __C150DEBUG_H_INCLUDED__
+#define __C150DEBUG_H_INCLUDED__
+
+/* Minimal stand-in for the COMP 150 debug logger. Output is discarded
+   unless C150_DEBUG is set in the environment. */
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+
+namespace C150NETWORK {
+
+const unsigned int C150APPLICATION = 1u << 0;
+const unsigned int C150NETWORKTRAFFIC = 1u << 1;
+const unsigned int C150NETWORKDELIVERY = 1u << 2;
+const unsigned int C150ALLDEBUG = ~0u;
+
+class C150DebugLog {
+    unsigned int enabledClasses;
+ public:
+    C150DebugLog() : enabledClasses(getenv("C150_DEBUG") ? C150ALLDEBUG : 0) {}
+    void enableLogging(unsigned int classes) { enabledClasses |= classes; }
+    void setIndent(const char *) {}
+    void setPrefix(const char *) {}
+    void printf(const char *fmt, ...) {
+        if (!enabledClasses) return;
+        va_list ap;
+        va_start(ap, fmt);
+        vfprintf(stderr, fmt, ap);
+        va_end(ap);
+    }
+};
+
+extern C150DebugLog *c150debug;
+
+}
+
+#endif
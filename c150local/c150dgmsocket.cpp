@@ -0,0 +1,180 @@
+#include "c150dgmsocket.h"
+#include "c150debug.h"
+
+#include <cerrno>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+
+namespace C150NETWORK {
+
+C150SocketStats c150SocketStats;
+
+/* Write the counters out when the process exits normally */
+namespace {
+struct StatsReporter {
+    ~StatsReporter() {
+        const char *path = getenv("C150_STATS_FILE");
+        if (path == NULL || *path == '\0') {
+            return;
+        }
+        FILE *out = fopen(path, "a");
+        if (out == NULL) {
+            return;
+        }
+        const C150SocketStats &s = c150SocketStats;
+        fprintf(out, "written=%llu read=%llu bytesWritten=%llu bytesRead=%llu "
+                     "timeouts=%llu dropped=%llu duplicated=%llu reordered=%llu corrupted=%llu\n",
+                (unsigned long long)s.datagramsWritten, (unsigned long long)s.datagramsRead,
+                (unsigned long long)s.bytesWritten, (unsigned long long)s.bytesRead,
+                (unsigned long long)s.timeouts, (unsigned long long)s.dropped,
+                (unsigned long long)s.duplicated, (unsigned long long)s.reordered,
+                (unsigned long long)s.corrupted);
+        fclose(out);
+    }
+} statsReporter;
+}
+
+C150DgmSocket::C150DgmSocket()
+    : isClient(false), isBound(false), haveOtherEnd(false),
+      timeoutsOn(false), timeoutMillis(0), lastReadTimedOut(false) {
+    memset(&otherEnd, 0, sizeof(otherEnd));
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        throw C150NetworkException(string("socket() failed: ") + strerror(errno));
+    }
+}
+
+C150DgmSocket::~C150DgmSocket() {
+    close(fd);
+}
+
+/* Servers listen on $C150_PORT on all interfaces */
+void C150DgmSocket::bindServerPort() {
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    local.sin_port = htons((uint16_t)c150EnvLong("C150_PORT", C150DEFAULTPORT));
+
+    if (c150EnvLong("C150_REUSEPORT", 0) != 0) {
+        int on = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0) {
+            throw C150NetworkException(string("SO_REUSEPORT failed: ") + strerror(errno));
+        }
+    }
+
+    if (bind(fd, (struct sockaddr *)&local, sizeof(local)) != 0) {
+        throw C150NetworkException(string("bind() failed: ") + strerror(errno));
+    }
+    isBound = true;
+}
+
+void C150DgmSocket::setServerName(const char *name) {
+    struct addrinfo hints;
+    struct addrinfo *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    if (getaddrinfo(name, NULL, &hints, &result) != 0 || result == NULL) {
+        throw C150NetworkException(string("Unknown server name: ") + name);
+    }
+    memcpy(&otherEnd, result->ai_addr, sizeof(otherEnd));
+    freeaddrinfo(result);
+
+    otherEnd.sin_port = htons((uint16_t)c150EnvLong("C150_PORT", C150DEFAULTPORT));
+    isClient = true;
+    haveOtherEnd = true;
+}
+
+void C150DgmSocket::sendRaw(const char *buf, ssize_t len) {
+    sendRawTo(otherEnd, buf, len);
+}
+
+void C150DgmSocket::sendRawTo(const struct sockaddr_in &to, const char *buf, ssize_t len) {
+    ssize_t sent = sendto(fd, buf, len, 0, (const struct sockaddr *)&to, sizeof(to));
+    if (sent < 0 && errno != ECONNREFUSED) {
+        throw C150NetworkException(string("sendto() failed: ") + strerror(errno));
+    }
+}
+
+void C150DgmSocket::write(const char *buf, ssize_t lenToWrite) {
+    if (lenToWrite > MAXDGMSIZE) {
+        throw C150NetworkException("Datagram larger than MAXDGMSIZE");
+    }
+    if (!haveOtherEnd) {
+        throw C150NetworkException("write() before any peer is known");
+    }
+    c150SocketStats.datagramsWritten++;
+    c150SocketStats.bytesWritten += lenToWrite;
+    sendRaw(buf, lenToWrite);
+}
+
+ssize_t C150DgmSocket::read(char *buf, ssize_t lenToRead) {
+    if (!isClient && !isBound) {
+        bindServerPort();
+    }
+
+    lastReadTimedOut = false;
+    int64_t deadline = c150NowMillis() + timeoutMillis;
+
+    for (;;) {
+        int wait = -1;
+        if (timeoutsOn) {
+            int64_t remaining = deadline - c150NowMillis();
+            wait = remaining > 0 ? (int)remaining : 0;
+        }
+
+        int heldWait = releaseHeld();
+        if (heldWait >= 0 && (wait < 0 || heldWait < wait)) {
+            wait = heldWait;
+        }
+
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        int ready = poll(&pfd, 1, wait);
+        if (ready < 0 && errno != EINTR) {
+            throw C150NetworkException(string("poll() failed: ") + strerror(errno));
+        }
+
+        if (ready > 0) {
+            struct sockaddr_in from;
+            socklen_t fromLen = sizeof(from);
+            ssize_t len = recvfrom(fd, buf, lenToRead, 0, (struct sockaddr *)&from, &fromLen);
+            if (len < 0) {
+                /* A client sees ICMP port unreachable as ECONNREFUSED; treat as no data */
+                if (errno == ECONNREFUSED || errno == EINTR) {
+                    continue;
+                }
+                throw C150NetworkException(string("recvfrom() failed: ") + strerror(errno));
+            }
+            if (!isClient) {
+                otherEnd = from;
+                haveOtherEnd = true;
+            }
+            c150SocketStats.datagramsRead++;
+            c150SocketStats.bytesRead += len;
+            return len;
+        }
+
+        if (timeoutsOn && c150NowMillis() >= deadline) {
+            lastReadTimedOut = true;
+            c150SocketStats.timeouts++;
+            return 0;
+        }
+    }
+}
+
+void C150DgmSocket::turnOnTimeouts(int msecs) {
+    timeoutsOn = true;
+    timeoutMillis = msecs;
+}
+
+void C150DgmSocket::turnOffTimeouts() {
+    timeoutsOn = false;
+}
+
+}
@@ -0,0 +1,79 @@
+#ifndef __C150DGMSOCKET_H_INCLUDED__
+#define __C150DGMSOCKET_H_INCLUDED__
+
+/* Local stand-in for C150DgmSocket: a UDP socket that is a client once
+   setServerName() has been called, and otherwise a server bound to the
+   port named by C150_PORT. A server writes to whoever it last read from.
+   With C150_REUSEPORT=1 the server port is bound with SO_REUSEPORT, so
+   several server processes can share it. */
+
+#include "c150network.h"
+
+#define C150_HAVE_GET_OTHER_END 1
+#define C150_HAVE_REUSEPORT 1       /* Honors C150_REUSEPORT */
+
+namespace C150NETWORK {
+
+/* Per-process datagram counters, appended to $C150_STATS_FILE at exit */
+struct C150SocketStats {
+    uint64_t datagramsWritten;
+    uint64_t datagramsRead;
+    uint64_t bytesWritten;
+    uint64_t bytesRead;
+    uint64_t timeouts;
+    uint64_t dropped;
+    uint64_t duplicated;
+    uint64_t reordered;
+    uint64_t corrupted;
+};
+
+extern C150SocketStats c150SocketStats;
+
+class C150DgmSocket {
+ protected:
+    int fd;
+    bool isClient;
+    bool isBound;
+    bool haveOtherEnd;
+    struct sockaddr_in otherEnd;
+
+    bool timeoutsOn;
+    int timeoutMillis;
+    bool lastReadTimedOut;
+
+    void bindServerPort();
+
+    /* Put one datagram on the wire, bypassing any nastiness */
+    void sendRaw(const char *buf, ssize_t len);
+    void sendRawTo(const struct sockaddr_in &to, const char *buf, ssize_t len);
+
+    /* Hook for delayed datagrams: send anything that is due and return
+       milliseconds until the next one, or -1 if nothing is pending */
+    virtual int releaseHeld() { return -1; }
+
+ public:
+    C150DgmSocket();
+    virtual ~C150DgmSocket();
+
+    virtual void setServerName(const char *name);
+
+    virtual ssize_t read(char *buf, ssize_t lenToRead);
+    virtual void write(const char *buf, ssize_t lenToWrite);
+
+    virtual void turnOnTimeouts(int msecs);
+    virtual void turnOffTimeouts();
+    virtual bool timeoutIsSet() { return timeoutsOn; }
+    virtual bool timedout() { return lastReadTimedOut; }
+
+    int getSocketFd() { return fd; }
+
+    /* Not in the course library: the peer a server last read from */
+    bool getOtherEnd(struct sockaddr_in &peer) { peer = otherEnd; return haveOtherEnd; }
+
+    /* Not in the course library: send later writes to peer */
+    void setOtherEnd(const struct sockaddr_in &peer) { otherEnd = peer; haveOtherEnd = true; }
+};
+
+}
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef __C150EXCEPTIONS_H_INCLUDED__
+#define __C150EXCEPTIONS_H_INCLUDED__
+
+/* Local stand-in for the COMP 150 exception classes. Only the members
+   used by fileclient/fileserver are provided. */
+
+#include <string>
+
+namespace C150NETWORK {
+
+using namespace std;
+
+class C150Exception {
+ protected:
+    string exceptionType;
+    string explanation;
+ public:
+    C150Exception(string explanation) : exceptionType("C150Exception"), explanation(explanation) {}
+    virtual ~C150Exception() {}
+
+    string explain() const { return explanation; }
+    string formattedExplanation() const { return exceptionType + ": " + explanation; }
+};
+
+class C150NetworkException : public C150Exception {
+ public:
+    C150NetworkException(string explanation) : C150Exception(explanation) {
+        exceptionType = "C150NetworkException";
+    }
+};
+
+class C150FileException : public C150Exception {
+ public:
+    C150FileException(string explanation) : C150Exception(explanation) {
+        exceptionType = "C150FileException";
+    }
+};
+
+}
+
+#endif
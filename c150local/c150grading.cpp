@@ -0,0 +1,21 @@
+#include "c150grading.h"
+
+#include <cstdlib>
+#include <fstream>
+
+namespace C150NETWORK {
+
+static std::ofstream gradeLog;
+std::ostream *GRADING = &gradeLog;
+
+void c150GradeMe(int argc, char *argv[]) {
+    (void)argc;
+    (void)argv;
+    const char *path = getenv("C150_GRADELOG");
+    /* An ofstream that was never opened silently swallows output */
+    if (path != NULL && *path != '\0') {
+        gradeLog.open(path, std::ios::app);
+    }
+}
+
+}
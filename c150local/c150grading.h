@@ -0,0 +1,19 @@
+#ifndef __C150GRADING_H_INCLUDED__
+#define __C150GRADING_H_INCLUDED__
+
+/* Local stand-in for the COMP 150 grading log. GRADEME() sends the
+   GRADING stream to $C150_GRADELOG when set, and discards it otherwise. */
+
+#include <ostream>
+
+namespace C150NETWORK {
+
+extern std::ostream *GRADING;
+
+void c150GradeMe(int argc, char *argv[]);
+
+}
+
+#define GRADEME(argc, argv) C150NETWORK::c150GradeMe((argc), (argv))
+
+#endif
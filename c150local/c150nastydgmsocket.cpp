@@ -0,0 +1,112 @@
+#include "c150nastydgmsocket.h"
+
+#include <unistd.h>
+
+namespace C150NETWORK {
+
+/* drop%, dup%, reorder%, corrupt%, delay ms */
+static const C150NastyProfile levelProfiles[] = {
+    {  0.0, 0.0,  0.0, 0.0,  0 },
+    {  5.0, 0.0,  0.0, 0.0,  0 },
+    { 10.0, 2.0,  5.0, 0.0,  2 },
+    { 15.0, 5.0, 10.0, 0.0,  5 },
+    { 25.0, 10.0, 20.0, 0.0, 10 },
+};
+
+C150NastyProfile c150NastyProfileForLevel(int nastiness) {
+    const int levels = sizeof(levelProfiles) / sizeof(levelProfiles[0]);
+    if (nastiness < 0) {
+        nastiness = 0;
+    }
+    if (nastiness >= levels) {
+        nastiness = levels - 1;
+    }
+    return levelProfiles[nastiness];
+}
+
+C150NastyDgmSocket::C150NastyDgmSocket(int nastiness)
+    : nastiness(nastiness) {
+    profile = c150NastyProfileForLevel(nastiness);
+    profile.dropPercent = c150EnvDouble("C150_NASTY_DROP", profile.dropPercent);
+    profile.dupPercent = c150EnvDouble("C150_NASTY_DUP", profile.dupPercent);
+    profile.reorderPercent = c150EnvDouble("C150_NASTY_REORDER", profile.reorderPercent);
+    profile.corruptPercent = c150EnvDouble("C150_NASTY_CORRUPT", profile.corruptPercent);
+    profile.delayMillis = (int)c150EnvLong("C150_NASTY_DELAY_MS", profile.delayMillis);
+    random.reseed((uint64_t)c150EnvLong("C150_NASTY_SEED", 117));
+}
+
+C150NastyDgmSocket::~C150NastyDgmSocket() {
+}
+
+void C150NastyDgmSocket::hold(const char *buf, ssize_t len) {
+    HeldDatagram h;
+    /* Always wait at least a millisecond so the datagram really goes out late */
+    h.releaseAt = c150NowMillis() + 1 + random.below(profile.delayMillis + 1);
+    h.to = otherEnd;
+    h.data.assign(buf, buf + len);
+    held.push_back(h);
+}
+
+int C150NastyDgmSocket::releaseHeld() {
+    if (held.empty()) {
+        return -1;
+    }
+
+    int64_t now = c150NowMillis();
+    int64_t next = -1;
+    for (auto it = held.begin(); it != held.end();) {
+        if (it->releaseAt <= now) {
+            sendRawTo(it->to, it->data.data(), it->data.size());
+            it = held.erase(it);
+        } else {
+            if (next < 0 || it->releaseAt < next) {
+                next = it->releaseAt;
+            }
+            ++it;
+        }
+    }
+    return next < 0 ? -1 : (int)(next - now);
+}
+
+void C150NastyDgmSocket::write(const char *buf, ssize_t lenToWrite) {
+    if (lenToWrite > MAXDGMSIZE) {
+        throw C150NetworkException("Datagram larger than MAXDGMSIZE");
+    }
+    if (!haveOtherEnd) {
+        throw C150NetworkException("write() before any peer is known");
+    }
+    c150SocketStats.datagramsWritten++;
+    c150SocketStats.bytesWritten += lenToWrite;
+
+    if (random.chance(profile.dropPercent)) {
+        c150SocketStats.dropped++;
+        releaseHeld();
+        return;
+    }
+
+    char copy[MAXDGMSIZE];
+    memcpy(copy, buf, lenToWrite);
+    if (lenToWrite > 0 && random.chance(profile.corruptPercent)) {
+        copy[random.below(lenToWrite)] ^= (char)(1 + random.below(255));
+        c150SocketStats.corrupted++;
+    }
+
+    int copies = random.chance(profile.dupPercent) ? 2 : 1;
+    if (copies == 2) {
+        c150SocketStats.duplicated++;
+    }
+
+    for (int i = 0; i < copies; i++) {
+        if (random.chance(profile.reorderPercent)) {
+            c150SocketStats.reordered++;
+            hold(copy, lenToWrite);
+        } else {
+            sendRaw(copy, lenToWrite);
+        }
+    }
+
+    /* Anything held back now lands behind the datagram just sent */
+    releaseHeld();
+}
+
+}
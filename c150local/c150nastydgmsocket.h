@@ -0,0 +1,61 @@
+#ifndef __C150NASTYDGMSOCKET_H_INCLUDED__
+#define __C150NASTYDGMSOCKET_H_INCLUDED__
+
+/* Local stand-in for C150NastyDgmSocket. Outgoing datagrams are dropped,
+   duplicated, reordered, delayed or corrupted according to the nastiness
+   level. Each behaviour can be overridden from the environment:
+
+     C150_NASTY_SEED      generator seed (default 117)
+     C150_NASTY_DROP      percent of datagrams dropped
+     C150_NASTY_DUP       percent of datagrams sent twice
+     C150_NASTY_REORDER   percent of datagrams held back behind the next one
+     C150_NASTY_CORRUPT   percent of datagrams with one byte flipped
+     C150_NASTY_DELAY_MS  upper bound on how long a held datagram waits */
+
+#include <deque>
+#include <vector>
+
+#include "c150dgmsocket.h"
+
+namespace C150NETWORK {
+
+struct C150NastyProfile {
+    double dropPercent;
+    double dupPercent;
+    double reorderPercent;
+    double corruptPercent;
+    int delayMillis;
+};
+
+class C150NastyDgmSocket : public C150DgmSocket {
+    struct HeldDatagram {
+        int64_t releaseAt;
+        struct sockaddr_in to;  /* A server may have read from someone else by then */
+        vector<char> data;
+    };
+
+    int nastiness;
+    C150NastyProfile profile;
+    C150Random random;
+    deque<HeldDatagram> held;
+
+    void hold(const char *buf, ssize_t len);
+
+ protected:
+    virtual int releaseHeld();
+
+ public:
+    C150NastyDgmSocket(int nastiness);
+    virtual ~C150NastyDgmSocket();
+
+    virtual void write(const char *buf, ssize_t lenToWrite);
+
+    const C150NastyProfile &getProfile() { return profile; }
+};
+
+/* Default behaviour for each nastiness level, before environment overrides */
+C150NastyProfile c150NastyProfileForLevel(int nastiness);
+
+}
+
+#endif
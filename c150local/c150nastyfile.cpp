@@ -0,0 +1,98 @@
+#include "c150nastyfile.h"
+
+#include <vector>
+
+namespace C150NETWORK {
+
+/* Percent chance, per open, that one read or write is corrupted */
+static const double levelReadPercent[] = { 0, 0, 5, 10, 20, 30 };
+static const double levelWritePercent[] = { 0, 5, 5, 10, 20, 30 };
+
+C150NastyFile::C150NastyFile(int nastiness)
+    : nastiness(nastiness), fp(NULL), corruptThisOpen(false), forWrite(false) {
+    const int levels = sizeof(levelReadPercent) / sizeof(levelReadPercent[0]);
+    if (this->nastiness < 0) {
+        this->nastiness = 0;
+    }
+    if (this->nastiness >= levels) {
+        this->nastiness = levels - 1;
+    }
+    /* Each instance gets its own stream, so two handles on one file do not
+       fail in lockstep, while a run as a whole stays reproducible */
+    static uint64_t instances = 0;
+    random.reseed((uint64_t)c150EnvLong("C150_NASTYFILE_SEED", 117) + 0x9E3779B97F4A7C15ULL * ++instances);
+}
+
+C150NastyFile::~C150NastyFile() {
+    if (fp != NULL) {
+        ::fclose(fp);
+    }
+}
+
+void *C150NastyFile::fopen(const char *path, const char *mode) {
+    if (fp != NULL) {
+        ::fclose(fp);
+    }
+    fp = ::fopen(path, mode);
+    forWrite = (strpbrk(mode, "wa+") != NULL);
+    double percent = forWrite ? levelWritePercent[nastiness] : levelReadPercent[nastiness];
+    corruptThisOpen = random.chance(percent);
+    return fp;
+}
+
+void C150NastyFile::maybeCorrupt(void *buf, size_t len) {
+    if (!corruptThisOpen || len == 0) {
+        return;
+    }
+    /* Spread the single corruption over the calls made on this open */
+    if (random.chance(50.0)) {
+        ((unsigned char *)buf)[random.below(len)] ^= (unsigned char)(1 + random.below(255));
+        corruptThisOpen = false;
+    }
+}
+
+size_t C150NastyFile::fread(void *ptr, size_t size, size_t nmemb) {
+    size_t items = ::fread(ptr, size, nmemb, fp);
+    maybeCorrupt(ptr, items * size);
+    return items;
+}
+
+size_t C150NastyFile::fwrite(const void *ptr, size_t size, size_t nmemb) {
+    if (!corruptThisOpen) {
+        return ::fwrite(ptr, size, nmemb, fp);
+    }
+    vector<unsigned char> copy((const unsigned char *)ptr, (const unsigned char *)ptr + size * nmemb);
+    maybeCorrupt(copy.data(), copy.size());
+    return ::fwrite(copy.data(), size, nmemb, fp);
+}
+
+int C150NastyFile::fseek(long offset, int whence) {
+    return ::fseek(fp, offset, whence);
+}
+
+long C150NastyFile::ftell() {
+    return ::ftell(fp);
+}
+
+void C150NastyFile::rewind() {
+    ::rewind(fp);
+}
+
+int C150NastyFile::feof() {
+    return ::feof(fp);
+}
+
+int C150NastyFile::ferror() {
+    return ::ferror(fp);
+}
+
+int C150NastyFile::fclose() {
+    if (fp == NULL) {
+        return EOF;
+    }
+    int result = ::fclose(fp);
+    fp = NULL;
+    return result;
+}
+
+}
@@ -0,0 +1,45 @@
+#ifndef __C150NASTYFILE_H_INCLUDED__
+#define __C150NASTYFILE_H_INCLUDED__
+
+/* Local stand-in for C150NastyFile. Behaves like stdio, except that with
+   nastiness above zero an open file may have one byte of one fread or
+   fwrite call flipped. The chance per open grows with the level; the
+   generator is seeded from C150_NASTYFILE_SEED (default 117). */
+
+#include <cstdio>
+
+#include "c150network.h"
+
+namespace C150NETWORK {
+
+class C150NastyFile {
+    int nastiness;
+    FILE *fp;
+    C150Random random;
+    bool corruptThisOpen;
+    bool forWrite;
+
+    void maybeCorrupt(void *buf, size_t len);
+
+ public:
+    C150NastyFile(int nastiness);
+    virtual ~C150NastyFile();
+
+    void *fopen(const char *path, const char *mode);
+    size_t fread(void *ptr, size_t size, size_t nmemb);
+    size_t fwrite(const void *ptr, size_t size, size_t nmemb);
+    int fseek(long offset, int whence);
+    long ftell();
+    void rewind();
+    int feof();
+    int ferror();
+    int fclose();
+
+    FILE *getFilePointer() { return fp; }
+};
+
+typedef C150NastyFile NASTYFILE;
+
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef __C150NETWORK_H_INCLUDED__
+#define __C150NETWORK_H_INCLUDED__
+
+/* Common includes for the local stand-in of the COMP 150 network library.
+   Like the original, this pulls the std namespace into C150NETWORK so
+   programs using "using namespace C150NETWORK" see string, cout, etc. */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include "c150exceptions.h"
+#include "c150utility.h"
+
+namespace C150NETWORK {
+
+using namespace std;
+
+/* Largest datagram the sockets will carry */
+const ssize_t MAXDGMSIZE = 512;
+
+/* Port used when C150_PORT is not set in the environment */
+const int C150DEFAULTPORT = 41117;
+
+}
+
+#endif
@@ -0,0 +1,30 @@
+#include "c150utility.h"
+
+#include <cstdlib>
+#include <time.h>
+
+namespace C150NETWORK {
+
+int64_t c150NowMillis() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long c150EnvLong(const char *name, long defaultValue) {
+    const char *value = getenv(name);
+    if (value == NULL || *value == '\0') {
+        return defaultValue;
+    }
+    return strtol(value, NULL, 10);
+}
+
+double c150EnvDouble(const char *name, double defaultValue) {
+    const char *value = getenv(name);
+    if (value == NULL || *value == '\0') {
+        return defaultValue;
+    }
+    return strtod(value, NULL);
+}
+
+}
@@ -0,0 +1,42 @@
+#ifndef __C150UTILITY_H_INCLUDED__
+#define __C150UTILITY_H_INCLUDED__
+
+/* Small helpers shared by the local stand-in library */
+
+#include <stdint.h>
+#include <string>
+
+namespace C150NETWORK {
+
+using namespace std;
+
+/* Milliseconds on a monotonic clock */
+int64_t c150NowMillis();
+
+/* Integer/double settings read from the environment, with a default */
+long c150EnvLong(const char *name, long defaultValue);
+double c150EnvDouble(const char *name, double defaultValue);
+
+/* Small seeded generator (xorshift64*) so runs can be replayed exactly */
+class C150Random {
+    uint64_t state;
+ public:
+    C150Random(uint64_t seed = 117) { reseed(seed); }
+    void reseed(uint64_t seed) { state = seed ? seed : 0x9E3779B97F4A7C15ULL; }
+    uint64_t next() {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545F4914F6CDD1DULL;
+    }
+    /* Uniform double in [0, 1) */
+    double unit() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+    /* True with the given percentage chance */
+    bool chance(double percent) { return percent > 0 && unit() * 100.0 < percent; }
+    /* Uniform integer in [0, bound) */
+    uint64_t below(uint64_t bound) { return bound ? next() % bound : 0; }
+};
+
+}
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef __CHUNKING_H_INCLUDED__
+#define __CHUNKING_H_INCLUDED__
+
+/* Content-defined chunking (gear hash with FastCDC-style normalized cut
+   points) and the chunk digests used to avoid resending data the server
+   already holds. Chunk boundaries depend only on nearby content, so an
+   insertion near the start of a file leaves later chunks unchanged. */
+
+#include <openssl/sha.h>
+#include <stdint.h>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+const size_t cdcMinChunk = 2 * 1024;
+const size_t cdcAvgChunk = 8 * 1024;
+const size_t cdcMaxChunk = 64 * 1024;
+
+/* Cut masks from FastCDC for an 8KB average: harder to match before the
+   average size, easier after, which narrows the size distribution */
+const uint64_t cdcMaskSmall = 0x0003590703530000ULL;
+const uint64_t cdcMaskLarge = 0x0000d90003530000ULL;
+
+struct ChunkDigest {
+    unsigned char bytes[SHA_DIGEST_LENGTH];
+
+    bool operator==(const ChunkDigest &other) const {
+        return memcmp(bytes, other.bytes, sizeof(bytes)) == 0;
+    }
+};
+
+struct ChunkDigestHash {
+    size_t operator()(const ChunkDigest &digest) const {
+        size_t h;
+        memcpy(&h, digest.bytes, sizeof(h));   /* SHA-1 bytes are already well mixed */
+        return h;
+    }
+};
+
+struct Chunk {
+    size_t offset;
+    uint32_t length;
+    ChunkDigest digest;
+};
+
+/* Table of 256 pseudo-random values, one per byte value */
+const uint64_t *gearTable() {
+    static uint64_t table[256];
+    static bool ready = false;
+    if (!ready) {
+        uint64_t state = 0x9E3779B97F4A7C15ULL;
+        for (int i = 0; i < 256; i++) {
+            state ^= state >> 12;
+            state ^= state << 25;
+            state ^= state >> 27;
+            table[i] = state * 0x2545F4914F6CDD1DULL;
+        }
+        ready = true;
+    }
+    return table;
+}
+
+/* Length of the chunk starting at data, given len bytes remain */
+size_t findChunkBoundary(const unsigned char *data, size_t len) {
+    if (len <= cdcMinChunk) {
+        return len;
+    }
+
+    const uint64_t *gear = gearTable();
+    size_t normal = len < cdcAvgChunk ? len : cdcAvgChunk;
+    size_t end = len < cdcMaxChunk ? len : cdcMaxChunk;
+    uint64_t fingerprint = 0;
+    size_t i = cdcMinChunk;
+
+    for (; i < normal; i++) {
+        fingerprint = (fingerprint << 1) + gear[data[i]];
+        if ((fingerprint & cdcMaskSmall) == 0) {
+            return i + 1;
+        }
+    }
+    for (; i < end; i++) {
+        fingerprint = (fingerprint << 1) + gear[data[i]];
+        if ((fingerprint & cdcMaskLarge) == 0) {
+            return i + 1;
+        }
+    }
+    return end;
+}
+
+/* Split a buffer into content-defined chunks and digest each one */
+void chunkBuffer(const char *buffer, size_t size, std::vector<Chunk> &chunks) {
+    chunks.clear();
+    size_t offset = 0;
+    while (offset < size) {
+        Chunk chunk;
+        chunk.offset = offset;
+        chunk.length = findChunkBoundary((const unsigned char *)buffer + offset, size - offset);
+        SHA1((const unsigned char *)buffer + offset, chunk.length, chunk.digest.bytes);
+        chunks.push_back(chunk);
+        offset += chunk.length;
+    }
+}
+
+#endif
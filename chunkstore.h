@@ -0,0 +1,155 @@
+#ifndef __CHUNKSTORE_H_INCLUDED__
+#define __CHUNKSTORE_H_INCLUDED__
+
+/* Server-side index of chunks that are already on disk in files that
+   passed their end-to-end check, keyed by chunk digest.
+
+   Before sending a file the client describes its chunks in QUERY
+   messages; the server answers which digests it already holds and keeps
+   the list as pending. When the file's first filename packet arrives the
+   pending list becomes the current file's list, and once that file
+   passes its check every chunk in it is indexed against the final path.
+   A chunk is re-hashed whenever it is read back, so a stale entry (the
+   file was since replaced) is dropped rather than copied.
+
+   The index is shared by every client a server process talks to, while
+   the pending and current lists belong to one client. */
+
+#include "c150nastyfile.h"
+#include "chunking.h"
+
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace C150NETWORK;
+
+const int chunkReadAttempts = 5;   /* Reads of a stored chunk before it is judged stale */
+
+/* The digests held on disk. One per server process, shared by the
+   ChunkStores of every client it serves */
+class ChunkIndex {
+    struct Location {
+        uint32_t pathIndex;
+        uint64_t offset;
+        uint32_t length;
+    };
+
+    unordered_map<ChunkDigest, Location, ChunkDigestHash> index;
+    vector<string> paths;
+
+    int fileNastiness;
+    vector<char> data;          /* Holds the chunk most recently read back */
+
+ public:
+    ChunkIndex(int fileNastiness) : fileNastiness(fileNastiness) {}
+
+    bool has(const ChunkDigest &digest) const {
+        return index.count(digest) != 0;
+    }
+
+    /* Index chunks, in file order, against the file at path */
+    void addFile(const string &path, const vector<Chunk> &chunks) {
+        uint32_t pathIndex = paths.size();
+        paths.push_back(path);
+
+        /* QUERY only carries lengths; offsets follow from the order */
+        uint64_t offset = 0;
+        for (const Chunk &chunk : chunks) {
+            Location location = { pathIndex, offset, chunk.length };
+            index[chunk.digest] = location;
+            offset += chunk.length;
+        }
+    }
+
+    /* Fetch a stored chunk; null if it is missing or stale. The result
+       is valid until the next call */
+    const vector<char> *readChunk(const ChunkDigest &digest) {
+        auto it = index.find(digest);
+        if (it == index.end()) {
+            return nullptr;
+        }
+
+        const Location &location = it->second;
+        data.resize(location.length);
+
+        /* The digest doubles as the check against file nastiness */
+        for (int attempt = 0; attempt < chunkReadAttempts; attempt++) {
+            NASTYFILE inputFile(fileNastiness);
+            if (inputFile.fopen(paths[location.pathIndex].c_str(), "rb") == nullptr) {
+                break;
+            }
+            bool ok = inputFile.fseek(location.offset, SEEK_SET) == 0 &&
+                      inputFile.fread(data.data(), 1, location.length) == location.length;
+            inputFile.fclose();
+
+            ChunkDigest actual;
+            SHA1((const unsigned char *)data.data(), data.size(), actual.bytes);
+            if (ok && actual == digest) {
+                return &data;
+            }
+        }
+
+        index.erase(it);
+        return nullptr;
+    }
+
+    size_t size() const { return index.size(); }
+};
+
+/* One client's view of the index: the chunk lists of the file it is
+   about to send and the file it is sending */
+class ChunkStore {
+    ChunkIndex &index;
+
+    uint32_t pendingId;         /* Packet number the QUERY said the file starts at */
+    vector<Chunk> pending;      /* Chunks described by QUERY messages */
+    vector<Chunk> current;      /* Chunks of the file being received */
+
+ public:
+    ChunkStore(ChunkIndex &index) : index(index), pendingId(0) {}
+
+    bool has(const ChunkDigest &digest) const {
+        return index.has(digest);
+    }
+
+    /* Record chunk descriptions from one QUERY message */
+    void addPending(uint32_t queryId, size_t firstIndex, const Chunk *chunks, size_t count) {
+        if (queryId != pendingId || firstIndex == 0) {
+            pending.clear();
+            pendingId = queryId;
+        }
+        if (firstIndex + count > pending.size()) {
+            pending.resize(firstIndex + count);
+        }
+        for (size_t i = 0; i < count; i++) {
+            pending[firstIndex + i] = chunks[i];
+        }
+    }
+
+    /* A new file starts at packet firstPacketNum */
+    void beginFile(uint32_t firstPacketNum) {
+        current.clear();
+        if (firstPacketNum == pendingId) {
+            current.swap(pending);
+        }
+        pending.clear();
+    }
+
+    /* The current file passed its check and now lives at path */
+    void commitFile(const string &path) {
+        if (!current.empty()) {
+            index.addFile(path, current);
+        }
+        current.clear();
+    }
+
+    const vector<char> *readChunk(const ChunkDigest &digest) {
+        return index.readChunk(digest);
+    }
+
+    size_t size() const { return index.size(); }
+};
+
+#endif
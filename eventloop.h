@@ -0,0 +1,462 @@
+#ifndef __EVENTLOOP_H_INCLUDED__
+#define __EVENTLOOP_H_INCLUDED__
+
+/* Single-threaded event loop driving C++20 coroutines, so that many
+   transfers can wait on the network at once without a thread each.
+
+   A flow is one socket, seen by the server as one client; it has at most
+   one exchange in flight, since the server acknowledges a client's
+   packets strictly in order. Concurrency is therefore capped at the
+   number of flows, each sending one packet per round trip. An exchange sends a packet and suspends its
+   coroutine until the matching reply arrives, resending each time its
+   deadline passes. Deadlines live in a hashed timer wheel of one-
+   millisecond ticks: arming one is a push onto a slot, and each tick
+   looks at a single slot, keeping entries whose deadline is rounds away.
+
+   The loop polls every flow's socket, hands each datagram to the flow's
+   exchange, and advances the wheel; it returns when every spawned task
+   has finished. An exchange that receives some other reply resends at
+   once, as sendPacketWithAck does. File reads and hashing go to a disk
+   worker thread, which alone uses the process-wide robust reader while
+   the loop runs; the coroutine that asked is resumed when the worker
+   signals an eventfd polled alongside the sockets, so other flows keep
+   sending meanwhile. A buffer a read fills is acquired by the coroutine
+   on the loop's thread, since a pooled buffer goes back on the thread
+   that acquired it. */
+
+#include "fileutils.h"
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace C150NETWORK;
+
+const size_t timerWheelSlots = 1024;   /* Ticks of one millisecond */
+
+/* A lazily started coroutine returning T. Awaiting it runs it, and the
+   awaiter resumes when it finishes */
+template <typename T>
+class Task {
+ public:
+    struct promise_type {
+        T value;
+        std::coroutine_handle<> continuation;
+        std::exception_ptr exception;
+
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> done) noexcept {
+                std::coroutine_handle<> next = done.promise().continuation;
+                return next ? next : std::noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+        FinalAwaiter final_suspend() noexcept { return {}; }
+
+        void return_value(T result) { value = std::move(result); }
+        void unhandled_exception() { exception = std::current_exception(); }
+    };
+
+    explicit Task(std::coroutine_handle<promise_type> coroutine) : handle(coroutine) {}
+    Task(Task &&other) : handle(other.handle) { other.handle = nullptr; }
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    ~Task() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    bool await_ready() { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) {
+        handle.promise().continuation = awaiter;
+        return handle;
+    }
+    T await_resume() { return result(); }
+
+    void start() { handle.resume(); }
+    bool done() const { return handle.done(); }
+
+    T result() {
+        if (handle.promise().exception) {
+            std::rethrow_exception(handle.promise().exception);
+        }
+        return std::move(handle.promise().value);
+    }
+
+ private:
+    std::coroutine_handle<promise_type> handle;
+};
+
+/* Hashed timing wheel of timer ids */
+class TimerWheel {
+    struct Timer {
+        uint64_t deadline;
+        uint64_t id;
+    };
+
+    vector<vector<Timer>> slots;
+    uint64_t current;           /* Last tick processed */
+    size_t armed;
+    chrono::steady_clock::time_point start;
+
+ public:
+    TimerWheel() : slots(timerWheelSlots), current(0), armed(0), start(chrono::steady_clock::now()) {}
+
+    uint64_t nowTick() const {
+        return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+    }
+
+    void add(uint64_t id, int delayMs) {
+        uint64_t deadline = max(current + 1, nowTick() + delayMs);
+        slots[deadline % timerWheelSlots].push_back({deadline, id});
+        armed++;
+    }
+
+    bool empty() const { return armed == 0; }
+
+    /* Fire every timer that is due, in tick order */
+    template <typename Fire>
+    void advance(Fire fire) {
+        uint64_t target = nowTick();
+        while (current < target && armed > 0) {
+            current++;
+            vector<Timer> due;
+            due.swap(slots[current % timerWheelSlots]);
+            for (const Timer &timer : due) {
+                if (timer.deadline <= current) {
+                    armed--;
+                    fire(timer.id);
+                } else {
+                    slots[current % timerWheelSlots].push_back(timer);
+                }
+            }
+        }
+        current = max(current, target);
+    }
+};
+
+class EventLoop;
+class Exchange;
+class Offload;
+
+/* A thread running blocking jobs one at a time, in the order given. The
+   loop polls fd and resumes whoever waited on a finished job */
+class DiskWorker {
+    std::mutex mutex;
+    std::condition_variable submitted;
+    std::deque<Offload *> pending;
+    vector<Offload *> finished;
+    bool stopping;
+    int fd;
+    std::thread worker;
+
+    void work();
+
+ public:
+    DiskWorker() : stopping(false) {
+        fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd < 0) {
+            throw C150Exception("DiskWorker: eventfd failed");
+        }
+        worker = std::thread(&DiskWorker::work, this);
+    }
+
+    ~DiskWorker() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        submitted.notify_one();
+        worker.join();
+        close(fd);
+    }
+
+    int getFd() const { return fd; }
+
+    void submit(Offload *job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.push_back(job);
+        }
+        submitted.notify_one();
+    }
+
+    /* Resume the coroutines whose jobs have finished */
+    void resumeFinished();
+};
+
+/* Run a job on the disk worker and resume once it is done. Anything the
+   job throws is thrown again here, on the loop's thread */
+class Offload {
+    DiskWorker &worker;
+    std::function<void()> job;
+    std::exception_ptr exception;
+    std::coroutine_handle<> waiter;
+
+ public:
+    Offload(DiskWorker &diskWorker, std::function<void()> work) : worker(diskWorker), job(std::move(work)) {}
+
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> coroutine) {
+        waiter = coroutine;
+        worker.submit(this);
+    }
+    void await_resume() {
+        if (exception) {
+            std::rethrow_exception(exception);
+        }
+    }
+
+    void run() {
+        try {
+            job();
+        } catch (...) {
+            exception = std::current_exception();
+        }
+    }
+
+    void resume() { waiter.resume(); }
+};
+
+void DiskWorker::work() {
+    spanThreadName("disk worker");
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        submitted.wait(lock, [this] { return stopping || !pending.empty(); });
+        if (pending.empty()) {
+            return;
+        }
+        Offload *job = pending.front();
+        pending.pop_front();
+
+        lock.unlock();
+        job->run();
+        lock.lock();
+
+        finished.push_back(job);
+        uint64_t one = 1;
+        if (write(fd, &one, sizeof(one)) != sizeof(one)) {
+            cerr << "DiskWorker: eventfd write failed" << endl;
+        }
+    }
+}
+
+void DiskWorker::resumeFinished() {
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+        return;
+    }
+    vector<Offload *> done;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done.swap(finished);
+    }
+    for (Offload *job : done) {
+        job->resume();
+    }
+}
+
+/* One socket and the exchange waiting on it */
+struct Flow {
+    C150DgmSocket *sock;
+    size_t packetCount;         /* Next packet number in this flow's sequence */
+    Exchange *waiting;
+};
+
+/* Send a packet on a flow and wait for its reply: the ACK of a FILE
+   packet, or a control message with the expected opcode and file id */
+class Exchange {
+    EventLoop &loop;
+    Flow &flow;
+    const Packet &request;
+    uint8_t expectedOpcode;     /* 0 for the ACK of a FILE packet */
+    uint32_t fileId;
+    Packet &response;
+    int maxTries;
+    int tries;
+    uint64_t id;
+    bool answered;
+    std::coroutine_handle<> waiter;
+
+ public:
+    Exchange(EventLoop &eventLoop, Flow &exchangeFlow, const Packet &packet, uint8_t opcode,
+             uint32_t expectedFileId, Packet &reply, int attempts)
+        : loop(eventLoop), flow(exchangeFlow), request(packet), expectedOpcode(opcode),
+          fileId(expectedFileId), response(reply), maxTries(attempts), tries(0), id(0),
+          answered(false) {}
+
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> coroutine);
+    bool await_resume() { return answered; }
+
+    bool matches(const Packet &packet) const {
+        if (expectedOpcode == 0) {
+            return packet.isFile && packet.packetNum == request.packetNum;
+        }
+        ControlMessage message;
+        return parseControlMessage(packet, message) && message.opcode == expectedOpcode &&
+               message.fileId == fileId;
+    }
+
+    void onPacket(const Packet &packet);
+    void onTimeout();
+
+ private:
+    void send();
+    void finish();
+};
+
+class EventLoop {
+    DiskWorker diskWorker;
+    TimerWheel timers;
+    unordered_map<uint64_t, Exchange *> exchanges;   /* Armed exchanges by timer id */
+    uint64_t nextId;
+    vector<Flow *> flows;
+    vector<Task<bool>> tasks;
+
+ public:
+    int timeoutMs;              /* Before an unanswered packet is sent again */
+
+    EventLoop(int resendMs) : nextId(1), timeoutMs(resendMs) {}
+
+    void addFlow(Flow &flow) { flows.push_back(&flow); }
+
+    /* Run task alongside the others; run() returns once all have finished */
+    void spawn(Task<bool> &&task) {
+        tasks.push_back(std::move(task));
+        tasks.back().start();
+    }
+
+    uint64_t arm(Exchange *exchange) {
+        uint64_t id = nextId++;
+        exchanges[id] = exchange;
+        return id;
+    }
+
+    void disarm(uint64_t id) { exchanges.erase(id); }
+
+    void schedule(uint64_t id) { timers.add(id, timeoutMs); }
+
+    /* Await this to run job off the loop's thread */
+    Offload offload(std::function<void()> job) { return Offload(diskWorker, std::move(job)); }
+
+    void run() {
+        vector<struct pollfd> fds;
+        while (!allDone()) {
+            /* The last entry is the disk worker's */
+            fds.resize(flows.size() + 1);
+            for (size_t i = 0; i < fds.size(); i++) {
+                fds[i].fd = (i < flows.size()) ? flows[i]->sock->getSocketFd() : diskWorker.getFd();
+                fds[i].events = POLLIN;
+                fds[i].revents = 0;
+            }
+
+            if (poll(fds.data(), fds.size(), timers.empty() ? -1 : 1) > 0) {
+                for (size_t i = 0; i < flows.size(); i++) {
+                    if (fds[i].revents != 0) {
+                        receive(*flows[i]);
+                    }
+                }
+                if (fds[flows.size()].revents != 0) {
+                    diskWorker.resumeFinished();
+                }
+            }
+
+            timers.advance([this](uint64_t id) {
+                auto found = exchanges.find(id);
+                if (found != exchanges.end()) {
+                    found->second->onTimeout();
+                }
+            });
+        }
+
+        /* Pass on anything a task threw, such as a socket error */
+        for (Task<bool> &task : tasks) {
+            task.result();
+        }
+    }
+
+ private:
+    bool allDone() const {
+        for (const Task<bool> &task : tasks) {
+            if (!task.done()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /* Hand one datagram to the flow's exchange. A read that comes up empty,
+        say a datagram the nasty socket dropped, just times out */
+    void receive(Flow &flow) {
+        Packet packet;
+        try {
+            packet = readPacket(flow.sock);
+        } catch (C150NetworkException&) {
+            return;
+        } catch (C150Exception& e) {
+            cerr << "Error: " << e.formattedExplanation() << endl;
+            return;
+        }
+        if (flow.waiting != nullptr) {
+            flow.waiting->onPacket(packet);
+        }
+    }
+};
+
+void Exchange::await_suspend(std::coroutine_handle<> coroutine) {
+    waiter = coroutine;
+    flow.waiting = this;
+    id = loop.arm(this);
+    send();
+}
+
+void Exchange::send() {
+    tries++;
+    writePacket(flow.sock, request);
+    loop.schedule(id);
+}
+
+/* Like the blocking loops, a reply to something else means this packet
+    was probably lost, so send it again now; the old deadline lapses */
+void Exchange::onPacket(const Packet &packet) {
+    if (matches(packet)) {
+        response = packet;
+        answered = true;
+        finish();
+    } else if (tries < maxTries) {
+        loop.disarm(id);
+        id = loop.arm(this);
+        send();
+    }
+}
+
+void Exchange::onTimeout() {
+    if (tries >= maxTries) {
+        finish();
+    } else {
+        send();
+    }
+}
+
+/* Resuming may start the flow's next exchange, so let go of this one first */
+void Exchange::finish() {
+    flow.waiting = nullptr;
+    loop.disarm(id);
+    waiter.resume();
+}
+
+#endif
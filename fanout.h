@@ -0,0 +1,347 @@
+#ifndef __FANOUT_H_INCLUDED__
+#define __FANOUT_H_INCLUDED__
+
+/* One-to-many transfer over UDP multicast. The client multicasts each file
+   once to a group that every fileserver has joined, then POLLs; servers
+   answer with NACKs for the packet ranges they are missing, after a random
+   backoff and only for ranges no other server has already NACKed, and the
+   client multicasts the union of the requested ranges as repairs. Each
+   server then runs its own end-to-end check.
+
+   Every message, including the servers' replies, goes to the group, so
+   servers hear each other's NACKs. Replies end with the uint32 id the
+   server picked at startup.
+
+   FILE packets in fan-out mode:
+      packetNum = fileId of the attempt, totalPackets in the header unused,
+      packetData = uint32 index | uint32 totalPackets (name + data packets) |
+                   uint8 nameFragments | name fragment or file bytes
+   The first nameFragments indexes carry the name, the rest the file.
+
+   The client paces its writes, fanoutBurstPackets at a time, so that a
+   large file does not overrun the servers' receive buffers in one burst. */
+
+#include "fileutils.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+using namespace C150NETWORK;
+
+const uint16_t defaultFanoutPort = 41118;
+const size_t fanoutHeaderLength = 2 * sizeof(uint32_t) + sizeof(uint8_t);
+const size_t fanoutPayloadLength = sizeof(Packet::packetData) - fanoutHeaderLength;
+const int nackBackoffMs = 20;                   /* Servers wait up to this long before NACKing */
+const int pollWindowMs = 2 * nackBackoffMs + 10;  /* Client collects replies this long per round */
+const int fanoutReceiveBuffer = 4 << 20;
+const size_t fanoutBurstPackets = 256;          /* Written back to back, well inside fanoutReceiveBuffer */
+const int fanoutBurstGapUs = 1000;              /* Pause between bursts */
+
+/* NACK payload: ranges of missing packet indexes, then the server id */
+struct PacketRange {
+    uint32_t first;
+    uint32_t count;
+};
+const size_t maxNackRanges = (sizeof(Packet::packetData) - controlHeaderLength - sizeof(uint32_t)) / (2 * sizeof(uint32_t));
+
+/* POLL and CHECK name the servers they are addressed to */
+const size_t maxFanoutServers = (sizeof(Packet::packetData) - controlHeaderLength - sizeof(uint32_t)) / sizeof(uint32_t);
+
+struct MulticastAddress {
+    string group;
+    uint16_t port;
+    string interface;   /* Local address to send and join on; empty for the default */
+};
+
+/* Parse group[:port][@interface], e.g. 239.255.0.117:41118@127.0.0.1 */
+bool parseMulticastAddress(const string &arg, MulticastAddress &address);
+
+/* A UDP socket joined to a multicast group. Received packets are dropped
+   at random according to the network nastiness, independently at each
+   member, so repair can be exercised on a loopback group. */
+class MulticastSocket {
+    int fd;
+    struct sockaddr_in groupAddr;
+    double dropRate;
+    unsigned int seed;
+
+ public:
+    MulticastSocket(const MulticastAddress &address, int networkNastiness);
+    ~MulticastSocket();
+
+    void write(const Packet &packet);
+
+    /* Wait up to timeoutMs for a packet; false if none arrived */
+    bool read(Packet &packet, int timeoutMs);
+};
+
+/* Writes a run of packets fanoutBurstPackets at a time */
+class FanoutPacer {
+    MulticastSocket &sock;
+    size_t inBurst;
+
+ public:
+    FanoutPacer(MulticastSocket &sock) : sock(sock), inBurst(0) {}
+
+    void write(const Packet &packet);
+};
+
+Packet createFanoutPacket(uint32_t fileId, uint32_t totalPackets, uint32_t index,
+                          uint8_t nameFragments, const char *data, size_t length);
+
+bool parseFanoutPacket(const Packet &packet, uint32_t &index, uint32_t &totalPackets, uint8_t &nameFragments,
+                       const char *&data, size_t &length);
+
+/* Add the ranges in a NACK payload to marked, ignoring indexes past its end */
+void markNackedRanges(const ControlMessage &message, vector<bool> &marked);
+
+void appendServerId(Packet &packet, uint32_t serverId);
+
+/* Remove the trailing server id from a reply */
+bool takeServerId(ControlMessage &message, uint32_t &serverId);
+
+bool listsServer(const char *ids, size_t length, uint32_t serverId);
+
+/* Runs of false in received, as ranges */
+void missingRanges(const vector<bool> &received, vector<PacketRange> &ranges);
+
+int64_t fanoutNowMillis();
+
+bool parseMulticastAddress(const string &arg, MulticastAddress &address) {
+    string rest = arg;
+    address.interface.clear();
+    address.port = defaultFanoutPort;
+
+    size_t at = rest.find('@');
+    if (at != string::npos) {
+        address.interface = rest.substr(at + 1);
+        rest = rest.substr(0, at);
+    }
+    size_t colon = rest.find(':');
+    if (colon != string::npos) {
+        int port = atoi(rest.c_str() + colon + 1);
+        if (port <= 0 || port > 65535) {
+            return false;
+        }
+        address.port = port;
+        rest = rest.substr(0, colon);
+    }
+    address.group = rest;
+
+    struct in_addr addr;
+    if (inet_pton(AF_INET, address.group.c_str(), &addr) != 1 || !IN_MULTICAST(ntohl(addr.s_addr))) {
+        return false;
+    }
+    return address.interface.empty() || inet_pton(AF_INET, address.interface.c_str(), &addr) == 1;
+}
+
+MulticastSocket::MulticastSocket(const MulticastAddress &address, int networkNastiness)
+    : fd(-1), dropRate(min(0.05 * networkNastiness, 0.3)),
+      seed((unsigned int)getpid() ^ (unsigned int)fanoutNowMillis())
+{
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        throw C150NetworkException("Cannot create multicast socket");
+    }
+
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &fanoutReceiveBuffer, sizeof(fanoutReceiveBuffer));
+
+    memset(&groupAddr, 0, sizeof(groupAddr));
+    groupAddr.sin_family = AF_INET;
+    groupAddr.sin_port = htons(address.port);
+    inet_pton(AF_INET, address.group.c_str(), &groupAddr.sin_addr);
+
+    struct sockaddr_in bindAddr = groupAddr;
+    bindAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(fd, (struct sockaddr *)&bindAddr, sizeof(bindAddr)) != 0) {
+        close(fd);
+        throw C150NetworkException("Cannot bind multicast port " + to_string(address.port));
+    }
+
+    struct ip_mreq membership;
+    membership.imr_multiaddr = groupAddr.sin_addr;
+    membership.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (!address.interface.empty()) {
+        inet_pton(AF_INET, address.interface.c_str(), &membership.imr_interface);
+        setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &membership.imr_interface, sizeof(membership.imr_interface));
+    }
+    if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) != 0) {
+        close(fd);
+        throw C150NetworkException("Cannot join multicast group " + address.group);
+    }
+
+    /* Members on the same host, loopback tests included, must see each other */
+    unsigned char loop = 1;
+    unsigned char ttl = 1;
+    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+}
+
+MulticastSocket::~MulticastSocket() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+void MulticastSocket::write(const Packet &packet) {
+    char buffer[maxPacketWireSize];
+    size_t length = serializePacket(packet, buffer);
+
+    if (packetTrace != nullptr) {
+        packetTrace->record(TRACE_SEND, buffer, length);
+    }
+
+    /* A full send buffer loses the packet, which repair covers like any other loss */
+    sendto(fd, buffer, length, 0, (struct sockaddr *)&groupAddr, sizeof(groupAddr));
+}
+
+bool MulticastSocket::read(Packet &packet, int timeoutMs) {
+    int64_t deadline = fanoutNowMillis() + timeoutMs;
+    char buffer[maxPacketWireSize];
+
+    while (true) {
+        int wait = max<int64_t>(0, deadline - fanoutNowMillis());
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, wait) <= 0) {
+            if (packetTrace != nullptr) {
+                packetTrace->record(TRACE_TIMEOUT, buffer, 0);
+            }
+            return false;
+        }
+
+        ssize_t readlen = recv(fd, buffer, sizeof(buffer), 0);
+        if (readlen <= 0) {
+            continue;
+        }
+        if (dropRate > 0 && rand_r(&seed) < dropRate * RAND_MAX) {
+            continue;
+        }
+        if (packetTrace != nullptr) {
+            packetTrace->record(TRACE_RECV, buffer, readlen);
+        }
+
+        try {
+            packet = parsePacket(buffer, readlen);
+            return true;
+        } catch (C150Exception &e) {
+            continue;   /* Not one of ours, or truncated */
+        }
+    }
+}
+
+void FanoutPacer::write(const Packet &packet) {
+    if (inBurst == fanoutBurstPackets) {
+        usleep(fanoutBurstGapUs);
+        inBurst = 0;
+    }
+    sock.write(packet);
+    inBurst++;
+}
+
+Packet createFanoutPacket(uint32_t fileId, uint32_t totalPackets, uint32_t index,
+                          uint8_t nameFragments, const char *data, size_t length) {
+    Packet packet;
+    packet.isFile = true;
+    packet.packetNum = fileId;
+    packet.totalPackets = 0;
+    packet.dataSize = 0;
+
+    uint32_t net_index = htonl(index);
+    uint32_t net_totalPackets = htonl(totalPackets);
+    appendToPacket(packet, &net_index, sizeof(net_index));
+    appendToPacket(packet, &net_totalPackets, sizeof(net_totalPackets));
+    appendToPacket(packet, &nameFragments, sizeof(nameFragments));
+    appendToPacket(packet, data, length);
+    return packet;
+}
+
+bool parseFanoutPacket(const Packet &packet, uint32_t &index, uint32_t &totalPackets, uint8_t &nameFragments,
+                       const char *&data, size_t &length) {
+    if (!packet.isFile || packet.dataSize < fanoutHeaderLength) {
+        return false;
+    }
+
+    uint32_t net_index;
+    uint32_t net_totalPackets;
+    memcpy(&net_index, packet.packetData, sizeof(net_index));
+    memcpy(&net_totalPackets, packet.packetData + sizeof(net_index), sizeof(net_totalPackets));
+    index = ntohl(net_index);
+    totalPackets = ntohl(net_totalPackets);
+    nameFragments = (uint8_t)packet.packetData[sizeof(net_index) + sizeof(net_totalPackets)];
+    data = packet.packetData + fanoutHeaderLength;
+    length = packet.dataSize - fanoutHeaderLength;
+    return index < totalPackets && nameFragments > 0 && nameFragments <= totalPackets;
+}
+
+void markNackedRanges(const ControlMessage &message, vector<bool> &marked) {
+    for (size_t offset = 0; offset + 2 * sizeof(uint32_t) <= message.payloadLength; offset += 2 * sizeof(uint32_t)) {
+        uint32_t net_first;
+        uint32_t net_count;
+        memcpy(&net_first, message.payload + offset, sizeof(net_first));
+        memcpy(&net_count, message.payload + offset + sizeof(net_first), sizeof(net_count));
+        size_t first = ntohl(net_first);
+        size_t last = min<size_t>(first + ntohl(net_count), marked.size());
+        for (size_t i = first; i < last; i++) {
+            marked[i] = true;
+        }
+    }
+}
+
+void appendServerId(Packet &packet, uint32_t serverId) {
+    uint32_t net_serverId = htonl(serverId);
+    appendToPacket(packet, &net_serverId, sizeof(net_serverId));
+}
+
+bool takeServerId(ControlMessage &message, uint32_t &serverId) {
+    size_t fixed = (message.digest != nullptr) ? digestLength : 0;
+    if (message.payloadLength < fixed + sizeof(uint32_t)) {
+        return false;
+    }
+
+    uint32_t net_serverId;
+    message.payloadLength -= sizeof(net_serverId);
+    memcpy(&net_serverId, message.payload + message.payloadLength, sizeof(net_serverId));
+    serverId = ntohl(net_serverId);
+    return true;
+}
+
+bool listsServer(const char *ids, size_t length, uint32_t serverId) {
+    for (size_t offset = 0; offset + sizeof(uint32_t) <= length; offset += sizeof(uint32_t)) {
+        uint32_t net_id;
+        memcpy(&net_id, ids + offset, sizeof(net_id));
+        if (ntohl(net_id) == serverId) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void missingRanges(const vector<bool> &received, vector<PacketRange> &ranges) {
+    ranges.clear();
+    size_t i = 0;
+    while (i < received.size()) {
+        if (received[i]) {
+            i++;
+            continue;
+        }
+        size_t first = i;
+        while (i < received.size() && !received[i]) {
+            i++;
+        }
+        ranges.push_back({(uint32_t)first, (uint32_t)(i - first)});
+    }
+}
+
+int64_t fanoutNowMillis() {
+    return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#endif
@@ -0,0 +1,396 @@
+#ifndef __FANOUTSERVER_H_INCLUDED__
+#define __FANOUTSERVER_H_INCLUDED__
+
+/* The server side of fan-out mode (see fanout.h). Files are gathered in
+   memory until every packet has arrived. The first POLL that names this
+   server then has it written to a .TMP file, which is checked and renamed
+   as in the unicast server; a retry aimed at other servers is dropped
+   without touching the disk. A file whose name cannot be written is
+   refused: it reports DONE, a digest of zeros and a failed check, and the
+   server carries on. */
+
+#include "fanout.h"
+#include "serverutils.h"
+#include <map>
+
+using namespace C150NETWORK;
+
+struct FanoutFile {
+    uint32_t totalPackets;
+    uint8_t nameFragments;      /* 0 until a FILE packet for the attempt has arrived */
+    vector<bool> received;
+    size_t receivedCount;
+    vector<string> nameParts;
+    PooledBuffer data;          /* Room for every data packet, from the shared pool */
+    size_t dataLength;
+    string fileName;
+    string targetName;          /* Set once the file is written */
+    bool refused;               /* Its name could not be written; it is never checked */
+    bool hashed;
+    unsigned char digest[digestLength];
+    int64_t nackDue;            /* When to send a NACK, or -1 */
+    vector<bool> heard;         /* Indexes other servers have NACKed since the POLL */
+};
+
+struct FanoutServer {
+    uint32_t serverId;
+    string targetDir;
+    int fileNastiness;
+    map<uint32_t, FanoutFile> files;
+    map<uint32_t, uint8_t> logged;  /* Status of each fileId whose RESULT was applied */
+    unsigned int seed;
+    size_t nacksSent;
+    size_t nacksSuppressed;
+    bool finishReported;            /* Counts printed at FINISHED, once per run of the client */
+};
+
+/* Join the group and serve fan-out transfers until killed */
+void runFanoutServer(MulticastSocket &sock, const string &targetDir, int fileNastiness);
+
+void handleFanoutData(FanoutServer &server, Packet &incomingPacket);
+
+void handleFanoutPoll(MulticastSocket &sock, FanoutServer &server, ControlMessage &message);
+
+void handleFanoutNack(FanoutServer &server, ControlMessage &message);
+
+void handleFanoutCheck(MulticastSocket &sock, FanoutServer &server, ControlMessage &message);
+
+void handleFanoutResult(MulticastSocket &sock, FanoutServer &server, ControlMessage &message);
+
+void sendDueNacks(MulticastSocket &sock, FanoutServer &server);
+
+void runFanoutServer(MulticastSocket &sock, const string &targetDir, int fileNastiness)
+{
+    FanoutServer server;
+    server.seed = (unsigned int)getpid() ^ (unsigned int)time(nullptr);
+    server.serverId = 0;
+    while (server.serverId == 0) {
+        server.serverId = ((uint32_t)rand_r(&server.seed) << 16) ^ (uint32_t)rand_r(&server.seed);
+    }
+    server.targetDir = targetDir;
+    server.fileNastiness = fileNastiness;
+    server.nacksSent = 0;
+    server.nacksSuppressed = 0;
+    server.finishReported = false;
+
+    printf("Fan-out server %08x ready\n", server.serverId);
+    fflush(stdout);
+
+    while (1) {
+        Packet incomingPacket;
+        if (sock.read(incomingPacket, nackBackoffMs / 4)) {
+            if (incomingPacket.isFile) {
+                handleFanoutData(server, incomingPacket);
+            } else {
+                ControlMessage message;
+                if (parseControlMessage(incomingPacket, message)) {
+                    switch (message.opcode) {
+                        case CTRL_HELLO:
+                        case CTRL_FINISHED:
+                            if (message.payloadLength == 0) {
+                                Packet reply = createControlPacket(message.opcode, message.fileId);
+                                appendServerId(reply, server.serverId);
+                                sock.write(reply);
+                            }
+                            if (message.opcode == CTRL_FINISHED && message.payloadLength == 0 && !server.finishReported) {
+                                server.finishReported = true;
+                                cout << "Fan-out: " << server.nacksSent << " NACKs sent, "
+                                     << server.nacksSuppressed << " suppressed" << endl;
+                                cout << bufferPoolSummary() << endl;
+                                dumpSpans();
+                            }
+                            break;
+                        case CTRL_POLL:
+                            handleFanoutPoll(sock, server, message);
+                            break;
+                        case CTRL_NACK:
+                            handleFanoutNack(server, message);
+                            break;
+                        case CTRL_CHECK:
+                            handleFanoutCheck(sock, server, message);
+                            break;
+                        case CTRL_RESULT:
+                            handleFanoutResult(sock, server, message);
+                            break;
+                        default:
+                            break;  /* Other servers' replies */
+                    }
+                }
+                if (packetTrace != nullptr) {
+                    packetTrace->flush();
+                }
+            }
+        }
+        sendDueNacks(sock, server);
+    }
+}
+
+/* Look up or start the state for one attempt */
+FanoutFile &fanoutFile(FanoutServer &server, uint32_t fileId, uint32_t totalPackets)
+{
+    auto found = server.files.find(fileId);
+    if (found != server.files.end()) {
+        return found->second;
+    }
+
+    FanoutFile &file = server.files[fileId];
+    file.totalPackets = totalPackets;
+    file.nameFragments = 0;
+    file.received.assign(totalPackets, false);
+    file.receivedCount = 0;
+    file.dataLength = 0;
+    file.hashed = false;
+    file.refused = false;
+    file.nackDue = -1;
+    return file;
+}
+
+/* Once every packet is in, put the name together and write the .TMP file,
+    or mark the file refused if the name cannot be written */
+void writeFanoutFile(FanoutServer &server, FanoutFile &file)
+{
+    string &fileName = file.fileName;
+    for (const string &part : file.nameParts) {
+        fileName += part;
+    }
+
+    *GRADING << "File: " << fileName << " starting to receive file" << endl;
+    cout << "File: " << fileName << " starting to receive file" << endl;
+
+    file.refused = true;
+    if (!isSafeRelativeName(fileName)) {
+        cerr << "Refusing file name " << fileName << " outside the target directory" << endl;
+        file.data.release();
+        return;
+    }
+
+    if (!makeParentDirectories(server.targetDir, fileName)) {
+        cerr << "Error creating directories for " << fileName << " errno=" << strerror(errno) << endl;
+        file.data.release();
+        return;
+    }
+
+    string targetName = makeFileName(server.targetDir, fileName + ".TMP");
+    SpanScope span("writeFanoutFile", targetName);
+    NASTYFILE outputFile(server.fileNastiness);
+    if (outputFile.fopen(targetName.c_str(), "wb") == NULL) {
+        cerr << "Error opening input file " << targetName << " errno=" << strerror(errno) << endl;
+        file.data.release();
+        return;
+    }
+    file.refused = false;
+    file.targetName = targetName;
+    if (file.dataLength > 0 && outputFile.fwrite(file.data.data(), 1, file.dataLength) != file.dataLength) {
+        cerr << "Error writing file " << file.targetName << " errno=" << strerror(errno) << endl;
+        exit(16);
+    }
+    outputFile.fclose();
+
+    file.data.release();
+}
+
+/* Store one FILE packet of an attempt; late copies of finished attempts are ignored */
+void handleFanoutData(FanoutServer &server, Packet &incomingPacket)
+{
+    uint32_t index;
+    uint32_t totalPackets;
+    uint8_t nameFragments;
+    const char *data;
+    size_t length;
+    if (!parseFanoutPacket(incomingPacket, index, totalPackets, nameFragments, data, length) ||
+        server.logged.count(incomingPacket.packetNum) > 0) {
+        return;
+    }
+
+    server.finishReported = false;
+    FanoutFile &file = fanoutFile(server, incomingPacket.packetNum, totalPackets);
+    if (file.totalPackets != totalPackets || !file.targetName.empty() || file.refused || file.received[index]) {
+        return;
+    }
+
+    if (file.nameFragments == 0) {
+        file.nameFragments = nameFragments;
+        file.nameParts.assign(nameFragments, "");
+        file.data = sharedBufferPool().acquire((size_t)(file.totalPackets - nameFragments) * fanoutPayloadLength);
+    }
+
+    if (index < file.nameFragments) {
+        file.nameParts[index].assign(data, length);
+    } else {
+        size_t offset = (size_t)(index - file.nameFragments) * fanoutPayloadLength;
+        if (length > fanoutPayloadLength) {
+            return;
+        }
+        memcpy(file.data.data() + offset, data, length);
+        if (index == file.totalPackets - 1) {
+            file.dataLength = offset + length;
+        }
+    }
+    file.received[index] = true;
+    file.receivedCount++;
+
+}
+
+/* POLL: uint32 totalPackets | ids of the servers taking part in the attempt.
+    A complete file is reported DONE at once; otherwise a NACK is scheduled
+    after a random backoff so that other servers' NACKs can suppress it */
+void handleFanoutPoll(MulticastSocket &sock, FanoutServer &server, ControlMessage &message)
+{
+    uint32_t net_totalPackets;
+    if (message.payloadLength < sizeof(net_totalPackets)) {
+        return;
+    }
+    memcpy(&net_totalPackets, message.payload, sizeof(net_totalPackets));
+    uint32_t totalPackets = ntohl(net_totalPackets);
+
+    if (!listsServer(message.payload + sizeof(net_totalPackets),
+                     message.payloadLength - sizeof(net_totalPackets), server.serverId)) {
+        server.files.erase(message.fileId);
+        return;
+    }
+
+    /* The client has moved on from any other attempt still being gathered */
+    for (auto it = server.files.begin(); it != server.files.end(); ) {
+        if (it->first != message.fileId && it->second.targetName.empty()) {
+            it = server.files.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    if (server.logged.count(message.fileId) > 0 || totalPackets == 0) {
+        return;
+    }
+
+    FanoutFile &file = fanoutFile(server, message.fileId, totalPackets);
+    if (file.targetName.empty() && !file.refused && file.receivedCount == file.totalPackets) {
+        writeFanoutFile(server, file);
+    }
+    if (!file.targetName.empty() || file.refused) {
+        Packet donePacket = createControlPacket(CTRL_DONE, message.fileId);
+        appendServerId(donePacket, server.serverId);
+        sock.write(donePacket);
+    } else if (file.nackDue < 0) {
+        file.nackDue = fanoutNowMillis() + rand_r(&server.seed) % nackBackoffMs;
+        file.heard.assign(file.totalPackets, false);
+    }
+}
+
+/* Another server's NACK: its ranges will be repaired for everyone */
+void handleFanoutNack(FanoutServer &server, ControlMessage &message)
+{
+    uint32_t serverId;
+    if (!takeServerId(message, serverId) || serverId == server.serverId) {
+        return;
+    }
+
+    auto found = server.files.find(message.fileId);
+    if (found == server.files.end() || found->second.nackDue < 0) {
+        return;
+    }
+    markNackedRanges(message, found->second.heard);
+}
+
+/* NACK whatever is still missing and was not NACKed by another server */
+void sendDueNacks(MulticastSocket &sock, FanoutServer &server)
+{
+    int64_t now = fanoutNowMillis();
+    for (auto &entry : server.files) {
+        FanoutFile &file = entry.second;
+        if (file.nackDue < 0 || now < file.nackDue) {
+            continue;
+        }
+        file.nackDue = -1;
+
+        vector<bool> covered(file.totalPackets);
+        for (size_t i = 0; i < covered.size(); i++) {
+            covered[i] = file.received[i] || file.heard[i];
+        }
+        vector<PacketRange> ranges;
+        missingRanges(covered, ranges);
+        if (ranges.empty()) {
+            server.nacksSuppressed++;
+            continue;
+        }
+
+        /* Whatever does not fit is asked for again at the next POLL */
+        Packet nackPacket = createControlPacket(CTRL_NACK, entry.first);
+        for (size_t i = 0; i < ranges.size() && i < maxNackRanges; i++) {
+            uint32_t net_first = htonl(ranges[i].first);
+            uint32_t net_count = htonl(ranges[i].count);
+            appendToPacket(nackPacket, &net_first, sizeof(net_first));
+            appendToPacket(nackPacket, &net_count, sizeof(net_count));
+        }
+        appendServerId(nackPacket, server.serverId);
+        sock.write(nackPacket);
+        server.nacksSent++;
+    }
+}
+
+/* CHECK: ids of the servers that should answer with the digest of their copy */
+void handleFanoutCheck(MulticastSocket &sock, FanoutServer &server, ControlMessage &message)
+{
+    if (!listsServer(message.payload, message.payloadLength, server.serverId)) {
+        return;
+    }
+
+    auto found = server.files.find(message.fileId);
+    if (found == server.files.end() || (found->second.targetName.empty() && !found->second.refused)) {
+        return;
+    }
+    FanoutFile &file = found->second;
+
+    if (!file.hashed) {
+        if (file.refused) {
+            memset(file.digest, 0, digestLength);
+        } else {
+            computeHash(file.targetName, server.fileNastiness, file.digest);
+        }
+        file.hashed = true;
+    }
+
+    Packet hashPacket = createControlPacket(CTRL_HASH, message.fileId, CTRL_FAIL, file.digest);
+    appendServerId(hashPacket, server.serverId);
+    sock.write(hashPacket);
+}
+
+/* RESULT: status for the one server named; renamed on a pass as in handleResult */
+void handleFanoutResult(MulticastSocket &sock, FanoutServer &server, ControlMessage &message)
+{
+    uint32_t serverId;
+    if (!takeServerId(message, serverId) || serverId != server.serverId) {
+        return;
+    }
+
+    auto found = server.files.find(message.fileId);
+    if (server.logged.count(message.fileId) == 0 && found != server.files.end() &&
+        (!found->second.targetName.empty() || found->second.refused)) {
+        const string &targetName = found->second.targetName;
+        const string &fileName = found->second.fileName;
+
+        bool passed = (message.status == CTRL_PASS && !found->second.refused);
+        if (passed) {
+            string finalName = makeFileName(server.targetDir, fileName);
+            SpanScope span("rename", finalName);
+            if (rename(targetName.c_str(), finalName.c_str()) != 0) {
+                cout << "ERROR with RENAME" << endl;
+            }
+        }
+
+        *GRADING << "File: " << fileName << " end-to-end check " << (passed ? "succeeded" : "failed") << endl;
+        cout << "File: " << fileName << " end-to-end check " << (passed ? "succeeded" : "failed") << endl;
+
+        server.logged[message.fileId] = passed ? CTRL_PASS : CTRL_FAIL;
+        server.files.erase(found);
+    }
+
+    auto logged = server.logged.find(message.fileId);
+    if (logged == server.logged.end()) {
+        return;
+    }
+    Packet logPacket = createControlPacket(CTRL_LOG, message.fileId, logged->second);
+    appendServerId(logPacket, server.serverId);
+    sock.write(logPacket);
+}
+
+#endif
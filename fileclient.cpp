@@ -1,38 +1,143 @@
 #include "fileutils.h"
+#include "chunking.h"
+#include "sparse.h"
+#include "scheduler.h"
+#include "fanout.h"
+#include "eventloop.h"
+#include "manifest.h"
 #include "c150nastydgmsocket.h"
 #include "c150dgmsocket.h"
 #include "c150grading.h"
 #include <iostream>
 #include <fstream>
+#include <chrono>
+#include <functional>
+#include <thread>
 
 // Always use namespace C150NETWORK with COMP 150 IDS framework!
 using namespace C150NETWORK;
 
 /* Perform end-to-end check on a given file */
 bool checkFile(C150DgmSocket *sock, 
-              dirent *sourceFile,
+              const string &fileName,
               char *sourceDir,
+              uint32_t fileId,
               int attemptNumber,
               int fileNastiness);
 
-/* Send a file from source to destination */
+/* A socket with a sequence of packets of its own. Large files are striped
+    over these as well as the main socket */
+struct Stripe {
+    C150DgmSocket *sock;
+    size_t packetCount;     /* Next packet number in this socket's sequence */
+};
+
+/* Send a file from source to destination: 1 once sent, 0 if the file
+    could not be read, -1 if the server stopped answering */
 int sendFile(C150DgmSocket *sock,
-             const dirent *sourceFile,
+             const string &fileName,
              char *targetDir,
              int fileNastiness,
              size_t &packetCount,
+             vector<Stripe> &stripes,
+             uint32_t &fileId,
              int attemptNumber);
 
-/* Send a message packet until correct response from server is received */
+/* How a run of the file is sent */
+enum SegmentKind {
+    SEG_BYTES,      /* as file bytes */
+    SEG_REFS,       /* as references to chunks the server holds */
+    SEG_ZEROS       /* as a single zero-range record */
+};
+
+struct SendSegment {
+    SegmentKind kind;
+    size_t start;       /* Bytes/zeros: file offset. References: index of the first chunk */
+    size_t count;       /* Bytes/zeros: byte count. References: number of chunks */
+};
+
+/* Ask the server which of the file's chunks it already holds */
+bool queryChunks(C150DgmSocket *sock,
+                 uint32_t queryId,
+                 const vector<Chunk> &chunks,
+                 vector<bool> &known);
+
+/* Split the file into byte runs and chunk-reference runs. Zero-filled 
+    chunks stay as bytes so that they can become zero ranges instead */
+void planSegments(const char *buffer,
+                  size_t fileSize,
+                  const vector<Chunk> &chunks,
+                  const vector<bool> &known,
+                  vector<SendSegment> &segments);
+
+/* Replace long runs of zeros inside byte segments with zero-range segments */
+void elideZeroRuns(const char *buffer, vector<SendSegment> &segments);
+
+/* Number of packets a segment is sent in */
+size_t segmentPackets(const SendSegment &segment);
+
+/* Where in the file a segment starts, and how many of its bytes it covers */
+size_t segmentOffset(const SendSegment &segment, const vector<Chunk> &chunks);
+size_t segmentLength(const SendSegment &segment, const vector<Chunk> &chunks);
+
+/* Split segments into count stripes of about the same number of packets.
+    Chunk references stay in stripe 0, on the socket whose QUERY found them */
+void planStripes(const vector<SendSegment> &segments, const vector<Chunk> &chunks, size_t count,
+                 vector<vector<SendSegment>> &stripes);
+
+/* Packets sendSegments uses for segments, counting a DATA_SEEK before each
+    segment that does not follow on from the one before */
+size_t sequencePackets(const vector<SendSegment> &segments, const vector<Chunk> &chunks);
+
+/* Number of packets fileName is sent in */
+size_t namePackets(const string &fileName);
+
+/* Filename packet number fragment of a sequence of totalPackets packets */
+Packet namePacket(const string &fileName, uint8_t flags, size_t fragment, uint32_t totalPackets, size_t packetNum);
+
+/* The data packets for segments, one at a time, with a DATA_SEEK before
+    each segment that does not follow on from the one before */
+class SegmentPackets {
+    const char *buffer;
+    const vector<Chunk> &chunks;
+    const vector<SendSegment> &segments;
+    uint32_t totalPackets;
+    size_t segment;         /* Index of the segment being sent */
+    size_t done;            /* Bytes, zeros or references of it already sent */
+    size_t position;        /* File offset the server will write at next */
+
+ public:
+    SegmentPackets(const char *fileBuffer, const vector<Chunk> &fileChunks,
+                   const vector<SendSegment> &plan, uint32_t sequencePackets)
+        : buffer(fileBuffer), chunks(fileChunks), segments(plan), totalPackets(sequencePackets),
+          segment(0), done(0), position(0) {}
+
+    /* Build the next packet, numbered packetNum; false once all are built */
+    bool next(size_t packetNum, Packet &packet);
+};
+
+/* Send the filename packets that start a sequence of totalPackets packets */
+bool sendName(C150DgmSocket *sock, const string &fileName, uint8_t flags, uint32_t totalPackets, size_t &packetCount);
+
+/* Send segments as data packets, continuing a sequence started by sendName */
+bool sendSegments(C150DgmSocket *sock, const char *buffer, const vector<Chunk> &chunks,
+                  const vector<SendSegment> &segments, uint32_t totalPackets, size_t &packetCount);
+
+/* QUERY for chunks[first, first + count), and the HAVE bitmap that answers it */
+Packet queryPacket(uint32_t queryId, const vector<Chunk> &chunks, size_t first, size_t count);
+bool readHaveReply(const ControlMessage &response, size_t first, size_t count, vector<bool> &known);
+
+/* Send a control packet until the expected reply for fileId is received */
 bool sendMessageWithResponse(C150DgmSocket *sock,
-                             const string &message,
-                             const string &expectedCommand,
-                             const string &expectedFileName,
-                             string &responseMessage);
+                             const Packet &messagePacket,
+                             uint8_t expectedOpcode,
+                             uint32_t fileId,
+                             Packet &responsePacket,
+                             ControlMessage &response);
 
 
-/* Return a buffer containing the entire file passed in */
-char* readEntireFile(const string &filePath,
+/* Return a pooled buffer containing the entire file passed in */
+PooledBuffer readEntireFile(const string &filePath,
                      size_t &fileSize, 
                      int fileNastiness);
 
@@ -40,22 +145,146 @@ char* readEntireFile(const string &filePath,
 bool sendPacketWithAck(C150DgmSocket *sock, Packet &packet);
 
 /* Check that correct command line arguments are used */
-void parseCommandLineArguments(int argc,
-                               char *argv[],
+void parseCommandLineArguments(int &argc,
+                               char **&argv,
                                int &fileNastiness,
-                               int &networkNastiness);
+                               int &networkNastiness,
+                               string &traceFile,
+                               string &spanFile,
+                               SchedulePolicy &policy,
+                               vector<PriorityRule> &rules,
+                               size_t &fanoutServers,
+                               size_t &stripeCount,
+                               size_t &flowCount,
+                               string &hashCacheFile);
+
+/* Send the server a manifest of items, with digests from the hash cache
+    in hashCacheFile, and drop the items it already holds */
+void skipHeldFiles(C150DgmSocket *sock,
+                   char *sourceDir,
+                   int fileNastiness,
+                   const string &hashCacheFile,
+                   uint32_t manifestId,
+                   vector<TransferItem> &items);
+
+/* Send the MANIFEST packets, a window at a time, until each has its HOLD reply */
+bool exchangeManifest(C150DgmSocket *sock,
+                      uint32_t manifestId,
+                      const vector<Packet> &batches,
+                      const vector<size_t> &batchFirst,
+                      vector<bool> &held);
 
 /* Sends a message to the server confirming all files were sent */
-void sendFinalMessage(C150DgmSocket *sock);
+void sendFinalMessage(C150DgmSocket *sock, const vector<string> &failedFiles);
+
+/* Say that every file reached the server, or list those that did not */
+void printSendResult(const vector<string> &failedFiles);
 
-/* Send a file and perform an end-to-end check */
-void processFile(C150DgmSocket *sock, 
-                 dirent *sourceFile, 
+/* Send a file and perform an end-to-end check; false if no attempt passed */
+bool processFile(C150DgmSocket *sock, 
+                 const string &fileName, 
                  char *sourceDir, 
                  int fileNastiness, 
-                 size_t &packetCount);
+                 size_t &packetCount,
+                 vector<Stripe> &stripes,
+                 double &checkSeconds);
+
+/* Totals for a fan-out run */
+struct FanoutStats {
+    size_t packetsSent;     /* First transmissions */
+    size_t repairsSent;
+    size_t nacksReceived;
+};
+
+/* Fan-out: multicast HELLO until serverCount servers have answered */
+vector<uint32_t> discoverServers(MulticastSocket &sock, size_t serverCount);
+
+/* Fan-out: repeat the requests built for the servers still to answer until
+    each has sent an expectedOpcode reply for fileId. Servers silent for
+    fanoutSilenceMs are dropped from servers */
+void collectReplies(MulticastSocket &sock,
+                    const function<vector<Packet>(const vector<uint32_t> &)> &requests,
+                    uint8_t expectedOpcode,
+                    uint32_t fileId,
+                    vector<uint32_t> &servers,
+                    const function<void(uint32_t, ControlMessage &)> &onReply);
+
+/* Fan-out: multicast one attempt of a file, then POLL and repair until every server has it;
+    false if the file cannot be sent at all */
+bool fanoutSendFile(MulticastSocket &sock,
+                    const string &fileName,
+                    char *sourceDir,
+                    int fileNastiness,
+                    uint32_t fileId,
+                    int attemptNumber,
+                    vector<uint32_t> &servers,
+                    FanoutStats &stats);
+
+/* Fan-out: end-to-end check on each server; the ones that failed are left in failed */
+void fanoutCheckFile(MulticastSocket &sock,
+                     const string &fileName,
+                     char *sourceDir,
+                     uint32_t fileId,
+                     int attemptNumber,
+                     int fileNastiness,
+                     vector<uint32_t> &servers,
+                     vector<uint32_t> &failed);
+
+/* Fan-out: send a file to every server and retry on the ones whose check failed;
+    false unless every server ended up with a copy that passed */
+bool fanoutProcessFile(MulticastSocket &sock,
+                       const string &fileName,
+                       char *sourceDir,
+                       int fileNastiness,
+                       vector<uint32_t> &servers,
+                       uint32_t &nextFileId,
+                       FanoutStats &stats,
+                       double &checkSeconds);
+
+/* Fan-out: tell every server that all files were sent */
+void fanoutFinalMessage(MulticastSocket &sock, vector<uint32_t> &servers, const vector<string> &failedFiles);
+
+/* Print how far through the plan the transfer is */
+void printProgress(const TransferProgress &progress);
+
+/* Engine: the plan, shared by the flows that take files from it in turn */
+struct EngineWork {
+    const vector<TransferItem> &items;
+    size_t next;            /* Index of the next file to be taken */
+    TransferProgress &progress;
+    char *sourceDir;
+    int fileNastiness;
+    size_t filesSent;
+    vector<string> failedFiles;     /* Files that never passed their end-to-end check */
+    double checkSeconds;
+};
+
+/* Engine: send every file over flowCount flows of one event loop */
+void engineTransfer(C150DgmSocket *sock, char *serverName, int networkNastiness, size_t flowCount,
+                    EngineWork &work, size_t &packetCount);
+
+/* Engine: take files from the plan until none are left, then send FINISHED */
+Task<bool> engineRunFlow(EventLoop &loop, Flow &flow, EngineWork &work);
+
+/* Engine: processFile, sendFile, checkFile and queryChunks on a flow */
+Task<bool> engineProcessFile(EventLoop &loop, Flow &flow, string fileName, EngineWork &work);
+Task<bool> engineSendFile(EventLoop &loop, Flow &flow, string fileName, EngineWork &work,
+                          uint32_t &fileId, int attemptNumber);
+Task<bool> engineCheckFile(EventLoop &loop, Flow &flow, string fileName, EngineWork &work,
+                           uint32_t fileId, int attemptNumber);
+Task<bool> engineQueryChunks(EventLoop &loop, Flow &flow, uint32_t queryId,
+                             const vector<Chunk> &chunks, vector<bool> &known);
 
 const int maxPacketDataLength = 498;
+const int maxNameFragmentLength = maxPacketDataLength - nameHeaderLength;
+const int maxFileDataLength = maxPacketDataLength - 1;     /* Data packets lead with a DataKind byte */
+const size_t dedupMinFileSize = 2 * cdcAvgChunk;  /* Smaller files are not worth a QUERY round trip */
+const size_t maxQueryChunks = 65535;              /* QUERY indexes chunks with 16 bits */
+const size_t stripeMinFileSize = 1 << 20;         /* Smaller files go over the main socket alone */
+const size_t maxStripes = 64;
+const size_t maxFlows = 1024;
+const size_t manifestWindow = 32;       /* MANIFEST packets outstanding at once */
+const int engineReadTimeoutMs = 1;     /* The loop only reads readable sockets, unless nastiness drops the datagram */
 const int serverArg = 1;
 const int sourceArg = 4;
 const int networkNastinessArg = 2;
@@ -63,149 +292,249 @@ const int fileNastinessArg = 3;
 const int timeOut = 20;
 const int maxAttempts = 1000000; /* High number to account for computeHash() time */
 const int maxFileSendRetries = 15;
+const int fanoutSilenceMs = 30000;   /* Long enough for a server to hash a large file */
 
 int main(int argc, char *argv[]) {
     GRADEME(argc, argv);
     
     int fileNastiness;
     int networkNastiness;
-    parseCommandLineArguments(argc, argv, fileNastiness, networkNastiness);
+    string traceFile;
+    string spanFile;
+    SchedulePolicy policy = SCHEDULE_WALK;
+    vector<PriorityRule> rules;
+    size_t fanoutServers = 0;
+    size_t stripeCount = 1;
+    size_t flowCount = 0;
+    string hashCacheFile;
+    parseCommandLineArguments(argc, argv, fileNastiness, networkNastiness, traceFile, spanFile, policy, rules, fanoutServers,
+                              stripeCount, flowCount, hashCacheFile);
+
+    PacketTrace trace;
+    if (!traceFile.empty()) {
+        if (!trace.create(traceFile, TRACE_CLIENT)) {
+            fprintf(stderr, "Error creating trace file %s\n", traceFile.c_str());
+            exit(8);
+        }
+        packetTrace = &trace;
+    }
+    if (!spanFile.empty()) {
+        startSpanTrace(spanFile);
+    }
 
-    DIR *SRC;                 
-    struct dirent *sourceFile;
     checkDirectory(argv[sourceArg]);
-    SRC = opendir(argv[sourceArg]);
+    vector<TransferItem> items;
+    walkSourceTree(argv[sourceArg], "", items);
+    scheduleTransfers(items, policy, rules);
+    TransferProgress progress(items);
 
-    if (SRC == NULL) {
-        fprintf(stderr,"Error opening source directory %s\n", argv[sourceArg]);     
-        exit(8);
+    cout << "Plan: " << items.size() << " files, " << progress.getTotalBytes() << " bytes" << endl;
+    for (const TransferItem &item : items) {
+        cout << "  [" << item.priorityClass << "] " << item.path << " (" << item.size << " bytes)" << endl;
     }
 
     try {
-        C150DgmSocket *sock = new C150NastyDgmSocket(networkNastiness);
-        
-        sock->setServerName(argv[serverArg]);  
-        sock->turnOnTimeouts(timeOut); 
+        C150DgmSocket *sock = nullptr;
+        MulticastSocket *group = nullptr;
+        vector<uint32_t> servers;
+        vector<Stripe> stripes;
+        FanoutStats fanoutStats = {0, 0, 0};
+        uint32_t nextFileId = (uint32_t)time(nullptr) << 8;
+
+        if (fanoutServers > 0) {
+            MulticastAddress address;
+            if (!parseMulticastAddress(argv[serverArg], address)) {
+                fprintf(stderr, "%s is not a multicast group[:port][@ifaddr]\n", argv[serverArg]);
+                exit(1);
+            }
+            group = new MulticastSocket(address, networkNastiness);
+            servers = discoverServers(*group, fanoutServers);
+        } else {
+            sock = new C150NastyDgmSocket(networkNastiness);
+            sock->setServerName(argv[serverArg]);  
+            sock->turnOnTimeouts(timeOut); 
+
+            /* Each extra socket has its own port, so the server sees it as another client */
+            for (size_t i = 1; i < stripeCount; i++) {
+                Stripe stripe = { new C150NastyDgmSocket(networkNastiness), 0 };
+                stripe.sock->setServerName(argv[serverArg]);
+                stripe.sock->turnOnTimeouts(timeOut);
+                stripes.push_back(stripe);
+            }
+        }
 
         size_t packetCount = 0;
+        size_t filesSent = 0;
+        vector<string> failedFiles;     /* Files that never passed their end-to-end check */
+        double checkSeconds = 0; /* Time spent in end-to-end checks */
 
-        /* Process each file that is not a directory */
-        while ((sourceFile = readdir(SRC)) != NULL) { 
-            if ((strcmp(sourceFile->d_name, ".") == 0) || (strcmp(sourceFile->d_name, "..")  == 0 )) 
-                continue;
+        if (!hashCacheFile.empty()) {
+            skipHeldFiles(sock, argv[sourceArg], fileNastiness, hashCacheFile, packetCount, items);
+            progress = TransferProgress(items);
+        }
 
-            string sourceName = makeFileName(argv[sourceArg], sourceFile->d_name);
-            if (!isFile(sourceName)) {
-                continue;
+        /* Send each file in the scheduled order */
+        if (flowCount > 0) {
+            EngineWork work = {items, 0, progress, argv[sourceArg], fileNastiness, 0, {}, 0};
+            engineTransfer(sock, argv[serverArg], networkNastiness, flowCount, work, packetCount);
+            filesSent = work.filesSent;
+            failedFiles = work.failedFiles;
+            checkSeconds = work.checkSeconds;
+        } else {
+            for (const TransferItem &item : items) {
+                auto fileStart = chrono::steady_clock::now();
+                bool sent = (group == nullptr)
+                    ? processFile(sock, item.path, argv[sourceArg], fileNastiness, packetCount, stripes, checkSeconds)
+                    : fanoutProcessFile(*group, item.path, argv[sourceArg], fileNastiness, servers, nextFileId,
+                                        fanoutStats, checkSeconds);
+                if (sent) {
+                    filesSent++;
+                } else {
+                    failedFiles.push_back(item.path);
+                }
+
+                progress.fileDone(item.size, chrono::duration<double>(chrono::steady_clock::now() - fileStart).count());
+                printProgress(progress);
+            }
+        }
+
+        if (flowCount > 0) {
+            /* Each flow sent its own FINISHED */
+        } else if (group != nullptr) {
+            fanoutFinalMessage(*group, servers, failedFiles);
+            packetCount = fanoutStats.packetsSent + fanoutStats.repairsSent;
+            cout << "Fan-out: " << servers.size() << " servers, " << fanoutStats.packetsSent << " packets multicast, "
+                 << fanoutStats.repairsSent << " repairs for " << fanoutStats.nacksReceived << " NACKs" << endl;
+            delete group;
+        } else {
+            sendFinalMessage(sock, failedFiles); /* Tell server file sends are complete */
+            for (Stripe &stripe : stripes) {
+                packetCount += stripe.packetCount;
+                delete stripe.sock;
             }
-            processFile(sock, sourceFile, argv[sourceArg], fileNastiness, packetCount);
         }
+        cout << "Summary: " << filesSent << " files, " << packetCount << " packets, "
+             << checkSeconds << " s in end-to-end checks" << endl;
+        cout << bufferPoolSummary() << endl;
 
-        sendFinalMessage(sock); /* Tell server file sends are complete */
+        if (!failedFiles.empty()) {
+            exit(20);
+        }
     }
 
     catch (C150NetworkException& e) {
         cerr << argv[0] << ": caught C150NetworkException: " << e.formattedExplanation() << endl;
     }
-
-    closedir(SRC);
 }
 
-int sendFile(C150DgmSocket *sock, const dirent *sourceFile, char *sourceDir, int fileNastiness, size_t &packetCount, int attemptNumber) {
+int sendFile(C150DgmSocket *sock, const string &fileName, char *sourceDir, int fileNastiness, size_t &packetCount, vector<Stripe> &stripes, uint32_t &fileId, int attemptNumber) {
     cout << endl;
-    *GRADING << "File: " <<  sourceFile->d_name << ", beginning transmission, attempt " << attemptNumber << endl;
-    cout << "File: " <<  sourceFile->d_name << ", beginning transmission, attempt " << attemptNumber << endl;
+    *GRADING << "File: " <<  fileName << ", beginning transmission, attempt " << attemptNumber << endl;
+    cout << "File: " <<  fileName << ", beginning transmission, attempt " << attemptNumber << endl;
 
-    char *buffer = nullptr;
+    PooledBuffer file;
 
-    string fileName = sourceFile->d_name;
     string sourceDirName = sourceDir;
     string sourceName = makeFileName(sourceDirName, fileName);
     size_t fileSize = 0;
 
     try {
 
-        buffer = readEntireFile(sourceName, fileSize, fileNastiness);
-        int numPackets = ((fileSize + maxPacketDataLength - 1) / maxPacketDataLength) + 1;
+        file = readEntireFile(sourceName, fileSize, fileNastiness);
+        const char *buffer = file.data();
 
-        size_t bytesRead = 0;
-        size_t bytesRemaining = fileSize;
-
-        /* Attempt to send fileName to server */
-        Packet filenamePacket = createDataPacket(true, packetCount, numPackets, fileName.c_str(), fileName.size());
-        if (!sendPacketWithAck(sock, filenamePacket)) {
-            cerr << "Failed to send filename packet after maximum retries." << endl;
-            free(buffer);
-            return -1;
+        /* On a first attempt, leave out chunks the server already has. A retry 
+            sends every byte in case a stored chunk was the problem */
+        vector<Chunk> chunks;
+        vector<bool> known;
+        if (attemptNumber == 1 && fileSize >= dedupMinFileSize) {
+            chunkBuffer(buffer, fileSize, chunks);
+            if (chunks.size() > maxQueryChunks || !queryChunks(sock, packetCount, chunks, known)) {
+                chunks.clear();
+                known.clear();
+            }
         }
 
-        packetCount++;
+        vector<SendSegment> segments;
+        planSegments(buffer, fileSize, chunks, known, segments);
+        elideZeroRuns(buffer, segments);
 
-        /* Break the file down into packets, and send them to the server */
-        for (int i = 1; i < numPackets; i++) {
+        /* A large file is split over the extra sockets as well, each one a
+            sequence of its own; the main socket creates the .TMP first */
+        vector<vector<SendSegment>> stripePlans;
+        if (!stripes.empty() && fileSize >= stripeMinFileSize) {
+            planStripes(segments, chunks, stripes.size() + 1, stripePlans);
+        } else {
+            stripePlans.push_back(segments);
+        }
 
-            size_t packetBytes = (bytesRemaining >= maxPacketDataLength) ? maxPacketDataLength : bytesRemaining;
-            if (packetBytes > 498) {
-                throw new runtime_error("Oversized packetBytes");
-            }
+        uint32_t numPackets = namePackets(fileName) + sequencePackets(stripePlans[0], chunks);
+        fileId = packetCount + numPackets;
 
-            Packet dataPacket = createDataPacket(true, packetCount, numPackets, buffer + bytesRead, packetBytes);
+        if (!sendName(sock, fileName, 0, numPackets, packetCount)) {
+            cerr << "Failed to send filename packet after maximum retries." << endl;
+            return -1;
+        }
 
-            bytesRead += packetBytes;
-            bytesRemaining = fileSize - bytesRead;
-            
-            if (!sendPacketWithAck(sock, dataPacket)) {
-                cerr << "Failed to send data packet " << packetCount << " after maximum retries." << endl;
-                free(buffer);
-                return -1;
+        vector<thread> stripeThreads;
+        vector<char> stripeSent(stripePlans.size(), 1);
+        for (size_t i = 1; i < stripePlans.size(); i++) {
+            if (stripePlans[i].empty()) {
+                continue;
             }
+            stripeThreads.emplace_back([&, i]() {
+                spanThreadName("stripe");
+                Stripe &stripe = stripes[i - 1];
+                uint32_t stripePackets = namePackets(fileName) + sequencePackets(stripePlans[i], chunks);
+                stripeSent[i] = sendName(stripe.sock, fileName, NAME_STRIPE, stripePackets, stripe.packetCount) &&
+                                sendSegments(stripe.sock, buffer, chunks, stripePlans[i], stripePackets, stripe.packetCount);
+            });
+        }
 
-            packetCount++;
+        bool sent = sendSegments(sock, buffer, chunks, stripePlans[0], numPackets, packetCount);
+        for (thread &stripeThread : stripeThreads) {
+            stripeThread.join();
+        }
+
+        /* A stripe that did not get through fails the end-to-end check, and the file is sent again */
+        if (!sent || find(stripeSent.begin(), stripeSent.end(), 0) != stripeSent.end()) {
+            cerr << "Failed to send data packets after maximum retries." << endl;
+            return -1;
         }
-    
-        free(buffer);
         
+    } catch (runtime_error& e) {
+        cerr << "sendFile(): Error reading " << sourceName << ": " << e.what() << endl;
+        return 0;
     } catch (C150Exception& e) {
         cerr << "nastyfiletest:copyfile(): Caught C150Exception: " << e.formattedExplanation() << endl;
-        if (buffer != nullptr) {
-            free(buffer);
-        }
     }
 
-    *GRADING << "File: " << sourceFile->d_name << " transmission complete, waiting for end-to-end check, attempt " << attemptNumber << endl;
-    cout << "File: " << sourceFile->d_name << " transmission complete, waiting for end-to-end check, attempt " << attemptNumber << endl;
+    *GRADING << "File: " << fileName << " transmission complete, waiting for end-to-end check, attempt " << attemptNumber << endl;
+    cout << "File: " << fileName << " transmission complete, waiting for end-to-end check, attempt " << attemptNumber << endl;
     return 1;
 }
 
-bool checkFile(C150DgmSocket *sock, dirent *sourceFile, char *sourceDir, int attemptNumber, int fileNastiness)
+bool checkFile(C150DgmSocket *sock, const string &fileName, char *sourceDir, uint32_t fileId, int attemptNumber, int fileNastiness)
 {
-    string fileName = sourceFile->d_name;
-    string msgCheck = "CHECK:" + fileName + ",";
+    Packet responsePacket;
+    ControlMessage response;
 
     /* Send CHECK message and await for the server HASH */
-    string serverHashResponse;
-    if (!sendMessageWithResponse(sock, msgCheck, "HASH", fileName ,serverHashResponse)) {
+    Packet checkPacket = createControlPacket(CTRL_CHECK, fileId);
+    if (!sendMessageWithResponse(sock, checkPacket, CTRL_HASH, fileId, responsePacket, response)) {
         cerr << "Failed to receive HASH response after maximum attempts." << endl;
         return false;
     }
 
-    /* Break down the server HASH response */
-    string serverHash;
-    if (!parseResponse(serverHashResponse, "HASH" ,fileName, serverHash)) {
-        cerr << "Invalid HASH response or filename mismatch." << endl;
-        return false;
-    }
-
     /*Compute client hash and compare with server */
-    string clientHash = computeHash(makeFileName(sourceDir, fileName), fileNastiness);
+    unsigned char clientHash[digestLength];
+    computeHash(makeFileName(sourceDir, fileName), fileNastiness, clientHash);
 
-    bool filesMatch = (serverHash == clientHash);
-    string resultMessage = filesMatch ? ("RESULT:" + fileName + ",PASS")
-                                      : ("RESULT:" + fileName + ",FAIL");
+    bool filesMatch = (memcmp(response.digest, clientHash, digestLength) == 0);
 
     /* Send RESULT message and wait for LOG response */
-    string serverLogResponse;
-    if (!sendMessageWithResponse(sock, resultMessage, "LOG", fileName ,serverLogResponse)) {
+    Packet resultPacket = createControlPacket(CTRL_RESULT, fileId, filesMatch ? CTRL_PASS : CTRL_FAIL);
+    if (!sendMessageWithResponse(sock, resultPacket, CTRL_LOG, fileId, responsePacket, response)) {
         cerr << "Failed to receive LOG response after maximum attempts." << endl;
         return false;
     }
@@ -219,34 +548,312 @@ bool checkFile(C150DgmSocket *sock, dirent *sourceFile, char *sourceDir, int att
     return filesMatch;
 }
 
+bool queryChunks(C150DgmSocket *sock, uint32_t queryId, const vector<Chunk> &chunks, vector<bool> &known)
+{
+    known.assign(chunks.size(), false);
+    Packet responsePacket;
+    ControlMessage response;
+
+    for (size_t first = 0; first < chunks.size(); first += maxQueryEntries) {
+        size_t count = min(maxQueryEntries, chunks.size() - first);
+        Packet query = queryPacket(queryId, chunks, first, count);
+
+        /* A late reply to an earlier batch matches on opcode and id, so check its index too */
+        bool answered = false;
+        for (int attempts = 0; attempts < maxFileSendRetries && !answered; attempts++) {
+            if (!sendMessageWithResponse(sock, query, CTRL_HAVE, queryId, responsePacket, response)) {
+                return false;
+            }
+            answered = readHaveReply(response, first, count, known);
+        }
+        if (!answered) {
+            return false;
+        }
+    }
+    return true;
+}
+
+Packet queryPacket(uint32_t queryId, const vector<Chunk> &chunks, size_t first, size_t count)
+{
+    Packet packet = createControlPacket(CTRL_QUERY, queryId);
+    uint16_t net_first = htons(first);
+    appendToPacket(packet, &net_first, sizeof(net_first));
+    for (size_t i = first; i < first + count; i++) {
+        uint32_t net_length = htonl(chunks[i].length);
+        appendToPacket(packet, chunks[i].digest.bytes, digestLength);
+        appendToPacket(packet, &net_length, sizeof(net_length));
+    }
+    return packet;
+}
+
+bool readHaveReply(const ControlMessage &response, size_t first, size_t count, vector<bool> &known)
+{
+    uint16_t net_replyFirst;
+    uint16_t net_replyCount;
+    if (response.payloadLength < 2 * sizeof(uint16_t)) {
+        return false;
+    }
+    memcpy(&net_replyFirst, response.payload, sizeof(net_replyFirst));
+    memcpy(&net_replyCount, response.payload + sizeof(net_replyFirst), sizeof(net_replyCount));
+    if (ntohs(net_replyFirst) != first || ntohs(net_replyCount) != count ||
+        response.payloadLength < 2 * sizeof(uint16_t) + (count + 7) / 8) {
+        return false;
+    }
+
+    const unsigned char *bitmap = (const unsigned char *)response.payload + 2 * sizeof(uint16_t);
+    for (size_t i = 0; i < count; i++) {
+        known[first + i] = (bitmap[i / 8] >> (i % 8)) & 1;
+    }
+    return true;
+}
+
+void planSegments(const char *buffer, size_t fileSize, const vector<Chunk> &chunks, const vector<bool> &known, vector<SendSegment> &segments)
+{
+    segments.clear();
+    if (chunks.empty()) {
+        if (fileSize > 0) {
+            segments.push_back({SEG_BYTES, 0, fileSize});
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < chunks.size(); i++) {
+        bool useRef = known[i] && !isAllZero(buffer + chunks[i].offset, chunks[i].length);
+        SegmentKind kind = useRef ? SEG_REFS : SEG_BYTES;
+        SendSegment *last = segments.empty() ? nullptr : &segments.back();
+        if (last != nullptr && last->kind == kind) {
+            last->count += (kind == SEG_REFS) ? 1 : chunks[i].length;
+        } else if (kind == SEG_REFS) {
+            segments.push_back({SEG_REFS, i, 1});
+        } else {
+            segments.push_back({SEG_BYTES, chunks[i].offset, chunks[i].length});
+        }
+    }
+}
+
+void elideZeroRuns(const char *buffer, vector<SendSegment> &segments)
+{
+    vector<SendSegment> result;
+    vector<Extent> runs;
+
+    for (const SendSegment &segment : segments) {
+        if (segment.kind != SEG_BYTES) {
+            result.push_back(segment);
+            continue;
+        }
+
+        findZeroRuns(buffer, segment.start, segment.count, runs);
+        size_t pos = segment.start;
+        for (const Extent &run : runs) {
+            if (run.offset > pos) {
+                result.push_back({SEG_BYTES, pos, run.offset - pos});
+            }
+            result.push_back({SEG_ZEROS, run.offset, run.length});
+            pos = run.offset + run.length;
+        }
+        if (pos < segment.start + segment.count) {
+            result.push_back({SEG_BYTES, pos, segment.start + segment.count - pos});
+        }
+    }
+
+    segments.swap(result);
+}
+
+size_t segmentPackets(const SendSegment &segment)
+{
+    switch (segment.kind) {
+        case SEG_REFS:
+            return (segment.count + maxRefsPerPacket - 1) / maxRefsPerPacket;
+        case SEG_ZEROS:
+            return 1;
+        default:
+            return (segment.count + maxFileDataLength - 1) / maxFileDataLength;
+    }
+}
+
+size_t segmentOffset(const SendSegment &segment, const vector<Chunk> &chunks)
+{
+    return (segment.kind == SEG_REFS) ? chunks[segment.start].offset : segment.start;
+}
+
+size_t segmentLength(const SendSegment &segment, const vector<Chunk> &chunks)
+{
+    if (segment.kind != SEG_REFS) {
+        return segment.count;
+    }
+    const Chunk &last = chunks[segment.start + segment.count - 1];
+    return last.offset + last.length - chunks[segment.start].offset;
+}
+
+void planStripes(const vector<SendSegment> &segments, const vector<Chunk> &chunks, size_t count,
+                 vector<vector<SendSegment>> &stripes)
+{
+    stripes.assign(count, vector<SendSegment>());
+
+    size_t total = 0;
+    for (const SendSegment &segment : segments) {
+        if (segment.kind == SEG_REFS) {
+            stripes[0].push_back(segment);
+        } else {
+            total += segmentPackets(segment);
+        }
+    }
+    size_t perStripe = max<size_t>(1, (total + count - 1) / count);
+
+    /* Deal the rest out in file order, cutting byte runs at packet boundaries */
+    size_t stripe = 0;
+    size_t load = 0;
+    for (SendSegment segment : segments) {
+        if (segment.kind == SEG_REFS) {
+            continue;
+        }
+        while (true) {
+            if (load >= perStripe && stripe + 1 < count) {
+                stripe++;
+                load = 0;
+            }
+            size_t room = (stripe + 1 < count) ? (perStripe - load) * maxFileDataLength : SIZE_MAX;
+            if (segment.kind != SEG_BYTES || segment.count <= room) {
+                stripes[stripe].push_back(segment);
+                load += segmentPackets(segment);
+                break;
+            }
+            stripes[stripe].push_back({SEG_BYTES, segment.start, room});
+            segment.start += room;
+            segment.count -= room;
+            load = perStripe;
+        }
+    }
+}
+
+size_t sequencePackets(const vector<SendSegment> &segments, const vector<Chunk> &chunks)
+{
+    size_t packets = 0;
+    size_t position = 0;
+    for (const SendSegment &segment : segments) {
+        if (segmentOffset(segment, chunks) != position) {
+            packets++;
+        }
+        packets += segmentPackets(segment);
+        position = segmentOffset(segment, chunks) + segmentLength(segment, chunks);
+    }
+    return packets;
+}
+
+size_t namePackets(const string &fileName)
+{
+    return max<size_t>(1, (fileName.size() + maxNameFragmentLength - 1) / maxNameFragmentLength);
+}
+
+Packet namePacket(const string &fileName, uint8_t flags, size_t fragment, uint32_t totalPackets, size_t packetNum)
+{
+    char payload[maxPacketDataLength];
+    uint32_t net_totalPackets = htonl(totalPackets);
+    size_t fragmentOffset = fragment * maxNameFragmentLength;
+    size_t fragmentLength = min((size_t)maxNameFragmentLength, fileName.size() - fragmentOffset);
+    payload[0] = flags | ((fragment == namePackets(fileName) - 1) ? NAME_LAST : 0);
+    memcpy(payload + 1, &net_totalPackets, sizeof(net_totalPackets));
+    memcpy(payload + nameHeaderLength, fileName.data() + fragmentOffset, fragmentLength);
+
+    return createDataPacket(true, packetNum, totalPackets, payload, fragmentLength + nameHeaderLength);
+}
+
+bool sendName(C150DgmSocket *sock, const string &fileName, uint8_t flags, uint32_t totalPackets, size_t &packetCount)
+{
+    /* Attempt to send fileName to server, split over as many packets as it needs */
+    for (size_t i = 0; i < namePackets(fileName); i++) {
+        Packet filenamePacket = namePacket(fileName, flags, i, totalPackets, packetCount);
+        if (!sendPacketWithAck(sock, filenamePacket)) {
+            return false;
+        }
+
+        packetCount++;
+    }
+    return true;
+}
+
+bool SegmentPackets::next(size_t packetNum, Packet &packet)
+{
+    if (segment == segments.size()) {
+        return false;
+    }
+    const SendSegment &current = segments[segment];
+    char payload[maxPacketDataLength];
+    size_t payloadSize = 1;
+
+    if (done == 0 && segmentOffset(current, chunks) != position) {
+        uint64_t net_offset = htobe64(segmentOffset(current, chunks));
+        payload[0] = DATA_SEEK;
+        memcpy(payload + 1, &net_offset, sizeof(net_offset));
+        payloadSize += sizeof(net_offset);
+        position = segmentOffset(current, chunks);
+        packet = createDataPacket(true, packetNum, totalPackets, payload, payloadSize);
+        return true;
+    }
+
+    size_t perPacket = (current.kind == SEG_REFS) ? maxRefsPerPacket :
+                       (current.kind == SEG_ZEROS) ? current.count : maxFileDataLength;
+    size_t n = min(perPacket, current.count - done);
+
+    if (current.kind == SEG_ZEROS) {
+        uint64_t net_length = htobe64(n);
+        payload[0] = DATA_ZERO;
+        memcpy(payload + 1, &net_length, sizeof(net_length));
+        payloadSize += sizeof(net_length);
+    } else if (current.kind == SEG_REFS) {
+        payload[0] = DATA_CHUNKREF;
+        for (size_t c = 0; c < n; c++) {
+            memcpy(payload + payloadSize, chunks[current.start + done + c].digest.bytes, digestLength);
+            payloadSize += digestLength;
+        }
+    } else {
+        payload[0] = DATA_RAW;
+        memcpy(payload + 1, buffer + current.start + done, n);
+        payloadSize += n;
+    }
+    packet = createDataPacket(true, packetNum, totalPackets, payload, payloadSize);
+
+    done += n;
+    if (done == current.count) {
+        position = segmentOffset(current, chunks) + segmentLength(current, chunks);
+        segment++;
+        done = 0;
+    }
+    return true;
+}
+
+bool sendSegments(C150DgmSocket *sock, const char *buffer, const vector<Chunk> &chunks,
+                  const vector<SendSegment> &segments, uint32_t totalPackets, size_t &packetCount)
+{
+    /* Break each segment down into packets, and send them to the server */
+    SegmentPackets packets(buffer, chunks, segments, totalPackets);
+    Packet dataPacket;
+    while (packets.next(packetCount, dataPacket)) {
+        if (!sendPacketWithAck(sock, dataPacket)) {
+            cerr << "Failed to send data packet " << packetCount << " after maximum retries." << endl;
+            return false;
+        }
+
+        packetCount++;
+    }
+    return true;
+}
+
 bool sendMessageWithResponse(C150DgmSocket *sock,
-                             const string &message,
-                             const string &expectedCommand,
-                             const string &expectedFileName,
-                             string &responseMessage)
+                             const Packet &messagePacket,
+                             uint8_t expectedOpcode,
+                             uint32_t fileId,
+                             Packet &responsePacket,
+                             ControlMessage &response)
 {
     for (int attempts = 0; attempts < maxAttempts; ++attempts) {
-        Packet messagePacket = createMessagePacket(message);
         writePacket(sock, messagePacket);
 
         try {
-            Packet responsePacket = readPacket(sock);
-            responseMessage.assign(responsePacket.packetData, responsePacket.dataSize);
-
-            size_t posColon = responseMessage.find(":");
-            if (posColon != string::npos) {
-                string command = responseMessage.substr(0, posColon);
-                if (command == expectedCommand) {
-                    string payload = responseMessage.substr(posColon + 1);
-                    size_t posComma = payload.find(",");
-                    string receivedFileName = (posComma != string::npos)
-                        ? payload.substr(0, posComma)
-                        : payload;
-
-                    if (receivedFileName == expectedFileName) {
-                        return true;
-                    }
-                }
+            responsePacket = readPacket(sock);
+            if (parseControlMessage(responsePacket, response) &&
+                response.opcode == expectedOpcode && response.fileId == fileId) {
+                return true;
             }
         } catch (C150NetworkException&) {
             // Timeout occurred, retry
@@ -258,41 +865,19 @@ bool sendMessageWithResponse(C150DgmSocket *sock,
     return false;
 }
 
-char* readEntireFile(const string &filePath, size_t &fileSize, int fileNastiness) {
-    struct stat statbuf;
-    if (lstat(filePath.c_str(), &statbuf) != 0) {
-        throw runtime_error("Error stating source file: " + filePath);
-    }
-
-    fileSize = statbuf.st_size;
-    char *buffer = (char *)malloc(fileSize);
-    if (buffer == nullptr) {
-        throw runtime_error("Memory allocation failed for file: " + filePath);
-    }
-
-    NASTYFILE inputFile(fileNastiness);
-    if (inputFile.fopen(filePath.c_str(), "rb") == nullptr) {
-        free(buffer);
-        throw runtime_error("Error opening input file: " + filePath);
-    }
-
-    size_t len = inputFile.fread(buffer, 1, fileSize);
-    if (len != fileSize) {
-        free(buffer);
-        throw runtime_error("Error reading file: " + filePath);
-    }
-
-    inputFile.fclose();
-    return buffer;
+PooledBuffer readEntireFile(const string &filePath, size_t &fileSize, int fileNastiness) {
+    SpanScope span("readEntireFile", filePath);
+    return sharedRobustReader(fileNastiness).readFile(filePath, fileSize);
 }
 
 bool sendPacketWithAck(C150DgmSocket *sock, Packet &packet) {
+    SpanScope span("sendPacketWithAck", "packetNum", packet.packetNum);
     int retries = 0;
     while (retries < maxAttempts) {
         writePacket(sock, packet);
         try {
             Packet response = readPacket(sock);
-            if (response.packetNum == packet.packetNum) {
+            if (response.isFile && response.packetNum == packet.packetNum) {
                 return true;
             } else {
                 retries++;
@@ -307,21 +892,92 @@ bool sendPacketWithAck(C150DgmSocket *sock, Packet &packet) {
     return false;
 }
 
-void parseCommandLineArguments(int argc, char *argv[], int &fileNastiness, int &networkNastiness) {
+void parseCommandLineArguments(int &argc, char **&argv, int &fileNastiness, int &networkNastiness,
+                               string &traceFile, string &spanFile, SchedulePolicy &policy, vector<PriorityRule> &rules,
+                               size_t &fanoutServers, size_t &stripeCount, size_t &flowCount,
+                               string &hashCacheFile) {
+    int opt;
+    PriorityRule rule;
+    while ((opt = getopt(argc, argv, "t:T:s:p:m:k:e:c:")) != -1) {
+        switch (opt) {
+            case 't':
+                traceFile = optarg;
+                break;
+            case 'T':
+                spanFile = optarg;
+                break;
+            case 's':
+                if (!parseSchedulePolicy(optarg, policy)) {
+                    fprintf(stderr, "Schedule %s is not one of walk, shortest or largest\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'p':
+                if (!parsePriorityRule(optarg, rule)) {
+                    fprintf(stderr, "Priority rule %s is not of the form pattern=class\n", optarg);
+                    exit(1);
+                }
+                rules.push_back(rule);
+                break;
+            case 'k':
+                stripeCount = atoi(optarg);
+                if (stripeCount < 1 || stripeCount > maxStripes) {
+                    fprintf(stderr, "Stripe count %s is not between 1 and %zu\n", optarg, maxStripes);
+                    exit(1);
+                }
+                break;
+            case 'c':
+                hashCacheFile = optarg;
+                break;
+            case 'e':
+                flowCount = atoi(optarg);
+                if (flowCount < 1 || flowCount > maxFlows) {
+                    fprintf(stderr, "Flow count %s is not between 1 and %zu\n", optarg, maxFlows);
+                    exit(1);
+                }
+                break;
+            case 'm':
+                fanoutServers = atoi(optarg);
+                if (fanoutServers == 0 || fanoutServers > maxFanoutServers) {
+                    fprintf(stderr, "Fan-out server count %s is not between 1 and %zu\n", optarg, maxFanoutServers);
+                    exit(1);
+                }
+                break;
+            default:
+                fprintf(stderr, "Correct syntax is: %s [-t tracefile] [-T spanfile] [-s walk|shortest|largest] [-p pattern=class]... [-m servercount] [-k stripes] [-e flows] [-c hashcache] <server> <networknastiness> <filenastiness> <srcdir>\n", argv[0]);
+                exit(1);
+        }
+    }
+
+    if (flowCount > 0 && (fanoutServers > 0 || stripeCount > 1)) {
+        fprintf(stderr, "-e cannot be combined with -m or -k\n");
+        exit(1);
+    }
+
+    if (!hashCacheFile.empty() && fanoutServers > 0) {
+        fprintf(stderr, "The manifest exchange (-c) is for unicast transfers, not fan-out (-m)\n");
+        exit(1);
+    }
+
+    /* Drop the options so argv[1..] are the positional arguments */
+    argv[optind - 1] = argv[0];
+    argv += optind - 1;
+    argc -= optind - 1;
+
     if (argc != 5) {
-        fprintf(stderr, "Correct syntax is: %s <server> <networknastiness> <filenastiness> <srcdir>\n", argv[0]);
+        fprintf(stderr, "Correct syntax is: %s [-t tracefile] [-T spanfile] [-s walk|shortest|largest] [-p pattern=class]... [-m servercount] [-k stripes] [-e flows] [-c hashcache] <server> <networknastiness> <filenastiness> <srcdir>\n", argv[0]);
         exit(1);
     }
 
     if (strspn(argv[networkNastinessArg], "0123456789") != strlen(argv[networkNastinessArg])) {
         fprintf(stderr, "Nastiness %s is not numeric\n", argv[networkNastinessArg]);
-        fprintf(stderr, "Correct syntax is: %s <server> <networknastiness> <filenastiness> <srcdir>\n", argv[0]);
+        fprintf(stderr, "Correct syntax is: %s [-t tracefile] [-T spanfile] [-s walk|shortest|largest] [-p pattern=class]... [-m servercount] [-k stripes] [-e flows] [-c hashcache] <server> <networknastiness> <filenastiness> <srcdir>\n", argv[0]);
         exit(4);
     }
 
     if (strspn(argv[fileNastinessArg], "0123456789") != strlen(argv[fileNastinessArg])) {
         fprintf(stderr, "Nastiness %s is not numeric\n", argv[fileNastinessArg]);
-        fprintf(stderr, "Correct syntax is: %s <server> <networknastiness> <filenastiness> <srcdir>\n", argv[0]);
+        fprintf(stderr, "Correct syntax is: %s [-t tracefile] [-T spanfile] [-s walk|shortest|largest] [-p pattern=class]... [-m servercount] [-k stripes] [-e flows] [-c hashcache] <server> <networknastiness> <filenastiness> <srcdir>\n", argv[0]);
         exit(4);
     }
 
@@ -329,35 +985,687 @@ void parseCommandLineArguments(int argc, char *argv[], int &fileNastiness, int &
     networkNastiness = atoi(argv[networkNastinessArg]);
 }
 
-void sendFinalMessage(C150DgmSocket *sock) {
-    string finalMessage = "FINISHED:";
-    string responseMessage;
-    if (!sendMessageWithResponse(sock, finalMessage, "FINISHED", "", responseMessage)) {
+void sendFinalMessage(C150DgmSocket *sock, const vector<string> &failedFiles) {
+    Packet finalPacket = createControlPacket(CTRL_FINISHED, 0);
+    Packet responsePacket;
+    ControlMessage response;
+    if (!sendMessageWithResponse(sock, finalPacket, CTRL_FINISHED, 0, responsePacket, response)) {
         cerr << "Failed to receive FINISHED acknowledgment after maximum attempts." << endl;
         exit(-1);
     } else {
-        cout << endl;
+        printSendResult(failedFiles);
+    }
+}
+
+void printSendResult(const vector<string> &failedFiles) {
+    cout << endl;
+    if (failedFiles.empty()) {
         cout << "Successfully finished sending all files to server." << endl;
+        return;
+    }
+    cerr << failedFiles.size() << " files did not pass their end-to-end check:" << endl;
+    for (const string &fileName : failedFiles) {
+        cerr << "  " << fileName << endl;
     }
 }
 
-void processFile(C150DgmSocket *sock, 
-                 dirent *sourceFile, 
+bool processFile(C150DgmSocket *sock, 
+                 const string &fileName, 
                  char *sourceDir, 
                  int fileNastiness, 
-                 size_t &packetCount)
+                 size_t &packetCount,
+                 vector<Stripe> &stripes,
+                 double &checkSeconds)
 {
     int fileTransferAttempt = 1;
+    uint32_t fileId = 0;
 
-    sendFile(sock, sourceFile, sourceDir, fileNastiness, packetCount, fileTransferAttempt);
+    /* A file that cannot be read has nothing to check */
+    if (sendFile(sock, fileName, sourceDir, fileNastiness, packetCount, stripes, fileId, fileTransferAttempt) == 0) {
+        return false;
+    }
 
     /* Attempt to send file maxFileSendRetries until end-to-end check succeeds */
     for (int i = 0; i < maxFileSendRetries; i++) {
-        if (checkFile(sock, sourceFile, sourceDir, fileTransferAttempt, fileNastiness)) {
-            break;
+        auto checkStart = chrono::steady_clock::now();
+        bool passed = checkFile(sock, fileName, sourceDir, fileId, fileTransferAttempt, fileNastiness);
+        checkSeconds += chrono::duration<double>(chrono::steady_clock::now() - checkStart).count();
+
+        if (passed) {
+            return true;
         } else {
             fileTransferAttempt++;
-            sendFile(sock, sourceFile, sourceDir, fileNastiness, packetCount, fileTransferAttempt);
+            if (sendFile(sock, fileName, sourceDir, fileNastiness, packetCount, stripes, fileId, fileTransferAttempt) == 0) {
+                return false;
+            }
+        }
+    }
+    return false;
+}
+
+void skipHeldFiles(C150DgmSocket *sock, char *sourceDir, int fileNastiness, const string &hashCacheFile,
+                   uint32_t manifestId, vector<TransferItem> &items)
+{
+    HashCache cache(hashCacheFile);
+    cache.load();
+
+    /* Files with names too long for one entry are always sent */
+    vector<ManifestEntry> entries;
+    vector<size_t> entryItem;
+    for (size_t i = 0; i < items.size(); i++) {
+        ManifestEntry entry;
+        entry.name = items[i].path;
+        if (entry.name.size() <= maxManifestNameLength &&
+            cache.digestOf(makeFileName(sourceDir, entry.name), fileNastiness, entry.size, entry.digest)) {
+            entries.push_back(entry);
+            entryItem.push_back(i);
+        }
+    }
+    if (!cache.save()) {
+        fprintf(stderr, "Error writing hash cache %s\n", hashCacheFile.c_str());
+    }
+
+    vector<Packet> batches;
+    vector<size_t> batchFirst;
+    size_t count;
+    for (size_t first = 0; first < entries.size(); first += count) {
+        batches.push_back(manifestPacket(manifestId, entries, first, count));
+        batchFirst.push_back(first);
+    }
+
+    vector<bool> held(entries.size(), false);
+    if (!exchangeManifest(sock, manifestId, batches, batchFirst, held)) {
+        cerr << "Failed to receive HOLD responses after maximum attempts; sending every file." << endl;
+        return;
+    }
+
+    vector<bool> skip(items.size(), false);
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (held[i]) {
+            skip[entryItem[i]] = true;
+            cout << "File: " << entries[i].name << " unchanged on server, skipped" << endl;
+        }
+    }
+    size_t skipped = count_if(held.begin(), held.end(), [](bool h) { return h; });
+    cout << "Manifest: " << skipped << " of " << items.size() << " files already on server, "
+         << cache.hits << " digests from the hash cache, " << cache.misses << " computed" << endl;
+
+    vector<TransferItem> remaining;
+    for (size_t i = 0; i < items.size(); i++) {
+        if (!skip[i]) {
+            remaining.push_back(items[i]);
+        }
+    }
+    items.swap(remaining);
+}
+
+bool exchangeManifest(C150DgmSocket *sock, uint32_t manifestId, const vector<Packet> &batches,
+                      const vector<size_t> &batchFirst, vector<bool> &held)
+{
+    vector<bool> answered(batches.size(), false);
+    size_t remaining = batches.size();
+
+    for (int attempts = 0; attempts < maxAttempts && remaining > 0; attempts++) {
+        size_t inFlight = 0;
+        for (size_t b = 0; b < batches.size() && inFlight < manifestWindow; b++) {
+            if (!answered[b]) {
+                writePacket(sock, batches[b]);
+                inFlight++;
+            }
+        }
+
+        /* Collect replies until the window is answered or a read times out */
+        while (inFlight > 0) {
+            try {
+                Packet responsePacket = readPacket(sock);
+                ControlMessage response;
+                uint32_t net_first;
+                uint16_t net_count;
+                if (!parseControlMessage(responsePacket, response) || response.opcode != CTRL_HOLD ||
+                    response.fileId != manifestId || response.payloadLength < sizeof(net_first) + sizeof(net_count)) {
+                    continue;
+                }
+                memcpy(&net_first, response.payload, sizeof(net_first));
+                memcpy(&net_count, response.payload + sizeof(net_first), sizeof(net_count));
+                size_t first = ntohl(net_first);
+                size_t count = ntohs(net_count);
+
+                auto found = lower_bound(batchFirst.begin(), batchFirst.end(), first);
+                if (found == batchFirst.end() || *found != first) {
+                    continue;
+                }
+                size_t b = found - batchFirst.begin();
+                size_t batchEnd = (b + 1 < batches.size()) ? batchFirst[b + 1] : held.size();
+                if (answered[b] || count != batchEnd - first ||
+                    response.payloadLength < sizeof(net_first) + sizeof(net_count) + (count + 7) / 8) {
+                    continue;
+                }
+
+                const unsigned char *bitmap = (const unsigned char *)response.payload + sizeof(net_first) + sizeof(net_count);
+                for (size_t i = 0; i < count; i++) {
+                    held[first + i] = (bitmap[i / 8] >> (i % 8)) & 1;
+                }
+                answered[b] = true;
+                remaining--;
+                inFlight--;
+            } catch (C150NetworkException&) {
+                break;      /* Timeout: send what is unanswered again */
+            } catch (C150Exception& e) {
+                cerr << "Error: " << e.formattedExplanation() << endl;
+                return false;
+            }
+        }
+    }
+    return remaining == 0;
+}
+
+void printProgress(const TransferProgress &progress)
+{
+    fprintf(stdout, "Progress: %zu/%zu files, %llu/%llu bytes, %.2f MB/s, about %.1f s left\n",
+            progress.getDoneFiles(), progress.getTotalFiles(),
+            (unsigned long long) progress.getDoneBytes(), (unsigned long long) progress.getTotalBytes(),
+            progress.throughput() / 1e6, progress.estimatedSecondsLeft());
+}
+
+void engineTransfer(C150DgmSocket *sock, char *serverName, int networkNastiness, size_t flowCount,
+                    EngineWork &work, size_t &packetCount)
+{
+    /* The first flow is sock. Each other flow has its own port, so the
+        server sees it as another client */
+    vector<Flow> flows(flowCount);
+    EventLoop loop(timeOut);
+    for (size_t i = 0; i < flowCount; i++) {
+        if (i == 0) {
+            flows[i] = { sock, packetCount, nullptr };
+        } else {
+            flows[i] = { new C150NastyDgmSocket(networkNastiness), 0, nullptr };
+            flows[i].sock->setServerName(serverName);
+        }
+        flows[i].sock->turnOnTimeouts(engineReadTimeoutMs);
+        loop.addFlow(flows[i]);
+    }
+
+    for (Flow &flow : flows) {
+        loop.spawn(engineRunFlow(loop, flow, work));
+    }
+    loop.run();
+
+    printSendResult(work.failedFiles);
+    packetCount = 0;
+    for (size_t i = 0; i < flowCount; i++) {
+        packetCount += flows[i].packetCount;
+        if (i > 0) {
+            delete flows[i].sock;
+        }
+    }
+}
+
+Task<bool> engineRunFlow(EventLoop &loop, Flow &flow, EngineWork &work)
+{
+    while (work.next < work.items.size()) {
+        const TransferItem &item = work.items[work.next++];
+        auto fileStart = chrono::steady_clock::now();
+        if (co_await engineProcessFile(loop, flow, item.path, work)) {
+            work.filesSent++;
+        } else {
+            work.failedFiles.push_back(item.path);
+        }
+
+        work.progress.fileDone(item.size, chrono::duration<double>(chrono::steady_clock::now() - fileStart).count());
+        printProgress(work.progress);
+    }
+
+    Packet finalPacket = createControlPacket(CTRL_FINISHED, 0);
+    Packet responsePacket;
+    if (!co_await Exchange(loop, flow, finalPacket, CTRL_FINISHED, 0, responsePacket, maxAttempts)) {
+        cerr << "Failed to receive FINISHED acknowledgment after maximum attempts." << endl;
+        exit(-1);
+    }
+    co_return true;
+}
+
+Task<bool> engineProcessFile(EventLoop &loop, Flow &flow, string fileName, EngineWork &work)
+{
+    int fileTransferAttempt = 1;
+    uint32_t fileId = 0;
+
+    co_await engineSendFile(loop, flow, fileName, work, fileId, fileTransferAttempt);
+
+    /* Attempt to send file maxFileSendRetries until end-to-end check succeeds */
+    for (int i = 0; i < maxFileSendRetries; i++) {
+        auto checkStart = chrono::steady_clock::now();
+        bool passed = co_await engineCheckFile(loop, flow, fileName, work, fileId, fileTransferAttempt);
+        work.checkSeconds += chrono::duration<double>(chrono::steady_clock::now() - checkStart).count();
+
+        if (passed) {
+            co_return true;
+        }
+        fileTransferAttempt++;
+        co_await engineSendFile(loop, flow, fileName, work, fileId, fileTransferAttempt);
+    }
+    co_return false;
+}
+
+Task<bool> engineSendFile(EventLoop &loop, Flow &flow, string fileName, EngineWork &work,
+                          uint32_t &fileId, int attemptNumber)
+{
+    cout << endl;
+    *GRADING << "File: " <<  fileName << ", beginning transmission, attempt " << attemptNumber << endl;
+    cout << "File: " <<  fileName << ", beginning transmission, attempt " << attemptNumber << endl;
+
+    PooledBuffer file;
+    string sourceName = makeFileName(work.sourceDir, fileName);
+    size_t fileSize = 0;
+    Packet packet;
+    Packet responsePacket;
+
+    /* Stat and read on the disk worker; the buffer is taken here, on the loop's thread */
+    try {
+        co_await loop.offload([&] { fileSize = RobustReader::sizeOf(sourceName); });
+        file = sharedBufferPool().acquire(fileSize);
+        co_await loop.offload([&] {
+            SpanScope span("readEntireFile", sourceName);
+            sharedRobustReader(work.fileNastiness).readInto(sourceName, fileSize, file.data());
+        });
+    } catch (runtime_error& e) {
+        cerr << "engineSendFile(): Error reading " << sourceName << ": " << e.what() << endl;
+        co_return false;
+    }
+    const char *buffer = file.data();
+
+    /* On a first attempt, leave out chunks the server already has */
+    vector<Chunk> chunks;
+    vector<bool> known;
+    if (attemptNumber == 1 && fileSize >= dedupMinFileSize) {
+        chunkBuffer(buffer, fileSize, chunks);
+        if (chunks.size() > maxQueryChunks ||
+            !co_await engineQueryChunks(loop, flow, flow.packetCount, chunks, known)) {
+            chunks.clear();
+            known.clear();
+        }
+    }
+
+    vector<SendSegment> segments;
+    planSegments(buffer, fileSize, chunks, known, segments);
+    elideZeroRuns(buffer, segments);
+
+    uint32_t numPackets = namePackets(fileName) + sequencePackets(segments, chunks);
+    fileId = flow.packetCount + numPackets;
+
+    for (size_t i = 0; i < namePackets(fileName); i++) {
+        packet = namePacket(fileName, 0, i, numPackets, flow.packetCount);
+        if (!co_await Exchange(loop, flow, packet, 0, 0, responsePacket, maxAttempts)) {
+            cerr << "Failed to send filename packet after maximum retries." << endl;
+            co_return false;
+        }
+        flow.packetCount++;
+    }
+
+    SegmentPackets packets(buffer, chunks, segments, numPackets);
+    while (packets.next(flow.packetCount, packet)) {
+        if (!co_await Exchange(loop, flow, packet, 0, 0, responsePacket, maxAttempts)) {
+            cerr << "Failed to send data packet " << flow.packetCount << " after maximum retries." << endl;
+            co_return false;
+        }
+        flow.packetCount++;
+    }
+
+    *GRADING << "File: " << fileName << " transmission complete, waiting for end-to-end check, attempt " << attemptNumber << endl;
+    cout << "File: " << fileName << " transmission complete, waiting for end-to-end check, attempt " << attemptNumber << endl;
+    co_return true;
+}
+
+Task<bool> engineCheckFile(EventLoop &loop, Flow &flow, string fileName, EngineWork &work,
+                           uint32_t fileId, int attemptNumber)
+{
+    Packet responsePacket;
+    ControlMessage response;
+
+    /* Send CHECK message and await for the server HASH */
+    Packet checkPacket = createControlPacket(CTRL_CHECK, fileId);
+    if (!co_await Exchange(loop, flow, checkPacket, CTRL_HASH, fileId, responsePacket, maxAttempts)) {
+        cerr << "Failed to receive HASH response after maximum attempts." << endl;
+        co_return false;
+    }
+    parseControlMessage(responsePacket, response);
+
+    /* Compute client hash on the disk worker and compare with server */
+    unsigned char clientHash[digestLength];
+    co_await loop.offload([&] { computeHash(makeFileName(work.sourceDir, fileName), work.fileNastiness, clientHash); });
+
+    bool filesMatch = (memcmp(response.digest, clientHash, digestLength) == 0);
+
+    /* Send RESULT message and wait for LOG response */
+    Packet resultPacket = createControlPacket(CTRL_RESULT, fileId, filesMatch ? CTRL_PASS : CTRL_FAIL);
+    if (!co_await Exchange(loop, flow, resultPacket, CTRL_LOG, fileId, responsePacket, maxAttempts)) {
+        cerr << "Failed to receive LOG response after maximum attempts." << endl;
+        co_return false;
+    }
+
+    *GRADING << "File: " << fileName << " end-to-end check "
+             << (filesMatch ? "succeeded" : "failed") << ", attempt " << attemptNumber << endl;
+
+    cout << "File: " << fileName << " end-to-end check "
+            << (filesMatch ? "succeeded" : "failed") << ", attempt " << attemptNumber << endl;
+
+    co_return filesMatch;
+}
+
+Task<bool> engineQueryChunks(EventLoop &loop, Flow &flow, uint32_t queryId,
+                             const vector<Chunk> &chunks, vector<bool> &known)
+{
+    known.assign(chunks.size(), false);
+    Packet responsePacket;
+    ControlMessage response;
+
+    for (size_t first = 0; first < chunks.size(); first += maxQueryEntries) {
+        size_t count = min(maxQueryEntries, chunks.size() - first);
+        Packet query = queryPacket(queryId, chunks, first, count);
+
+        /* A late reply to an earlier batch matches on opcode and id, so check its index too */
+        bool answered = false;
+        for (int attempts = 0; attempts < maxFileSendRetries && !answered; attempts++) {
+            if (!co_await Exchange(loop, flow, query, CTRL_HAVE, queryId, responsePacket, maxAttempts)) {
+                co_return false;
+            }
+            answered = parseControlMessage(responsePacket, response) &&
+                       readHaveReply(response, first, count, known);
+        }
+        if (!answered) {
+            co_return false;
+        }
+    }
+    co_return true;
+}
+
+vector<uint32_t> discoverServers(MulticastSocket &sock, size_t serverCount)
+{
+    vector<uint32_t> servers;
+    Packet helloPacket = createControlPacket(CTRL_HELLO, 0);
+    int64_t giveUp = fanoutNowMillis() + fanoutSilenceMs;
+
+    while (servers.size() < serverCount && fanoutNowMillis() < giveUp) {
+        sock.write(helloPacket);
+
+        int64_t deadline = fanoutNowMillis() + pollWindowMs;
+        Packet responsePacket;
+        ControlMessage response;
+        uint32_t serverId;
+        while (fanoutNowMillis() < deadline && sock.read(responsePacket, deadline - fanoutNowMillis())) {
+            if (parseControlMessage(responsePacket, response) && response.opcode == CTRL_HELLO &&
+                takeServerId(response, serverId) &&
+                find(servers.begin(), servers.end(), serverId) == servers.end()) {
+                servers.push_back(serverId);
+                printf("Found fan-out server %08x\n", serverId);
+            }
+        }
+    }
+
+    if (servers.size() < serverCount) {
+        fprintf(stderr, "Only %zu of %zu fan-out servers answered\n", servers.size(), serverCount);
+        exit(8);
+    }
+    return servers;
+}
+
+void collectReplies(MulticastSocket &sock,
+                    const function<vector<Packet>(const vector<uint32_t> &)> &requests,
+                    uint8_t expectedOpcode,
+                    uint32_t fileId,
+                    vector<uint32_t> &servers,
+                    const function<void(uint32_t, ControlMessage &)> &onReply)
+{
+    vector<uint32_t> pending = servers;
+    int64_t lastHeard = fanoutNowMillis();
+
+    while (!pending.empty()) {
+        for (const Packet &request : requests(pending)) {
+            sock.write(request);
+        }
+
+        int64_t deadline = fanoutNowMillis() + pollWindowMs;
+        Packet responsePacket;
+        ControlMessage response;
+        uint32_t serverId;
+        while (!pending.empty() && fanoutNowMillis() < deadline &&
+               sock.read(responsePacket, deadline - fanoutNowMillis())) {
+            if (!parseControlMessage(responsePacket, response) || response.opcode != expectedOpcode ||
+                response.fileId != fileId || !takeServerId(response, serverId)) {
+                continue;
+            }
+            auto found = find(pending.begin(), pending.end(), serverId);
+            if (found != pending.end()) {
+                pending.erase(found);
+                onReply(serverId, response);
+                lastHeard = fanoutNowMillis();
+            }
+        }
+
+        if (!pending.empty() && fanoutNowMillis() - lastHeard > fanoutSilenceMs) {
+            for (uint32_t serverId : pending) {
+                fprintf(stderr, "Fan-out server %08x stopped answering, dropping it\n", serverId);
+                servers.erase(find(servers.begin(), servers.end(), serverId));
+            }
+            pending.clear();
+        }
+    }
+}
+
+bool fanoutSendFile(MulticastSocket &sock,
+                    const string &fileName,
+                    char *sourceDir,
+                    int fileNastiness,
+                    uint32_t fileId,
+                    int attemptNumber,
+                    vector<uint32_t> &servers,
+                    FanoutStats &stats)
+{
+    cout << endl;
+    *GRADING << "File: " <<  fileName << ", beginning transmission, attempt " << attemptNumber << endl;
+    cout << "File: " <<  fileName << ", beginning transmission, attempt " << attemptNumber << endl;
+
+    size_t fileSize = 0;
+    PooledBuffer file;
+    string sourceName = makeFileName(sourceDir, fileName);
+    try {
+        file = readEntireFile(sourceName, fileSize, fileNastiness);
+    } catch (runtime_error& e) {
+        cerr << "fanoutSendFile(): Error reading " << sourceName << ": " << e.what() << endl;
+        return false;
+    }
+    const char *buffer = file.data();
+
+    size_t nameFragments = max<size_t>(1, (fileName.size() + fanoutPayloadLength - 1) / fanoutPayloadLength);
+    size_t totalPackets = nameFragments + (fileSize + fanoutPayloadLength - 1) / fanoutPayloadLength;
+    if (nameFragments > UINT8_MAX || totalPackets > UINT32_MAX) {
+        cerr << "File: " << fileName << " is too large to fan out" << endl;
+        return false;
+    }
+
+    /* Packets are built from the name and the pooled file buffer as they are sent */
+    auto packetAt = [&](size_t index) {
+        const char *data = (index < nameFragments) ? fileName.data() : buffer;
+        size_t dataLength = (index < nameFragments) ? fileName.size() : fileSize;
+        size_t offset = ((index < nameFragments) ? index : index - nameFragments) * fanoutPayloadLength;
+        return createFanoutPacket(fileId, totalPackets, index, nameFragments, data + offset,
+                                  min(fanoutPayloadLength, dataLength - offset));
+    };
+
+    FanoutPacer pacer(sock);
+    for (size_t i = 0; i < totalPackets; i++) {
+        pacer.write(packetAt(i));
+    }
+    stats.packetsSent += totalPackets;
+
+    /* POLL until every server reports DONE, repairing the union of the NACKed ranges each round */
+    Packet pollPacket = createControlPacket(CTRL_POLL, fileId);
+    uint32_t net_totalPackets = htonl(totalPackets);
+    appendToPacket(pollPacket, &net_totalPackets, sizeof(net_totalPackets));
+    for (uint32_t serverId : servers) {
+        appendServerId(pollPacket, serverId);
+    }
+
+    vector<uint32_t> done;
+    int64_t lastHeard = fanoutNowMillis();
+    while (done.size() < servers.size()) {
+        sock.write(pollPacket);
+
+        vector<bool> repair(totalPackets, false);
+        int64_t deadline = fanoutNowMillis() + pollWindowMs;
+        Packet responsePacket;
+        ControlMessage response;
+        uint32_t serverId;
+        while (done.size() < servers.size() && fanoutNowMillis() < deadline &&
+               sock.read(responsePacket, deadline - fanoutNowMillis())) {
+            if (!parseControlMessage(responsePacket, response) || response.fileId != fileId ||
+                !takeServerId(response, serverId) ||
+                find(servers.begin(), servers.end(), serverId) == servers.end()) {
+                continue;
+            }
+
+            if (response.opcode == CTRL_DONE) {
+                if (find(done.begin(), done.end(), serverId) == done.end()) {
+                    done.push_back(serverId);
+                }
+                lastHeard = fanoutNowMillis();
+            } else if (response.opcode == CTRL_NACK) {
+                stats.nacksReceived++;
+                lastHeard = fanoutNowMillis();
+                markNackedRanges(response, repair);
+            }
+        }
+
+        FanoutPacer repairPacer(sock);
+        for (size_t i = 0; i < totalPackets; i++) {
+            if (repair[i]) {
+                repairPacer.write(packetAt(i));
+                stats.repairsSent++;
+            }
+        }
+
+        if (done.size() < servers.size() && fanoutNowMillis() - lastHeard > fanoutSilenceMs) {
+            for (size_t i = servers.size(); i-- > 0; ) {
+                if (find(done.begin(), done.end(), servers[i]) == done.end()) {
+                    fprintf(stderr, "Fan-out server %08x stopped answering, dropping it\n", servers[i]);
+                    servers.erase(servers.begin() + i);
+                }
+            }
+        }
+    }
+
+    *GRADING << "File: " << fileName << " transmission complete, waiting for end-to-end check, attempt " << attemptNumber << endl;
+    cout << "File: " << fileName << " transmission complete, waiting for end-to-end check, attempt " << attemptNumber << endl;
+    return true;
+}
+
+void fanoutCheckFile(MulticastSocket &sock,
+                     const string &fileName,
+                     char *sourceDir,
+                     uint32_t fileId,
+                     int attemptNumber,
+                     int fileNastiness,
+                     vector<uint32_t> &servers,
+                     vector<uint32_t> &failed)
+{
+    unsigned char clientHash[digestLength];
+    computeHash(makeFileName(sourceDir, fileName), fileNastiness, clientHash);
+
+    /* Send CHECK to the servers that have not answered and gather their HASHes */
+    failed.clear();
+    collectReplies(sock,
+        [fileId](const vector<uint32_t> &pending) {
+            Packet checkPacket = createControlPacket(CTRL_CHECK, fileId);
+            for (uint32_t serverId : pending) {
+                appendServerId(checkPacket, serverId);
+            }
+            return vector<Packet>{checkPacket};
+        },
+        CTRL_HASH, fileId, servers,
+        [&](uint32_t serverId, ControlMessage &response) {
+            if (memcmp(response.digest, clientHash, digestLength) != 0) {
+                failed.push_back(serverId);
+            }
+        });
+
+    /* Send each server its RESULT and wait for the LOGs */
+    collectReplies(sock,
+        [fileId, &failed](const vector<uint32_t> &pending) {
+            vector<Packet> resultPackets;
+            for (uint32_t serverId : pending) {
+                bool passed = find(failed.begin(), failed.end(), serverId) == failed.end();
+                resultPackets.push_back(createControlPacket(CTRL_RESULT, fileId, passed ? CTRL_PASS : CTRL_FAIL));
+                appendServerId(resultPackets.back(), serverId);
+            }
+            return resultPackets;
+        },
+        CTRL_LOG, fileId, servers,
+        [](uint32_t, ControlMessage &) {});
+
+    for (uint32_t serverId : servers) {
+        bool passed = find(failed.begin(), failed.end(), serverId) == failed.end();
+        *GRADING << "File: " << fileName << " end-to-end check " << (passed ? "succeeded" : "failed")
+                 << " on server " << hex << serverId << dec << ", attempt " << attemptNumber << endl;
+        cout << "File: " << fileName << " end-to-end check " << (passed ? "succeeded" : "failed")
+             << " on server " << hex << serverId << dec << ", attempt " << attemptNumber << endl;
+    }
+}
+
+bool fanoutProcessFile(MulticastSocket &sock,
+                       const string &fileName,
+                       char *sourceDir,
+                       int fileNastiness,
+                       vector<uint32_t> &servers,
+                       uint32_t &nextFileId,
+                       FanoutStats &stats,
+                       double &checkSeconds)
+{
+    /* With every server dropped for silence, nothing can be sent */
+    if (servers.empty()) {
+        cerr << "File: " << fileName << " not sent, no fan-out servers left" << endl;
+        return false;
+    }
+
+    /* Each attempt goes to the servers whose copy has not yet passed */
+    vector<uint32_t> targets = servers;
+    bool serverDropped = false;
+    for (int attempt = 1; attempt <= maxFileSendRetries + 1 && !targets.empty(); attempt++) {
+        vector<uint32_t> attemptTargets = targets;
+        uint32_t fileId = nextFileId++;
+        if (!fanoutSendFile(sock, fileName, sourceDir, fileNastiness, fileId, attempt, targets, stats)) {
+            return false;
         }
+
+        auto checkStart = chrono::steady_clock::now();
+        vector<uint32_t> failed;
+        fanoutCheckFile(sock, fileName, sourceDir, fileId, attempt, fileNastiness, targets, failed);
+        checkSeconds += chrono::duration<double>(chrono::steady_clock::now() - checkStart).count();
+
+        /* Servers dropped for silence are not sent further files */
+        for (uint32_t serverId : attemptTargets) {
+            if (find(targets.begin(), targets.end(), serverId) == targets.end()) {
+                servers.erase(find(servers.begin(), servers.end(), serverId));
+                serverDropped = true;
+            }
+        }
+        targets = failed;
     }
-}
\ No newline at end of file
+    return targets.empty() && !serverDropped;
+}
+
+void fanoutFinalMessage(MulticastSocket &sock, vector<uint32_t> &servers, const vector<string> &failedFiles)
+{
+    collectReplies(sock,
+        [](const vector<uint32_t> &) { return vector<Packet>{createControlPacket(CTRL_FINISHED, 0)}; },
+        CTRL_FINISHED, 0, servers,
+        [](uint32_t, ControlMessage &) {});
+
+    cout << endl;
+    if (failedFiles.empty()) {
+        cout << "Successfully finished sending all files to " << servers.size() << " servers." << endl;
+        return;
+    }
+    cerr << failedFiles.size() << " files did not reach every server:" << endl;
+    for (const string &fileName : failedFiles) {
+        cerr << "  " << fileName << endl;
+    }
+}
@@ -3,74 +3,32 @@
 #include <fstream>
 #include <cstdlib> 
 #include "fileutils.h"
+#include "serverutils.h"
+#include "fanoutserver.h"
 #include <unordered_set>
 #include <cstdio>
+#include <unistd.h>
+#include <memory>
+#include <unordered_map>
+#include <csignal>
+#include <sys/prctl.h>
+#include <sys/wait.h>
 
 using namespace C150NETWORK;  // for all the comp150 utilities 
 
-void parseCommandLineArguments(int argc, char *argv[], int &fileNastiness, int &networkNastiness);
-
-void receiveFilename(int &packetsWrittenToFile, 
-                     uint32_t &currentFileNameCounter,
-                     Packet &incomingPacket, 
-                     string &currentFileName,
-                     string &targetName,
-                     string &targetDir,
-                     unordered_set<string> &logResult,
-                     unordered_set<string> &logStart,
-                     NASTYFILE& outputFile);
-
-void writeDataToFile(int &packetsWrittenToFile,
-                     NASTYFILE& outputFile, 
-                     Packet &incomingPacket, 
-                     string &targetName);
-
-void acknowledgePacket(C150DgmSocket *sock, Packet &incomingPacket);
-
-void handleFilePacket(C150DgmSocket *sock,
-                      int &packetsWrittenToFile, 
-                      uint32_t &currentFileNameCounter,
-                      uint32_t &currentPacketNumber,
-                      Packet &incomingPacket, 
-                      string &currentFileName,
-                      string &targetName,
-                      string &targetDir,
-                      unordered_set<string> &logResult,
-                      unordered_set<string> &logStart,
-                      NASTYFILE& outputFile);
-
-void handleCheck(C150DgmSocket *sock,
-                 string &fileName,
-                 string &currentFileName,
-                 string &targetName,
-                 unordered_set<string> &logResult, 
-                 int &fileNastiness);
-
-void handleResult(C150DgmSocket *sock, 
-                  string &response, 
-                  string &currentFileName, 
-                  unordered_set<string> &logStart, 
-                  string &fileName, 
-                  string &targetName, 
-                  string &targetDir);
-
-void handleMessagePacket(C150DgmSocket *sock,  
-                         string &currentFileName, 
-                         unordered_set<string> &logStart,
-                         unordered_set<string> &logResult,
-                         string &targetName, 
-                         string &targetDir,
-                         Packet &incomingPacket,
-                         int &fileNastiness,
-                         uint32_t &currentPacketNumber,
-                         uint32_t &currentFileNameCounter,
-                         int &packetsWrittenToFile);
+void parseCommandLineArguments(int &argc, char **&argv, int &fileNastiness, int &networkNastiness,
+                               string &traceFile, string &spanFile, string &fanoutGroup, int &workers,
+                               int &groupFiles);
 
 const int networkNastinessArg = 1;
 const int fileNastinessArg = 2;
 const int destArg = 3;
 
-// USAGE: fileserver <networknastiness> <filenastiness> <targetdir>
+// USAGE: fileserver [-t tracefile] [-T spanfile] [-m group[:port][@ifaddr]] [-w workers] [-d groupfiles] <networknastiness> <filenastiness> <targetdir>
+
+/* Start workers server processes sharing the UDP port; returns in each
+    child with its index, and never returns in the parent */
+int startWorkers(int workers);
 
 /* Main Loop: process incoming packets, determine type, and process accordingly */
 int main(int argc, char *argv[]) {
@@ -78,41 +36,137 @@ int main(int argc, char *argv[]) {
     
     int fileNastiness;
     int networkNastiness;
-    parseCommandLineArguments(argc, argv, fileNastiness, networkNastiness);
+    string traceFile;
+    string spanFile;
+    string fanoutGroup;
+    int workers = 1;
+    int groupFiles = 0;
+    parseCommandLineArguments(argc, argv, fileNastiness, networkNastiness, traceFile, spanFile, fanoutGroup, workers,
+                              groupFiles);
+
+    if (workers > 1) {
+        int worker = startWorkers(workers);
+        if (!traceFile.empty()) {
+            traceFile += "." + to_string(worker);
+        }
+        if (!spanFile.empty()) {
+            spanFile += "." + to_string(worker);
+        }
+    }
+
+    PacketTrace trace;
+    if (!traceFile.empty()) {
+        if (!trace.create(traceFile, TRACE_SERVER)) {
+            fprintf(stderr, "Error creating trace file %s\n", traceFile.c_str());
+            exit(8);
+        }
+        packetTrace = &trace;
+    }
+    if (!spanFile.empty()) {
+        startSpanTrace(spanFile);
+    }
     
+    if (!fanoutGroup.empty()) {
+        MulticastAddress address;
+        if (!parseMulticastAddress(fanoutGroup, address)) {
+            fprintf(stderr, "%s is not a multicast group[:port][@ifaddr]\n", fanoutGroup.c_str());
+            exit(1);
+        }
+        try {
+            MulticastSocket sock(address, networkNastiness);
+            runFanoutServer(sock, argv[destArg], fileNastiness);
+        }
+        catch (C150NetworkException& e) {
+            cerr << argv[0] << ": caught C150NetworkException: " << e.formattedExplanation() << endl;
+        }
+        return 4;
+    }
+
     try {
         // Create the socket
         C150DgmSocket *sock = new C150NastyDgmSocket(networkNastiness);
 
-        unordered_set<string> logResult;
-        unordered_set<string> logStart;
-
-        uint32_t currentPacketNumber = 0; // Track state of the current 'global' packet number exapected (corresponds to packetNum struct in Packet)
-        uint32_t currentFileNameCounter = 0; // Next first FILE packet for a file (will contain filename and no data)
-
-        int packetsWrittenToFile = 0;
-        
         string targetDir = argv[destArg];
 
-        string currentFileName = "";
-        string targetName = "";
+        /* Chunks on disk are shared by all clients; the rest is per client */
+        ChunkIndex chunkIndex(fileNastiness);
+        HeldFiles heldFiles(fileNastiness);
+        unordered_map<string, unique_ptr<ServerSession>> sessions;
+        GroupCommit groupCommit(groupFiles);
+        bool idleTimeoutOn = false;     /* Set while a group waits for the socket to go quiet */
 
-        NASTYFILE outputFile(fileNastiness);
+#ifndef C150_HAVE_GET_OTHER_END
+        cout << "This socket library cannot tell clients apart: serve one client at a time, "
+             << "without -k or -e" << endl;
+#endif
 
         while(1) { 
-            Packet incomingPacket = readPacket(sock);
+            /* While a group is open, a quiet socket means no more files are coming soon */
+            Packet incomingPacket;
+            try {
+                incomingPacket = readPacket(sock);
+            } catch (C150NetworkException&) {
+                if (!sock->timedout()) {
+                    throw;
+                }
+                groupCommit.commit(sock);
+                sock->turnOffTimeouts();
+                idleTimeoutOn = false;
+                continue;
+            }
+
+            string key = clientKey(sock);
+            unique_ptr<ServerSession> &session = sessions[key];
+            if (!session) {
+                session.reset(new ServerSession(fileNastiness, chunkIndex));
+            }
             
             if (incomingPacket.isFile) {
-                handleFilePacket(sock, packetsWrittenToFile, currentFileNameCounter,
-                                 currentPacketNumber, incomingPacket, currentFileName,
-                                 targetName, targetDir, logResult, logStart, outputFile);
+                handleFilePacket(sock, session->packetsWrittenToFile, session->currentFileNameCounter,
+                                 session->currentPacketNumber, incomingPacket, session->currentFileName,
+                                 session->targetName, session->fileRefused, targetDir, session->logResult,
+                                 session->logStart, session->outputFile, session->chunkStore);
             }
 
             else {
-                handleMessagePacket(sock, currentFileName, logStart, logResult,
-                                    targetName, targetDir, incomingPacket,
-                                    fileNastiness, currentPacketNumber,
-                                    currentFileNameCounter, packetsWrittenToFile);
+                handleMessagePacket(sock, session->currentFileName, session->logStart, session->logResult,
+                                    session->targetName, session->fileRefused, targetDir, incomingPacket,
+                                    fileNastiness, session->currentPacketNumber,
+                                    session->currentFileNameCounter, session->packetsWrittenToFile,
+                                    session->chunkStore, session->fileCheck, groupCommit, key, heldFiles);
+
+                /* A client that has finished starts afresh if it comes back */
+                ControlMessage message;
+                if (parseControlMessage(incomingPacket, message) && message.opcode == CTRL_FINISHED) {
+                    groupCommit.commit(sock);
+                    if (groupCommit.enabled()) {
+                        cout << "Group commit: " << groupCommit.files << " files in " << groupCommit.groups
+                             << " groups" << endl;
+                    }
+                    cout << bufferPoolSummary() << endl;
+                    sessions.erase(key);
+                    dumpSpans();
+                }
+
+                /* Control exchanges are rare; keep the trace current at each one */
+                if (packetTrace != nullptr) {
+                    packetTrace->flush();
+                }
+            }
+
+            /* Hash some of what recent MANIFESTs could not wait for */
+            heldFiles.hashQueued(deferredHashBudget);
+
+            if (groupCommit.due(sessions.size())) {
+                groupCommit.commit(sock);
+            }
+            if (groupCommit.empty() == idleTimeoutOn) {
+                if (groupCommit.empty()) {
+                    sock->turnOffTimeouts();
+                } else {
+                    sock->turnOnTimeouts(groupCommitIdleMs);
+                }
+                idleTimeoutOn = !groupCommit.empty();
             }
 
         }
@@ -126,222 +180,119 @@ int main(int argc, char *argv[]) {
     return 4;
 }
 
-/* Ensure Command Line Arguments are within expected bounds and values */
-void parseCommandLineArguments(int argc, char *argv[], int &fileNastiness, int &networkNastiness) {
-    if (argc != 4)  {
-        fprintf(stderr,"Correct syntxt is: %s <networknastiness> <filenastiness> <targetdir>\n", argv[0]);
-        exit(1);
-    }
+int startWorkers(int workers) {
+    /* The kernel spreads clients over the workers by hashing their addresses */
+    setenv("C150_REUSEPORT", "1", 1);
 
-    if (strspn(argv[networkNastinessArg], "0123456789") != strlen(argv[networkNastinessArg])) {
-        fprintf(stderr,"Nastiness %s is not numeric\n", argv[networkNastinessArg]);     
-        fprintf(stderr,"Correct syntxt is: %s <networknastiness> <filenastiness> <targetdir>\n", argv[0]);     
-        exit(4);
+    for (int worker = 0; worker < workers; worker++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "Error starting worker %d errno=%s\n", worker, strerror(errno));
+            exit(8);
+        }
+        if (pid == 0) {
+            /* Workers go when the parent does */
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            if (getppid() == 1) {
+                exit(0);
+            }
+            return worker;
+        }
+        cout << "Worker " << worker << " is pid " << pid << endl;
     }
 
-    if (strspn(argv[fileNastinessArg], "0123456789") != strlen(argv[fileNastinessArg])) {
-        fprintf(stderr,"Nastiness %s is not numeric\n", argv[fileNastinessArg]);     
-        fprintf(stderr,"Correct syntxt is: %s <networknastiness> <filenastiness> <targetdir>\n", argv[0]);     
-        exit(4);
+    /* Killing the parent takes the workers with it; report any that fail first */
+    int status;
+    pid_t pid;
+    while ((pid = wait(&status)) > 0) {
+        fprintf(stderr, "Worker pid %d exited with status %d\n", (int)pid,
+                WIFEXITED(status) ? WEXITSTATUS(status) : -1);
     }
-    networkNastiness = atoi(argv[networkNastinessArg]);   // convert command line string to integer
-    fileNastiness = atoi(argv[fileNastinessArg]);   // convert command line string to integer
+    exit(4);
 }
 
-/* Process the filename packet, the 1st packet send for transmission of a given file */
-void receiveFilename(int &packetsWrittenToFile, 
-                     uint32_t &currentFileNameCounter,
-                     Packet &incomingPacket, 
-                     string &currentFileName,
-                     string &targetName,
-                     string &targetDir,
-                     unordered_set<string> &logResult,
-                     unordered_set<string> &logStart,
-                     NASTYFILE& outputFile) 
-{
-    packetsWrittenToFile = 0;
-
-    currentFileNameCounter = incomingPacket.packetNum + incomingPacket.totalPackets;
-    currentFileName.assign(incomingPacket.packetData, incomingPacket.dataSize);
-    *GRADING << "File: " << currentFileName << " starting to receive file" << endl;
-    cout << "File: " << currentFileName << " starting to receive file" << endl;
-
-    targetName = makeFileName(targetDir, (currentFileName + ".TMP"));
-
-    logResult.erase(currentFileName);
-    logStart.erase(currentFileName);
-
-    void *fopenretval;
-    fopenretval = outputFile.fopen(targetName.c_str(), "wb");
-
-    
-    if (fopenretval == NULL) {
-        cerr << "Error opening input file " << targetName << " errno=" << strerror(errno) << endl;
-        exit(12);
+/* Ensure Command Line Arguments are within expected bounds and values. 
+    Options are consumed, leaving argv[1..] as the positional arguments */
+void parseCommandLineArguments(int &argc, char **&argv, int &fileNastiness, int &networkNastiness,
+                               string &traceFile, string &spanFile, string &fanoutGroup, int &workers,
+                               int &groupFiles) {
+    int opt;
+    while ((opt = getopt(argc, argv, "t:T:m:w:d:")) != -1) {
+        switch (opt) {
+            case 't':
+                traceFile = optarg;
+                break;
+            case 'T':
+                spanFile = optarg;
+                break;
+            case 'm':
+                fanoutGroup = optarg;
+                break;
+            case 'd':
+                groupFiles = atoi(optarg);
+                if (groupFiles < 1) {
+                    fprintf(stderr, "Group size %s is not a positive number\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'w':
+                workers = atoi(optarg);
+                if (workers < 1) {
+                    fprintf(stderr, "Worker count %s is not a positive number\n", optarg);
+                    exit(1);
+                }
+                break;
+            default:
+                fprintf(stderr,"Correct syntxt is: %s [-t tracefile] [-T spanfile] [-m group[:port][@ifaddr]] [-w workers] [-d groupfiles] <networknastiness> <filenastiness> <targetdir>\n", argv[0]);
+                exit(1);
+        }
     }
-}
+    argv[optind - 1] = argv[0];
+    argv += optind - 1;
+    argc -= optind - 1;
 
-/* Take in packet and write selected portion into file */
-void writeDataToFile(int &packetsWrittenToFile,
-                     NASTYFILE& outputFile, 
-                     Packet &incomingPacket, 
-                     string &targetName)
-{
-    ssize_t len = outputFile.fwrite(incomingPacket.packetData, 1, incomingPacket.dataSize);
-    if (len != incomingPacket.dataSize) {
-        cerr << "Error writing file " << targetName << " errno=" << strerror(errno) << endl;
-        exit(16);
+    if (groupFiles > 0 && !fanoutGroup.empty()) {
+        fprintf(stderr, "Group commit (-d) is for unicast transfers, not fan-out (-m)\n");
+        exit(1);
     }
-                        
-    packetsWrittenToFile++;
-}
-
-/* Send ACK packet */
-void acknowledgePacket(C150DgmSocket *sock, Packet &incomingPacket) {
-    Packet ackPacket = createDataPacket(true, incomingPacket.packetNum, 0, "", 0);
-    writePacket(sock, ackPacket);
-}
-
-/* Process incoming FILE packet and send ACK packet */
-void handleFilePacket(C150DgmSocket *sock,
-                      int &packetsWrittenToFile, 
-                      uint32_t &currentFileNameCounter,
-                      uint32_t &currentPacketNumber,
-                      Packet &incomingPacket, 
-                      string &currentFileName,
-                      string &targetName,
-                      string &targetDir,
-                      unordered_set<string> &logResult,
-                      unordered_set<string> &logStart,
-                      NASTYFILE& outputFile)
-{
-    if (currentPacketNumber == incomingPacket.packetNum) {      
-        // Handle packet containing filename
-        if (currentFileNameCounter == incomingPacket.packetNum) {
-
-            receiveFilename(packetsWrittenToFile, currentFileNameCounter, incomingPacket, 
-                            currentFileName, targetName, targetDir, logResult, logStart,
-                            outputFile);
-    
-        } else {       
-            writeDataToFile(packetsWrittenToFile, outputFile, incomingPacket,targetName);
-        };
-        
-        acknowledgePacket(sock, incomingPacket);
-
-        currentPacketNumber++; // Increment current packet
-
-        if (currentPacketNumber == currentFileNameCounter) {
-            if (outputFile.fclose() != 0 ) {
-                cerr << "Error closing output file " << targetName << 
-                    " errno=" << strerror(errno) << endl;
-                exit(16);
-            }
-        }
 
-    /* Send ACK Packet for previous packet if that ACK was never received */
-    } else if (incomingPacket.packetNum == currentPacketNumber - 1 ) {
-        acknowledgePacket(sock, incomingPacket);
+    if (workers > 1 && !fanoutGroup.empty()) {
+        fprintf(stderr, "Workers (-w) are for unicast transfers, not fan-out (-m)\n");
+        exit(1);
     }
-}
 
-/* Process incoming CHECK packet and send the HASH message containing the hash code
-    of the server file*/ 
-void handleCheck(C150DgmSocket *sock,
-                 string &fileName,
-                 string &currentFileName,
-                 string &targetName,
-                 unordered_set<string> &logResult, 
-                 int &fileNastiness)
-{
-    if (logResult.count(fileName) == 0) {
-        *GRADING << "File: " << currentFileName << " received, beginning end-to-end check" << endl;
-        cout << "File: " << currentFileName << " received, beginning end-to-end check" << endl;
-        logResult.insert(fileName);
+#ifndef C150_HAVE_GET_OTHER_END
+    /* LOGs held for a group must go back to the client each file came from */
+    if (groupFiles > 0) {
+        fprintf(stderr, "Group commit (-d) needs the local C150 stand-in library; this build uses the COMP117 one\n");
+        exit(1);
     }
+#endif
 
-    string messageHash = "HASH:" + fileName + "," + computeHash(targetName, fileNastiness);
-
-    Packet messagePacket = createMessagePacket(messageHash);
-
-    writePacket(sock, messagePacket);
-}
-
-/* Process incoming RESULT packet and send the LOG confirmation message */
-void handleResult(C150DgmSocket *sock, 
-                  string &response, 
-                  string &currentFileName, 
-                  unordered_set<string> &logStart, 
-                  string &fileName, 
-                  string &targetName, 
-                  string &targetDir)
-{
-    string result;
-    if (!parseResponse(response, "RESULT" , currentFileName, result)) {
-        cerr << "Invalid RESULT response or filename mismatch." << endl;
-        cout << "Wrong file " << endl;
-    } else {
-        if (result == "PASS") {
-            // On a PASS, remove .TMP extension
-            if (rename(targetName.c_str(), makeFileName(targetDir, currentFileName).c_str()) != 0) {
-                cout << "ERROR with RENAME" << endl;
-            }
-            targetName = makeFileName(targetDir, currentFileName);
-        }
-        
-        if (logStart.count(fileName) == 0) {
-            if (result == "PASS") {
-                *GRADING << "File: " << fileName << " end-to-end check succeeded" << endl;
-                cout << "File: " << fileName << " end-to-end check succeeded" << endl;
-            } else if (result == "FAIL") {
-                *GRADING << "File: " << fileName << " end-to-end check failed" << endl;
-                cout << "File: " << fileName << " end-to-end check failed" << endl;
-            }
-            logStart.insert(fileName);
-        }
-
-        string logConfirmation = "LOG:" + fileName + "," + result;           
-        Packet logPacket = createMessagePacket(logConfirmation);
-        writePacket(sock, logPacket);
+#ifndef C150_HAVE_REUSEPORT
+    /* Without SO_REUSEPORT the workers cannot share the server port */
+    if (workers > 1) {
+        fprintf(stderr, "Workers (-w) need the local C150 stand-in library; this build uses the COMP117 one\n");
+        exit(1);
     }
-}
+#endif
 
-/* Process an incoming Message Packet */
-void handleMessagePacket(C150DgmSocket *sock,  
-                         string &currentFileName, 
-                         unordered_set<string> &logStart,
-                         unordered_set<string> &logResult,
-                         string &targetName, 
-                         string &targetDir,
-                         Packet &incomingPacket,
-                         int &fileNastiness,
-                         uint32_t &currentPacketNumber,
-                         uint32_t &currentFileNameCounter,
-                         int &packetsWrittenToFile)
-{
-    string response;
-    response.assign(incomingPacket.packetData, incomingPacket.dataSize);
-    size_t posColon = response.find(":");
-    size_t posComma = response.find(",");
-    string msgCommand = response.substr(0, posColon);
-    string fileName = response.substr(posColon + 1, posComma - posColon - 1);
-
-    if (fileName == currentFileName) {
-        if (msgCommand == "CHECK") {
-            handleCheck(sock, fileName, currentFileName, targetName, logResult, fileNastiness);
-        }  
-        else if (msgCommand == "RESULT") {
-            handleResult(sock, response, currentFileName, logStart, 
-                            fileName, targetName, targetDir);
-        }
+    if (argc != 4)  {
+        fprintf(stderr,"Correct syntxt is: %s [-t tracefile] [-T spanfile] [-m group[:port][@ifaddr]] [-w workers] [-d groupfiles] <networknastiness> <filenastiness> <targetdir>\n", argv[0]);
+        exit(1);
+    }
 
-    } else if (msgCommand == "FINISHED") {
-        currentPacketNumber = 0;
-        currentFileNameCounter = 0;
-        packetsWrittenToFile = 0;
-        string finalMessage = "FINISHED:";
+    if (strspn(argv[networkNastinessArg], "0123456789") != strlen(argv[networkNastinessArg])) {
+        fprintf(stderr,"Nastiness %s is not numeric\n", argv[networkNastinessArg]);     
+        fprintf(stderr,"Correct syntxt is: %s [-t tracefile] [-T spanfile] [-m group[:port][@ifaddr]] [-w workers] [-d groupfiles] <networknastiness> <filenastiness> <targetdir>\n", argv[0]);     
+        exit(4);
+    }
 
-        Packet finalPacket = createMessagePacket(finalMessage);               
-        writePacket(sock, finalPacket);
+    if (strspn(argv[fileNastinessArg], "0123456789") != strlen(argv[fileNastinessArg])) {
+        fprintf(stderr,"Nastiness %s is not numeric\n", argv[fileNastinessArg]);     
+        fprintf(stderr,"Correct syntxt is: %s [-t tracefile] [-T spanfile] [-m group[:port][@ifaddr]] [-w workers] [-d groupfiles] <networknastiness> <filenastiness> <targetdir>\n", argv[0]);     
+        exit(4);
     }
-}
\ No newline at end of file
+    networkNastiness = atoi(argv[networkNastinessArg]);   // convert command line string to integer
+    fileNastiness = atoi(argv[fileNastinessArg]);   // convert command line string to integer
+}
@@ -1,3 +1,6 @@
+#ifndef __FILEUTILS_H_INCLUDED__
+#define __FILEUTILS_H_INCLUDED__
+
 #include "c150nastyfile.h" 
 #include "c150grading.h"
 #include "c150dgmsocket.h"
@@ -13,131 +16,70 @@
 #include <iostream>            
 #include <fstream>        
 #include <openssl/sha.h>
-#include <iomanip>
 #include <string>
 #include <vector>
-#include <unordered_map>
 
-using namespace C150NETWORK;
-struct Packet {
-    bool isFile;            /* Whether packet is a FILE or MESSAGE */
-    uint32_t packetNum;     /* Global number of each packets */
-    uint16_t totalPackets;  /* Count of the total packets being sent for operation (multiple for FILE, 1 for MESSAGE) */
-    uint16_t dataSize;      /* Size of valid data written to packetData */
-    char packetData[498];   /* Data field of packet: filename for 1st file packet of group, file content, or message */
-};
+#include "packetcodec.h"
+#include "packettrace.h"
+#include "spantrace.h"
+#include "robustread.h"
 
-const int maxHashAttempts = 50; /* Compute the hash this many times*/
+using namespace C150NETWORK;
 
 void copyFile(string sourceDir, string fileName, string targetDir, int nastiness);
 bool isFile(string fname);
 void checkDirectory(char *dirname);
-string makeFileName(string dir, string name);
-string computeHash(const string& filepath);
+void computeHash(const string& filepath, int fileNastiness, unsigned char *digest);
 void checkAndPrintMessage(ssize_t readlen, char *msg, ssize_t bufferlen);
-Packet createMessagePacket(const string &message);
-
-Packet createDataPacket(bool isFile, 
-                        size_t packetNum, 
-                        size_t totalPackets, 
-                        const char *data, 
-                        size_t dataSize);
-
-bool parseResponse(const string &response,
-                   const string &expectedCommand,
-                   const string &expectedFileName,
-                   string &extractedData);
 
-/* Deconstruct a message packet into it's fields */
-bool parseResponse(const string &response,
-                   const string &expectedCommand,
-                   const string &expectedFileName,
-                   string &extractedData) {
+Packet parsePacket(const char *buffer, size_t readlen);
 
-    size_t posColon = response.find(":");
-    size_t posComma = response.find(",");
-
-    if (posColon == string::npos || posComma == string::npos) {
-        return false;
+/* Name of the peer the last packet came from: the server's key for each
+    client, and what traces record. Empty when the socket library cannot say */
+string clientKey(C150DgmSocket *sock) {
+#ifdef C150_HAVE_GET_OTHER_END
+    struct sockaddr_in peer;
+    if (sock->getOtherEnd(peer)) {
+        char address[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &peer.sin_addr, address, sizeof(address));
+        return string(address) + ":" + to_string(ntohs(peer.sin_port));
     }
-
-    string command = response.substr(0, posColon);
-    string fileName = response.substr(posColon + 1, posComma - posColon - 1);
-    extractedData = response.substr(posComma + 1);
- 
-    return (command == expectedCommand && fileName == expectedFileName);
+#endif
+    return "";
 }
 
-/* Create a message packet that is used for end-to-end check */
-Packet createMessagePacket(const string &message) {
-    Packet packet;
-    packet.isFile = false;
-    packet.packetNum = 0;
-    packet.totalPackets = 0;
-    packet.dataSize = message.size();
+/* Write instance of Packet struct over C150DgmSocket */
+void writePacket(C150DgmSocket *sock, const Packet &packet) {
+    char buffer[maxPacketWireSize];
+    size_t offset = serializePacket(packet, buffer);
 
-    if (packet.dataSize > sizeof(packet.packetData)) {
-        throw std::runtime_error("Message size exceeds packetData buffer size");
+    if (packetTrace != nullptr) {
+        packetTrace->record(TRACE_SEND, buffer, offset, clientKey(sock));
     }
 
-    memset(packet.packetData, 0, sizeof(packet.packetData));
-    memcpy(packet.packetData, message.c_str(), packet.dataSize);
-
-    return packet;
+    sock->write(buffer, offset);
 }
 
-/* Create a data packet used for sending file */
-Packet createDataPacket(bool isFile, size_t packetNum, size_t totalPackets, const char *data, size_t dataSize) {
+/* Deserializes a received buffer and constructs a Packet struct from it */
+Packet parsePacket(const char *buffer, size_t readlen) {
     Packet packet;
-    packet.isFile = isFile;
-    packet.packetNum = packetNum;
-    packet.totalPackets = totalPackets;
-    packet.dataSize = dataSize;
-
-    if (dataSize > sizeof(packet.packetData)) {
-        throw runtime_error("Data size exceeds packetData buffer size");
+    const char *error;
+    if (!decodePacket(buffer, readlen, packet, error)) {
+        throw C150Exception(error);
     }
-
-    memcpy(packet.packetData, data, dataSize);
     return packet;
 }
 
-/* Write instance of Packet struct over C150DgmSocket */
-/* Uses network byte order to send the struct as a buffer */
-void writePacket(C150DgmSocket *sock, const Packet &packet) {
-    char buffer[512] = {0};
-    size_t offset = 0;
-
-    uint8_t isFileByte = packet.isFile ? 1 : 0;
-    memcpy(buffer + offset, &isFileByte, sizeof(isFileByte));
-    offset += sizeof(isFileByte);
-
-    uint32_t net_packetNum = htonl(packet.packetNum);
-    memcpy(buffer + offset, &net_packetNum, sizeof(net_packetNum));
-    offset += sizeof(net_packetNum);
-
-    uint16_t net_totalPackets = htons(packet.totalPackets);
-    memcpy(buffer + offset, &net_totalPackets, sizeof(net_totalPackets));
-    offset += sizeof(net_totalPackets);
-
-    uint16_t net_dataSize = htons(packet.dataSize);
-    memcpy(buffer + offset, &net_dataSize, sizeof(net_dataSize));
-    offset += sizeof(net_dataSize);
-
-    memcpy(buffer + offset, packet.packetData, packet.dataSize);
-    offset += packet.dataSize;
-
-    sock->write(buffer, offset);
-}
-
 /* Read from the socket and return a Packet struct */
-/* Deserializes buffer and constructs a Packet struct from it */
 Packet readPacket(C150DgmSocket *sock) {
 
-    char buffer[512] = {0};
+    char buffer[512];
     ssize_t readlen_ssize = sock->read(buffer, sizeof(buffer));
     if (readlen_ssize <= 0) {
         if (sock->timedout()) {
+            if (packetTrace != nullptr) {
+                packetTrace->record(TRACE_TIMEOUT, buffer, 0);
+            }
             throw C150NetworkException("Read timed out");
         } else {
             cout << "PACKET READ FAIL" << endl;
@@ -145,181 +87,38 @@ Packet readPacket(C150DgmSocket *sock) {
         }
     }
 
-    size_t readlen = static_cast<size_t>(readlen_ssize);
-
-    Packet packet;
-    size_t offset = 0;
-    
-    /* Deserialize isFile */
-    if (readlen < offset + sizeof(uint8_t)) {
-        throw C150Exception("Incomplete packet received (isFile)");
-    }
-    uint8_t isFileByte;
-    memcpy(&isFileByte, buffer + offset, sizeof(isFileByte));
-    packet.isFile = (isFileByte != 0);
-    offset += sizeof(isFileByte);
-
-    /* Deserialize packetNum */
-    if (readlen < offset + sizeof(uint32_t)) {
-        throw C150Exception("Incomplete packet received (packetNum)");
-    }
-    uint32_t net_packetNum;
-    memcpy(&net_packetNum, buffer + offset, sizeof(net_packetNum));
-    packet.packetNum = ntohl(net_packetNum);
-    offset += sizeof(net_packetNum);
-
-    /* Deserialize totalPackets */
-    if (readlen < offset + sizeof(uint16_t)) {
-        throw C150Exception("Incomplete packet received (totalPackets)");
-    }
-    uint16_t net_totalPackets;
-    memcpy(&net_totalPackets, buffer + offset, sizeof(net_totalPackets));
-    packet.totalPackets = ntohs(net_totalPackets);
-    offset += sizeof(net_totalPackets);
-
-    /* Deserialise dataSize */
-    if (readlen < offset + sizeof(uint16_t)) {
-        throw C150Exception("Incomplete packet received (dataSize)");
-    }
-    uint16_t net_dataSize;
-    memcpy(&net_dataSize, buffer + offset, sizeof(net_dataSize));
-    packet.dataSize = ntohs(net_dataSize);
-    offset += sizeof(net_dataSize);
-
-    /* Check for a buffer overflow */
-    if (packet.dataSize > sizeof(packet.packetData)) {
-        throw C150Exception("Received packet dataSize exceeds buffer size");
+    if (packetTrace != nullptr) {
+        packetTrace->record(TRACE_RECV, buffer, readlen_ssize, clientKey(sock));
     }
 
-    /* Ensure packet is complete */
-    if (readlen < offset + packet.dataSize) {
-        throw C150Exception("Incomplete packet received (packetData)");
-    }
-
-    memcpy(packet.packetData, buffer + offset, packet.dataSize);
-    offset += packet.dataSize;
-
-    memset(packet.packetData + packet.dataSize, 0, sizeof(packet.packetData) - packet.dataSize);
-
-    return packet;
+    return parsePacket(buffer, static_cast<size_t>(readlen_ssize));
 }
 
-/* Read in a file and compute the hash a single time */
-string computeHashHelper(const string& filepath, int fileNastiness) {
-    NASTYFILE inputFile(fileNastiness);
-    unsigned char obuf[20];  // Buffer to hold the hash output
-    void* fopenretval;
-    struct stat statbuf;
+/* Read in a file, voting chunk by chunk to get past file nastiness, 
+    and compute its SHA-1 digest */
+void computeHashHelper(const string& filepath, int fileNastiness, unsigned char *digest) {
+    SpanScope span("computeHashHelper", filepath);
     size_t sourceSize;
-    char* buffer;
-
-    /* NEEDSWORK: with sufficiently high file nastiness (4+), the E-E check may be 
-    marked as succeeding despite the files not matching due to file nastiness 
-    'cancelling out' at the client and server, resulting in the E-E check passing 
-    despite actual file contents not matching */
-
-    // Open the file in read binary mode using NASTYFILE
-    fopenretval = inputFile.fopen(filepath.c_str(), "rb");
-    if (fopenretval == NULL) {
-        cerr << "Error opening input file " << filepath
-             << " errno=" << strerror(errno) << endl;
-        exit(12);
-    }
-
-    // Get the file size
-    if (lstat(filepath.c_str(), &statbuf) != 0) {
-        cerr << "computeHash: Error stating supplied file " << filepath << endl;
-        exit(20);
-    }
-
-    // Allocate a buffer large enough to hold the entire file
-    sourceSize = statbuf.st_size;
-    buffer = (char*)malloc(sourceSize);
-    if (buffer == nullptr) {
-        cerr << "Failed to allocate memory for file reading" << endl;
-        exit(1);
-    }
+    PooledBuffer buffer;
 
-    // Read the entire file into the buffer
-    size_t bytesRead = inputFile.fread(buffer, 1, sourceSize);
-    if (bytesRead != sourceSize) {
-        cerr << "Error reading file " << filepath
-             << " errno=" << strerror(errno) << endl;
-        free(buffer);
-        exit(16);
-    }
-
-    // Close the file after reading
-    if (inputFile.fclose() != 0) {
-        cerr << "Error closing input file " << filepath
-             << " errno=" << strerror(errno) << endl;
-        free(buffer);
+    try {
+        buffer = sharedRobustReader(fileNastiness).readFile(filepath, sourceSize);
+    } catch (runtime_error& e) {
+        cerr << "computeHash: " << e.what() << " errno=" << strerror(errno) << endl;
         exit(16);
     }
 
     // Compute the SHA-1 hash using the single call version of SHA1
-    SHA1((const unsigned char*)buffer, sourceSize, obuf);
-
-    // Convert the hash to a hexadecimal string
-    stringstream hexStream;
-    for (int i = 0; i < 20; i++) {
-        hexStream << hex << setw(2) << setfill('0') << (int)obuf[i];
-    }
-
-    // Free the allocated buffer memory
-    free(buffer);
-
-    // Return the hash as a hexadecimal string
-    return hexStream.str();
+    SHA1((const unsigned char*)buffer.data(), sourceSize, digest);
 }
 
-/* Compute a file's hash by repeatedly calling computeHashHelper and taking 
-    the most common hash code (a measure to account for file nastiness during
-    the computation of a single hash code) */string computeHash(const string& filepath, int fileNastiness) {
-    unordered_map<string, int> hashMap;
-
-    for (int i = 0; i < maxHashAttempts; i++) {
-        string currHash = computeHashHelper(filepath, fileNastiness);
-        hashMap[currHash]++;
-        // if (hashMap.count(currHash) == 0) { // currHash not yet 
-        //     hashMap
-        // }
-    }
-
-    string mostCommonHash;
-    int maxCount = 0;
-    for (auto& pair : hashMap) {
-        if (pair.second > maxCount) {
-            mostCommonHash = pair.first;
-            maxCount = pair.second;
-        }
-    }
-    
-    return mostCommonHash;
+/* Compute a file's digest. Nastiness is handled by per-chunk voting in
+    the read, so a single pass is enough */
+void computeHash(const string& filepath, int fileNastiness, unsigned char *digest) {
+    SpanScope span("computeHash", filepath);
+    computeHashHelper(filepath, fileNastiness, digest);
 }
 
-// ------------------------------------------------------
-//
-//                   makeFileName
-//
-// Put together a directory and a file name, making
-// sure there's a / in between
-//
-// ------------------------------------------------------
-string
-makeFileName(string dir, string name) {
-  stringstream ss;
-
-  ss << dir;
-  // make sure dir name ends in /
-  if (dir.substr(dir.length()-1,1) != "/")
-    ss << '/';
-  ss << name;     // append file name to dir
-  return ss.str();  // return dir/name
-  
-}
-
-
 // ------------------------------------------------------
 //
 //                   checkDirectory
@@ -364,4 +163,6 @@ isFile(string fname) {
     return false;
   }
   return true;
-}
\ No newline at end of file
+}
+
+#endif
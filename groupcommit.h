@@ -0,0 +1,146 @@
+#ifndef __GROUPCOMMIT_H_INCLUDED__
+#define __GROUPCOMMIT_H_INCLUDED__
+
+/* Durable completion of files that passed their end-to-end check, a group
+   at a time. A passed file is queued rather than renamed, and its LOG is
+   held back. When the group commits, every file in it is fdatasync'd,
+   renamed over its final name, and each directory holding one is fsync'd
+   once. Only then do the clients get their LOGs, so a PASS that a client
+   has seen acknowledged survives a crash.
+
+   A client waits for each LOG before sending its next file, so groups
+   form from concurrent clients. A group commits when every session is
+   waiting on it, when it holds maxFiles files, when the oldest has waited
+   groupCommitWindowMs, or when the socket has been idle for
+   groupCommitIdleMs. */
+
+#include "fileutils.h"
+#include "chunkstore.h"
+#include "spantrace.h"
+#include <fcntl.h>
+#include <chrono>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace C150NETWORK;
+
+const int groupCommitWindowMs = 10;   /* Under the client's RESULT timeout, so retries stay rare */
+const int groupCommitIdleMs = 1;
+
+struct PendingCommit {
+    string tempName;
+    string finalName;
+    string clientKey;
+    uint32_t fileId;
+    ChunkStore *chunkStore;     /* The session's; sessions outlive their pending files */
+#ifdef C150_HAVE_GET_OTHER_END
+    struct sockaddr_in peer;
+#endif
+};
+
+class GroupCommit {
+    vector<PendingCommit> pending;
+    chrono::steady_clock::time_point oldest;
+    size_t maxFiles;
+
+ public:
+    size_t groups;
+    size_t files;
+
+    /* maxFiles of 0 turns group commit off: files are renamed at once */
+    GroupCommit(size_t groupMaxFiles = 0) : maxFiles(groupMaxFiles), groups(0), files(0) {}
+
+    bool enabled() const { return maxFiles > 0; }
+    bool empty() const { return pending.empty(); }
+
+    bool isPending(const string &clientKey, uint32_t fileId) const {
+        for (const PendingCommit &commit : pending) {
+            if (commit.clientKey == clientKey && commit.fileId == fileId) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void add(const PendingCommit &commit) {
+        if (pending.empty()) {
+            oldest = chrono::steady_clock::now();
+        }
+        pending.push_back(commit);
+    }
+
+    /* sessions: how many clients the server is serving */
+    bool due(size_t sessions) const {
+        return pending.size() >= min(maxFiles, sessions) ||
+               (!pending.empty() && chrono::steady_clock::now() - oldest >= chrono::milliseconds(groupCommitWindowMs));
+    }
+
+    /* Make the group durable and send its LOGs */
+    void commit(C150DgmSocket *sock);
+};
+
+/* Flush a file or directory to disk */
+bool syncPath(const string &path, bool dataOnly) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    int result = dataOnly ? fdatasync(fd) : fsync(fd);
+    close(fd);
+    return result == 0;
+}
+
+void GroupCommit::commit(C150DgmSocket *sock) {
+    if (pending.empty()) {
+        return;
+    }
+    SpanScope span("groupCommit", "files", pending.size());
+
+    for (const PendingCommit &commit : pending) {
+        if (!syncPath(commit.tempName, true)) {
+            cerr << "Error syncing " << commit.tempName << " errno=" << strerror(errno) << endl;
+            exit(16);
+        }
+    }
+
+    set<string> directories;
+    for (const PendingCommit &commit : pending) {
+        if (rename(commit.tempName.c_str(), commit.finalName.c_str()) != 0) {
+            cout << "ERROR with RENAME" << endl;
+            continue;
+        }
+        commit.chunkStore->commitFile(commit.finalName);
+        size_t slash = commit.finalName.rfind('/');
+        directories.insert((slash == string::npos) ? "." : commit.finalName.substr(0, slash + 1));
+    }
+    for (const string &directory : directories) {
+        if (!syncPath(directory, false)) {
+            cerr << "Error syncing directory " << directory << " errno=" << strerror(errno) << endl;
+            exit(16);
+        }
+    }
+
+#ifdef C150_HAVE_GET_OTHER_END
+    struct sockaddr_in current;
+    bool haveCurrent = sock->getOtherEnd(current);
+#endif
+    for (const PendingCommit &commit : pending) {
+#ifdef C150_HAVE_GET_OTHER_END
+        sock->setOtherEnd(commit.peer);
+#endif
+        Packet logPacket = createControlPacket(CTRL_LOG, commit.fileId, CTRL_PASS);
+        writePacket(sock, logPacket);
+    }
+#ifdef C150_HAVE_GET_OTHER_END
+    if (haveCurrent) {
+        sock->setOtherEnd(current);
+    }
+#endif
+
+    groups++;
+    files += pending.size();
+    pending.clear();
+}
+
+#endif
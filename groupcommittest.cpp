@@ -0,0 +1,143 @@
+// ------------------------------------------------------
+//
+//                   groupcommittest
+//
+// Drive the server handlers through one file under group
+// commit, repeating the CHECK and RESULT while the group is
+// open and again once it has committed, as a lossy network
+// does. The server must answer every repeat from the check
+// it already made, never by reading a file that has moved.
+//
+//   groupcommittest
+//
+// Prints each step and exits non-zero on the first failure.
+//
+// ------------------------------------------------------
+
+#include "c150dgmsocket.h"
+#include "c150grading.h"
+#include "fileutils.h"
+#include "serverutils.h"
+#include <stdlib.h>
+
+using namespace C150NETWORK;
+
+/* Socket that keeps what the handlers write instead of sending it */
+class CaptureDgmSocket : public C150DgmSocket {
+ public:
+    vector<Packet> written;
+
+    virtual void write(const char *buf, ssize_t lenToWrite) {
+        written.push_back(parsePacket(buf, lenToWrite));
+    }
+};
+
+int failures = 0;
+
+void expect(bool ok, const string &step) {
+    cout << (ok ? "ok     " : "FAILED ") << step << endl;
+    if (!ok) {
+        failures++;
+    }
+}
+
+/* The only reply since the last call, if it is a control message with opcode */
+bool takeReply(CaptureDgmSocket &sock, uint8_t opcode, ControlMessage &message) {
+    bool ok = sock.written.size() == 1 && parseControlMessage(sock.written[0], message) &&
+              message.opcode == opcode;
+    sock.written.clear();
+    return ok;
+}
+
+bool fileExists(const string &path) {
+    struct stat statbuf;
+    return stat(path.c_str(), &statbuf) == 0;
+}
+
+int main(int argc, char *argv[]) {
+    GRADEME(argc, argv);
+
+    char tempDir[] = "/tmp/groupcommittest.XXXXXX";
+    if (mkdtemp(tempDir) == nullptr) {
+        fprintf(stderr, "Error creating a temporary directory\n");
+        exit(8);
+    }
+    string targetDir = tempDir;
+    string fileName = "f1";
+    string contents = "group commit holds this file back until the group is durable";
+
+    CaptureDgmSocket sock;
+    ChunkIndex chunkIndex(0);
+    ServerSession session(0, chunkIndex);
+    GroupCommit groupCommit(8);
+    HeldFiles heldFiles(0);
+    int fileNastiness = 0;
+
+    /* Name packet, then one packet of data: the file's CHECK and RESULT use fileId 2 */
+    uint32_t totalPackets = 2;
+    uint32_t fileId = totalPackets;
+    vector<char> name(nameHeaderLength);
+    name[0] = NAME_LAST;
+    uint32_t net_totalPackets = htonl(totalPackets);
+    memcpy(name.data() + 1, &net_totalPackets, sizeof(net_totalPackets));
+    name.insert(name.end(), fileName.begin(), fileName.end());
+    string data = string(1, (char)DATA_RAW) + contents;
+
+    vector<Packet> filePackets = {
+        createDataPacket(true, 0, totalPackets, name.data(), name.size()),
+        createDataPacket(true, 1, totalPackets, data.data(), data.size())
+    };
+    for (Packet &packet : filePackets) {
+        handleFilePacket(&sock, session.packetsWrittenToFile, session.currentFileNameCounter,
+                         session.currentPacketNumber, packet, session.currentFileName, session.targetName,
+                         session.fileRefused, targetDir, session.logResult, session.logStart,
+                         session.outputFile, session.chunkStore);
+    }
+    sock.written.clear();
+
+    auto send = [&](Packet packet) {
+        handleMessagePacket(&sock, session.currentFileName, session.logStart, session.logResult,
+                            session.targetName, session.fileRefused, targetDir, packet, fileNastiness,
+                            session.currentPacketNumber, session.currentFileNameCounter,
+                            session.packetsWrittenToFile, session.chunkStore, session.fileCheck, groupCommit, "",
+                            heldFiles);
+    };
+
+    unsigned char expected[digestLength];
+    SHA1((const unsigned char *)contents.data(), contents.size(), expected);
+    string tempName = makeFileName(targetDir, fileName + ".TMP");
+    string finalName = makeFileName(targetDir, fileName);
+    ControlMessage reply;
+
+    send(createControlPacket(CTRL_CHECK, fileId));
+    expect(takeReply(sock, CTRL_HASH, reply) && memcmp(reply.digest, expected, digestLength) == 0,
+           "CHECK is answered with the digest of the received file");
+
+    send(createControlPacket(CTRL_RESULT, fileId, CTRL_PASS));
+    expect(sock.written.empty() && !groupCommit.empty(), "a PASS is held for the group, with no LOG yet");
+    expect(fileExists(tempName) && !fileExists(finalName), "the file stays .TMP while the group is open");
+
+    send(createControlPacket(CTRL_CHECK, fileId));
+    expect(takeReply(sock, CTRL_HASH, reply) && memcmp(reply.digest, expected, digestLength) == 0,
+           "a duplicate CHECK while the group is open gets the same digest");
+
+    send(createControlPacket(CTRL_RESULT, fileId, CTRL_PASS));
+    expect(sock.written.empty() && groupCommit.isPending("", fileId),
+           "a duplicate RESULT while the group is open waits for the group");
+
+    groupCommit.commit(&sock);
+    expect(takeReply(sock, CTRL_LOG, reply) && reply.status == CTRL_PASS, "the commit sends the held LOG");
+    expect(!fileExists(tempName) && fileExists(finalName), "the commit renames the file");
+
+    send(createControlPacket(CTRL_CHECK, fileId));
+    expect(takeReply(sock, CTRL_HASH, reply) && memcmp(reply.digest, expected, digestLength) == 0,
+           "a duplicate CHECK after the commit gets the same digest");
+
+    send(createControlPacket(CTRL_RESULT, fileId, CTRL_PASS));
+    expect(takeReply(sock, CTRL_LOG, reply) && reply.status == CTRL_PASS,
+           "a duplicate RESULT after the commit is answered with its LOG");
+
+    unlink(finalName.c_str());
+    rmdir(tempDir);
+    return failures == 0 ? 0 : 1;
+}
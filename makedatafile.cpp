@@ -0,0 +1,188 @@
+// ------------------------------------------------------
+//
+//                   makedatafile
+//
+// Fill a directory with synthetic files for benchmarking.
+//
+//   makedatafile <targetdir> <count> <minsize> <maxsize> <content> [seed]
+//
+// File sizes are drawn log-uniformly between minsize and maxsize so that
+// a wide range gives many small files and a few large ones. Content is
+// one of:
+//
+//    random        incompressible bytes
+//    compressible  text built from a small word list
+//    zeros         all zero bytes
+//
+// The same seed always produces the same directory.
+//
+// ------------------------------------------------------
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+const int targetArg = 1;
+const int countArg = 2;
+const int minSizeArg = 3;
+const int maxSizeArg = 4;
+const int contentArg = 5;
+const int seedArg = 6;
+
+/* Small seeded generator (xorshift64*) so datasets are reproducible */
+struct Random {
+    uint64_t state;
+    Random(uint64_t seed) : state(seed ? seed : 0x9E3779B97F4A7C15ULL) {}
+    uint64_t next() {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545F4914F6CDD1DULL;
+    }
+    double unit() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+};
+
+enum Content { RANDOM, COMPRESSIBLE, ZEROS };
+
+void usage(char *prog) {
+    fprintf(stderr, "Correct syntax is: %s <targetdir> <count> <minsize> <maxsize> "
+                    "<random|compressible|zeros> [seed]\n", prog);
+    exit(1);
+}
+
+/* Parse a size such as 512, 64K or 8M */
+size_t parseSize(const char *arg, char *prog) {
+    char *end;
+    double value = strtod(arg, &end);
+    if (end == arg || value < 0) {
+        fprintf(stderr, "Size %s is not numeric\n", arg);
+        usage(prog);
+    }
+    switch (*end) {
+        case 'k': case 'K': value *= 1024; break;
+        case 'm': case 'M': value *= 1024 * 1024; break;
+        case 'g': case 'G': value *= 1024.0 * 1024 * 1024; break;
+        case '\0': break;
+        default:
+            fprintf(stderr, "Size %s has an unknown suffix\n", arg);
+            usage(prog);
+    }
+    return (size_t)value;
+}
+
+/* Draw a size log-uniformly from [minSize, maxSize] */
+size_t pickSize(Random &random, size_t minSize, size_t maxSize) {
+    if (maxSize <= minSize) {
+        return minSize;
+    }
+    double lo = log((double)minSize + 1);
+    double hi = log((double)maxSize + 1);
+    size_t size = (size_t)(exp(lo + (hi - lo) * random.unit()) - 1);
+    return size < minSize ? minSize : (size > maxSize ? maxSize : size);
+}
+
+/* Fill buffer with the requested kind of content */
+void fillBuffer(Random &random, Content content, vector<char> &buffer) {
+    static const char *words[] = {
+        "packet ", "file ", "server ", "client ", "check ", "hash ", "retry ",
+        "nasty ", "network ", "datagram ", "log\n", "the ", "of ", "and ",
+    };
+    const size_t numWords = sizeof(words) / sizeof(words[0]);
+
+    size_t i = 0;
+    switch (content) {
+        case ZEROS:
+            memset(buffer.data(), 0, buffer.size());
+            break;
+        case RANDOM:
+            while (i < buffer.size()) {
+                uint64_t r = random.next();
+                size_t n = min(sizeof(r), buffer.size() - i);
+                memcpy(buffer.data() + i, &r, n);
+                i += n;
+            }
+            break;
+        case COMPRESSIBLE:
+            while (i < buffer.size()) {
+                const char *word = words[random.next() % numWords];
+                size_t n = min(strlen(word), buffer.size() - i);
+                memcpy(buffer.data() + i, word, n);
+                i += n;
+            }
+            break;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 6 && argc != 7) {
+        usage(argv[0]);
+    }
+
+    const char *targetDir = argv[targetArg];
+    if (strspn(argv[countArg], "0123456789") != strlen(argv[countArg])) {
+        fprintf(stderr, "Count %s is not numeric\n", argv[countArg]);
+        usage(argv[0]);
+    }
+    int count = atoi(argv[countArg]);
+    size_t minSize = parseSize(argv[minSizeArg], argv[0]);
+    size_t maxSize = parseSize(argv[maxSizeArg], argv[0]);
+
+    Content content;
+    if (strcmp(argv[contentArg], "random") == 0) {
+        content = RANDOM;
+    } else if (strcmp(argv[contentArg], "compressible") == 0) {
+        content = COMPRESSIBLE;
+    } else if (strcmp(argv[contentArg], "zeros") == 0) {
+        content = ZEROS;
+    } else {
+        fprintf(stderr, "Unknown content type %s\n", argv[contentArg]);
+        usage(argv[0]);
+    }
+
+    uint64_t seed = (argc == 7) ? strtoull(argv[seedArg], NULL, 10) : 117;
+    Random random(seed);
+
+    if (mkdir(targetDir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error creating target directory %s: %s\n", targetDir, strerror(errno));
+        exit(8);
+    }
+
+    size_t totalBytes = 0;
+    vector<char> buffer;
+    for (int i = 0; i < count; i++) {
+        size_t size = pickSize(random, minSize, maxSize);
+        buffer.resize(size);
+        fillBuffer(random, content, buffer);
+
+        char name[64];
+        snprintf(name, sizeof(name), "data%05d", i);
+        string path = string(targetDir) + "/" + name;
+
+        FILE *out = fopen(path.c_str(), "wb");
+        if (out == NULL) {
+            fprintf(stderr, "Error opening %s: %s\n", path.c_str(), strerror(errno));
+            exit(12);
+        }
+        if (size > 0 && fwrite(buffer.data(), 1, size, out) != size) {
+            fprintf(stderr, "Error writing %s: %s\n", path.c_str(), strerror(errno));
+            exit(16);
+        }
+        if (fclose(out) != 0) {
+            fprintf(stderr, "Error closing %s: %s\n", path.c_str(), strerror(errno));
+            exit(16);
+        }
+        totalBytes += size;
+    }
+
+    printf("%d files, %zu bytes in %s\n", count, totalBytes, targetDir);
+    return 0;
+}
@@ -0,0 +1,378 @@
+#ifndef __MANIFEST_H_INCLUDED__
+#define __MANIFEST_H_INCLUDED__
+
+/* Manifest exchange: before sending anything, the client describes the
+   whole tree as (name, size, content digest) entries in MANIFEST
+   messages, and the server answers each with a HOLD bitmap of the files
+   it already has byte for byte. Those files are not sent at all.
+
+   The client keeps its digests in a hash cache file, keyed by source
+   path and valid while the file's size and mtime are unchanged, so a
+   repeated sync only hashes files that changed. The server hashes its
+   copy of a file the first time it is asked about it and remembers the
+   digest while the file's size, mtime and inode are unchanged. It hashes
+   at most manifestHashBudget bytes while answering one MANIFEST, since
+   every other client waits meanwhile; the files past that are reported
+   as not held and hashed later, deferredHashBudget bytes after each
+   packet the server handles, ready for the next sync; a large file is
+   hashed over many packets, keeping its digest context in between. The digest the
+   end-to-end check computes for a received file is kept by inode, so it
+   still applies once the file is renamed to its final name.
+
+   MANIFEST payload: uint32 first entry index | entries of
+                     digest | uint64 size | uint16 name length | name
+   HOLD payload:     uint32 first entry index | uint16 count | bitmap, LSB first */
+
+#include "fileutils.h"
+#include <limits.h>
+#include <openssl/evp.h>
+#include <sys/stat.h>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+using namespace C150NETWORK;
+
+const size_t manifestEntryHeaderLength = digestLength + sizeof(uint64_t) + sizeof(uint16_t);
+const size_t manifestPayloadLength = sizeof(Packet::packetData) - controlHeaderLength - sizeof(uint32_t);
+const size_t maxManifestNameLength = manifestPayloadLength - manifestEntryHeaderLength;  /* Longer names are always sent */
+const size_t manifestHashBudget = 8 << 20;    /* Bytes the server hashes while answering one MANIFEST */
+const size_t deferredHashBudget = 1 << 20;    /* Bytes of queued files hashed after each packet */
+
+struct ManifestEntry {
+    string name;            /* Relative to the source/target directory */
+    uint64_t size;
+    unsigned char digest[digestLength];
+};
+
+/* Size and mtime, to nanoseconds, of path; false unless it is a regular file */
+bool fileStamp(const string &path, uint64_t &size, int64_t &mtimeNanos, uint64_t *inode = nullptr) {
+    struct stat statbuf;
+    if (stat(path.c_str(), &statbuf) != 0 || !S_ISREG(statbuf.st_mode)) {
+        return false;
+    }
+    size = statbuf.st_size;
+    mtimeNanos = (int64_t)statbuf.st_mtim.tv_sec * 1000000000 + statbuf.st_mtim.tv_nsec;
+    if (inode != nullptr) {
+        *inode = statbuf.st_ino;
+    }
+    return true;
+}
+
+/* Build a MANIFEST packet from entries[first, ...), as many as fit; count is set to how many */
+Packet manifestPacket(uint32_t manifestId, const vector<ManifestEntry> &entries, size_t first, size_t &count) {
+    Packet packet = createControlPacket(CTRL_MANIFEST, manifestId);
+    uint32_t net_first = htonl(first);
+    appendToPacket(packet, &net_first, sizeof(net_first));
+
+    count = 0;
+    for (size_t i = first; i < entries.size(); i++, count++) {
+        const ManifestEntry &entry = entries[i];
+        if (packet.dataSize + manifestEntryHeaderLength + entry.name.size() > sizeof(packet.packetData)) {
+            break;
+        }
+        uint64_t net_size = htobe64(entry.size);
+        uint16_t net_nameLength = htons(entry.name.size());
+        appendToPacket(packet, entry.digest, digestLength);
+        appendToPacket(packet, &net_size, sizeof(net_size));
+        appendToPacket(packet, &net_nameLength, sizeof(net_nameLength));
+        appendToPacket(packet, entry.name.data(), entry.name.size());
+    }
+    return packet;
+}
+
+/* Decode a MANIFEST payload; false if it is malformed */
+bool parseManifest(const ControlMessage &message, uint32_t &first, vector<ManifestEntry> &entries) {
+    uint32_t net_first;
+    if (message.payloadLength < sizeof(net_first)) {
+        return false;
+    }
+    memcpy(&net_first, message.payload, sizeof(net_first));
+    first = ntohl(net_first);
+
+    entries.clear();
+    size_t offset = sizeof(net_first);
+    while (offset < message.payloadLength) {
+        if (offset + manifestEntryHeaderLength > message.payloadLength) {
+            return false;
+        }
+        ManifestEntry entry;
+        uint64_t net_size;
+        uint16_t net_nameLength;
+        memcpy(entry.digest, message.payload + offset, digestLength);
+        memcpy(&net_size, message.payload + offset + digestLength, sizeof(net_size));
+        memcpy(&net_nameLength, message.payload + offset + digestLength + sizeof(net_size), sizeof(net_nameLength));
+        offset += manifestEntryHeaderLength;
+
+        size_t nameLength = ntohs(net_nameLength);
+        if (offset + nameLength > message.payloadLength) {
+            return false;
+        }
+        entry.name.assign(message.payload + offset, nameLength);
+        entry.size = be64toh(net_size);
+        offset += nameLength;
+        entries.push_back(entry);
+    }
+    return true;
+}
+
+/* Client: digests of source files, persisted between runs. The file holds
+   one line per file, "digest size mtime path", and is rewritten whole by
+   save with only the entries looked up in this run */
+class HashCache {
+    struct Record {
+        uint64_t size;
+        int64_t mtimeNanos;
+        unsigned char digest[digestLength];
+        bool used;
+    };
+
+    unordered_map<string, Record> records;
+    string cacheFile;
+
+ public:
+    size_t hits;
+    size_t misses;
+
+    HashCache(const string &path) : cacheFile(path), hits(0), misses(0) {}
+
+    /* Read the cache file; a missing or unreadable one is an empty cache */
+    void load() {
+        FILE *fp = fopen(cacheFile.c_str(), "r");
+        if (fp == nullptr) {
+            return;
+        }
+        char line[PATH_MAX + 128];
+        while (fgets(line, sizeof(line), fp) != nullptr) {
+            char hex[2 * digestLength + 1];
+            unsigned long long size;
+            long long mtimeNanos;
+            int nameStart = 0;
+            if (sscanf(line, "%40s %llu %lld %n", hex, &size, &mtimeNanos, &nameStart) != 3 || nameStart == 0 ||
+                strlen(hex) != 2 * digestLength) {
+                continue;
+            }
+            string path = line + nameStart;
+            if (path.empty() || path.back() != '\n') {
+                continue;
+            }
+            path.pop_back();
+
+            Record record = { size, mtimeNanos, {0}, false };
+            for (size_t i = 0; i < digestLength; i++) {
+                unsigned int byte;
+                sscanf(hex + 2 * i, "%2x", &byte);
+                record.digest[i] = byte;
+            }
+            records[path] = record;
+        }
+        fclose(fp);
+    }
+
+    /* The digest of path, from the cache if the file is unchanged since it
+       was hashed, else computed now; false if it is not a regular file */
+    bool digestOf(const string &path, int fileNastiness, uint64_t &size, unsigned char *digest) {
+        int64_t mtimeNanos;
+        if (!fileStamp(path, size, mtimeNanos)) {
+            return false;
+        }
+
+        auto found = records.find(path);
+        if (found != records.end() && found->second.size == size && found->second.mtimeNanos == mtimeNanos) {
+            found->second.used = true;
+            memcpy(digest, found->second.digest, digestLength);
+            hits++;
+            return true;
+        }
+
+        computeHash(path, fileNastiness, digest);
+        Record record = { size, mtimeNanos, {0}, true };
+        memcpy(record.digest, digest, digestLength);
+        records[path] = record;
+        misses++;
+        return true;
+    }
+
+    /* Write the entries used in this run, replacing the cache file */
+    bool save() {
+        string tempName = cacheFile + ".part";
+        FILE *fp = fopen(tempName.c_str(), "w");
+        if (fp == nullptr) {
+            return false;
+        }
+        for (const auto &entry : records) {
+            if (!entry.second.used || entry.first.find('\n') != string::npos) {
+                continue;
+            }
+            for (size_t i = 0; i < digestLength; i++) {
+                fprintf(fp, "%02x", entry.second.digest[i]);
+            }
+            fprintf(fp, " %llu %lld %s\n", (unsigned long long)entry.second.size,
+                    (long long)entry.second.mtimeNanos, entry.first.c_str());
+        }
+        bool ok = (fclose(fp) == 0);
+        return ok && rename(tempName.c_str(), cacheFile.c_str()) == 0;
+    }
+};
+
+/* Server: digests of files in the target directory, computed on demand.
+   One per server process, shared by every client */
+class HeldFiles {
+    struct Record {
+        uint64_t size;
+        int64_t mtimeNanos;
+        uint64_t inode;
+        unsigned char digest[digestLength];
+    };
+
+    /* The queued file being hashed, a piece per hashQueued */
+    struct PartialHash {
+        string path;
+        Record stamp;           /* Size, mtime and inode when hashing began */
+        uint64_t offset;        /* Bytes hashed so far */
+        unique_ptr<EVP_MD_CTX, void (*)(EVP_MD_CTX *)> context;
+
+        PartialHash() : offset(0), context(nullptr, EVP_MD_CTX_free) {}
+    };
+
+    unordered_map<string, Record> records;
+    unordered_map<uint64_t, Record> checked;    /* From end-to-end checks, by inode */
+    deque<string> queue;            /* Paths to hash once the MANIFEST that named them is answered */
+    unordered_set<string> queued;
+    PartialHash partial;            /* No context when no file is partway */
+    int fileNastiness;
+
+    /* The record for path, hashing the file unless the digest is current */
+    Record &record(const string &path, uint64_t size, int64_t mtimeNanos, uint64_t inode) {
+        Record &found = records[path];
+        if (found.size != size || found.mtimeNanos != mtimeNanos || found.inode != inode) {
+            found.size = size;
+            found.mtimeNanos = mtimeNanos;
+            found.inode = inode;
+            computeHash(path, fileNastiness, found.digest);
+        }
+        return found;
+    }
+
+    /* True if the digest for path is known, taking it from checked if need be */
+    bool current(const string &path, uint64_t size, int64_t mtimeNanos, uint64_t inode) {
+        auto found = records.find(path);
+        if (found != records.end() && found->second.size == size && found->second.mtimeNanos == mtimeNanos &&
+            found->second.inode == inode) {
+            return true;
+        }
+
+        auto check = checked.find(inode);
+        if (check == checked.end() || check->second.size != size || check->second.mtimeNanos != mtimeNanos) {
+            return false;
+        }
+        records[path] = check->second;
+        checked.erase(check);
+        return true;
+    }
+
+ public:
+    HeldFiles(int fileNastiness) : fileNastiness(fileNastiness) {}
+
+    /* Keep the digest an end-to-end check computed for the file at path */
+    void remember(const string &path, const unsigned char *digest) {
+        Record record;
+        if (fileStamp(path, record.size, record.mtimeNanos, &record.inode)) {
+            memcpy(record.digest, digest, digestLength);
+            checked[record.inode] = record;
+        }
+    }
+
+    /* True if the file at path has exactly the size and digest given. A
+       file with no current digest is hashed now if its size fits in
+       budget, which it is taken from; otherwise it is queued for
+       hashQueued and reported as not held */
+    bool holds(const string &path, uint64_t size, const unsigned char *digest, size_t &budget) {
+        uint64_t heldSize;
+        int64_t mtimeNanos;
+        uint64_t inode;
+        if (!fileStamp(path, heldSize, mtimeNanos, &inode) || heldSize != size) {
+            return false;
+        }
+
+        if (!current(path, heldSize, mtimeNanos, inode)) {
+            if (heldSize > budget) {
+                if (queued.insert(path).second) {
+                    queue.push_back(path);
+                }
+                return false;
+            }
+            budget -= heldSize;
+        }
+        return memcmp(record(path, heldSize, mtimeNanos, inode).digest, digest, digestLength) == 0;
+    }
+
+    /* Hash queued files until budget bytes have gone, stopping partway
+       through a file if need be and going on from there next time */
+    void hashQueued(size_t budget) {
+        size_t hashed = 0;
+        while (hashed < budget && (partial.context || !queue.empty())) {
+            if (!partial.context) {
+                string path = queue.front();
+                queue.pop_front();
+                queued.erase(path);
+
+                Record &stamp = partial.stamp;
+                if (!fileStamp(path, stamp.size, stamp.mtimeNanos, &stamp.inode) ||
+                    current(path, stamp.size, stamp.mtimeNanos, stamp.inode)) {
+                    continue;
+                }
+                partial.path = path;
+                partial.offset = 0;
+                partial.context.reset(EVP_MD_CTX_new());
+                EVP_DigestInit_ex(partial.context.get(), EVP_sha1(), nullptr);
+            }
+            hashed += hashPiece(budget - hashed);
+        }
+    }
+
+ private:
+    /* Hash up to limit more bytes of the partial file, whole robust-read
+       chunks at a time, and record its digest once it is all hashed. A file
+       that changes or cannot be read is dropped, for a later MANIFEST to
+       queue again */
+    size_t hashPiece(size_t limit) {
+        Record now;
+        const Record &stamp = partial.stamp;
+        if (!fileStamp(partial.path, now.size, now.mtimeNanos, &now.inode) || now.size != stamp.size ||
+            now.mtimeNanos != stamp.mtimeNanos || now.inode != stamp.inode) {
+            partial.context.reset();
+            return 0;
+        }
+
+        size_t length = min<uint64_t>(stamp.size - partial.offset,
+                                      max(robustChunkSize, limit / robustChunkSize * robustChunkSize));
+        if (length > 0) {
+            PooledBuffer buffer = sharedBufferPool().acquire(length);
+            try {
+                sharedRobustReader(fileNastiness).readRange(partial.path, stamp.size, partial.offset, length,
+                                                            buffer.data());
+            } catch (runtime_error& e) {
+                cerr << "hashQueued: " << e.what() << endl;
+                partial.context.reset();
+                return length;
+            }
+            EVP_DigestUpdate(partial.context.get(), buffer.data(), length);
+            partial.offset += length;
+        }
+
+        if (partial.offset == stamp.size) {
+            Record &found = records[partial.path];
+            found = stamp;
+            EVP_DigestFinal_ex(partial.context.get(), found.digest, nullptr);
+            partial.context.reset();
+        }
+        return length;
+    }
+};
+
+#endif
@@ -0,0 +1,307 @@
+// microbench: time the per-packet and per-file hot paths in isolation.
+//
+// Builds against packetcodec.h and bufferpool.h only, with no C150 library
+// and no sockets, so it runs anywhere OpenSSL does. Each case is repeated
+// until it has run for at least the minimum time, and reported as one CSV
+// row: nanoseconds and operator new calls per operation, and bytes/sec
+// over the bytes each operation handles (wire bytes for the codec, file
+// bytes for hashing).
+//
+//   microbench [-t millis] [-o csvfile] [filter]
+//
+// With -o, rows are appended to csvfile (header written if it is new) so
+// runs can be compared over time; otherwise they go to stdout. Only cases
+// whose name contains filter are run.
+
+#include "packetcodec.h"
+#include "bufferpool.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <functional>
+#include <new>
+#include <string>
+#include <vector>
+
+/* operator new calls, counted for allocs/op; buffer pool allocations use
+   posix_memalign and are not counted, being reused across operations */
+static uint64_t allocations = 0;
+
+void *operator new(size_t size) {
+    allocations++;
+    void *p = malloc(size ? size : 1);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+/* Keep the compiler from dropping a result nobody reads */
+template <typename T>
+void keep(const T &value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+const size_t hashReadChunk = 64 * 1024;   /* As RobustReader reads files */
+
+struct BenchResult {
+    uint64_t iterations;
+    double nsPerOp;
+    double allocsPerOp;
+};
+
+/* Run op in doubling batches until a batch takes minNanos */
+BenchResult runBench(const function<void()> &op, uint64_t minNanos) {
+    op();   /* Warm up caches and the buffer pool */
+
+    for (uint64_t batch = 1;; batch *= 2) {
+        uint64_t allocsBefore = allocations;
+        auto start = chrono::steady_clock::now();
+        for (uint64_t i = 0; i < batch; i++) {
+            op();
+        }
+        uint64_t nanos = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        if (nanos >= minNanos || batch >= (1ull << 40)) {
+            return { batch, (double)nanos / batch, (double)(allocations - allocsBefore) / batch };
+        }
+    }
+}
+
+/* Read a whole file into a pooled buffer and SHA-1 it: a stand-in for
+   computeHashHelper at file nastiness 0, without the NASTYFILE layer or
+   the robust reader, which need the C150 library */
+bool sha1File(const string &path, unsigned char *digest) {
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (fp == nullptr) {
+        return false;
+    }
+    fseek(fp, 0, SEEK_END);
+    size_t size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    PooledBuffer buffer = sharedBufferPool().acquire(size);
+    size_t done = 0;
+    while (done < size) {
+        size_t got = fread(buffer.data() + done, 1, min(hashReadChunk, size - done), fp);
+        if (got == 0) {
+            break;
+        }
+        done += got;
+    }
+    fclose(fp);
+
+    SHA1((const unsigned char *)buffer.data(), done, digest);
+    return done == size;
+}
+
+struct BenchCase {
+    string name;
+    string param;
+    size_t bytesPerOp;
+    function<void()> op;
+};
+
+int main(int argc, char *argv[]) {
+    int minMillis = 200;
+    string csvFile;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:o:")) != -1) {
+        switch (opt) {
+            case 't':
+                minMillis = atoi(optarg);
+                break;
+            case 'o':
+                csvFile = optarg;
+                break;
+            default:
+                fprintf(stderr, "Correct syntax is: %s [-t millis] [-o csvfile] [filter]\n", argv[0]);
+                exit(1);
+        }
+    }
+    string filter = (optind < argc) ? argv[optind] : "";
+    if (minMillis < 1 || optind + 1 < argc) {
+        fprintf(stderr, "Correct syntax is: %s [-t millis] [-o csvfile] [filter]\n", argv[0]);
+        exit(1);
+    }
+
+    char tempDir[] = "/tmp/microbench.XXXXXX";
+    if (mkdtemp(tempDir) == nullptr) {
+        fprintf(stderr, "Error creating a temporary directory\n");
+        exit(8);
+    }
+
+    vector<BenchCase> cases;
+    vector<char> payload(sizeof(Packet::packetData));
+    for (size_t i = 0; i < payload.size(); i++) {
+        payload[i] = (char)(i * 131 + 7);
+    }
+
+    /* Packet codec across payload sizes, up to a full data packet */
+    for (size_t size : {0, 64, 256, (int)sizeof(Packet::packetData)}) {
+        Packet packet = createDataPacket(true, 123456, 1000, payload.data(), size);
+        size_t wireSize = maxPacketWireSize - sizeof(Packet::packetData) + size;
+        string param = "payload=" + to_string(size);
+
+        cases.push_back({"createDataPacket", param, size, [&payload, size]() {
+            Packet built = createDataPacket(true, 123456, 1000, payload.data(), size);
+            keep(built);
+        }});
+
+        cases.push_back({"serializePacket", param, wireSize, [packet]() {
+            char buffer[maxPacketWireSize];
+            size_t length = serializePacket(packet, buffer);
+            keep(length);
+            keep(buffer);
+        }});
+
+        char wire[maxPacketWireSize];
+        serializePacket(packet, wire);
+        vector<char> datagram(wire, wire + wireSize);
+        cases.push_back({"decodePacket", param, wireSize, [datagram]() {
+            Packet decoded;
+            const char *error;
+            bool ok = decodePacket(datagram.data(), datagram.size(), decoded, error);
+            keep(ok);
+            keep(decoded);
+        }});
+    }
+
+    /* Control messages: the end-to-end check pair, and a full QUERY */
+    unsigned char digest[digestLength];
+    SHA1((const unsigned char *)payload.data(), payload.size(), digest);
+    cases.push_back({"createControlPacket", "CHECK", controlHeaderLength, []() {
+        Packet built = createControlPacket(CTRL_CHECK, 987654);
+        keep(built);
+    }});
+    cases.push_back({"createControlPacket", "HASH", controlHeaderLength + digestLength, [&digest]() {
+        Packet built = createControlPacket(CTRL_HASH, 987654, CTRL_FAIL, digest);
+        keep(built);
+    }});
+
+    Packet queryPacket = createControlPacket(CTRL_QUERY, 987654);
+    uint16_t net_first = 0;
+    appendToPacket(queryPacket, &net_first, sizeof(net_first));
+    for (size_t i = 0; i < maxQueryEntries; i++) {
+        uint32_t net_length = htonl(8192);
+        appendToPacket(queryPacket, digest, digestLength);
+        appendToPacket(queryPacket, &net_length, sizeof(net_length));
+    }
+    cases.push_back({"appendToPacket", "QUERY", queryPacket.dataSize, [&digest]() {
+        Packet built = createControlPacket(CTRL_QUERY, 987654);
+        uint16_t net_first = 0;
+        appendToPacket(built, &net_first, sizeof(net_first));
+        for (size_t i = 0; i < maxQueryEntries; i++) {
+            uint32_t net_length = htonl(8192);
+            appendToPacket(built, digest, digestLength);
+            appendToPacket(built, &net_length, sizeof(net_length));
+        }
+        keep(built);
+    }});
+
+    Packet hashPacket = createControlPacket(CTRL_HASH, 987654, CTRL_FAIL, digest);
+    cases.push_back({"parseControlMessage", "HASH", hashPacket.dataSize, [hashPacket]() {
+        ControlMessage message;
+        bool ok = parseControlMessage(hashPacket, message);
+        keep(ok);
+        keep(message);
+    }});
+    cases.push_back({"parseControlMessage", "QUERY", queryPacket.dataSize, [queryPacket]() {
+        ControlMessage message;
+        bool ok = parseControlMessage(queryPacket, message);
+        keep(ok);
+        keep(message);
+    }});
+
+    /* File names as the client and server build them */
+    string shortDir = "src";
+    string shortName = "data1";
+    string longDir = "/home/user/projects/filecopy/testdata/source";
+    string longName = "nested/directory/levels/with/a/fairly/long/file-name-0123456789.bin";
+    cases.push_back({"makeFileName", "short", shortDir.size() + shortName.size() + 1, [&]() {
+        string name = makeFileName(shortDir, shortName);
+        keep(name);
+    }});
+    cases.push_back({"makeFileName", "long", longDir.size() + longName.size() + 1, [&]() {
+        string name = makeFileName(longDir, longName);
+        keep(name);
+    }});
+
+    /* Whole-file hashing across file sizes: SHA-1 alone, and with the read */
+    vector<string> hashFiles;
+    for (size_t size : {4096, 65536, 1 << 20, 16 << 20}) {
+        string param = "size=" + to_string(size);
+        string path = string(tempDir) + "/hash" + to_string(size);
+        vector<char> contents(size);
+        for (size_t i = 0; i < size; i++) {
+            contents[i] = (char)(i * 2654435761u >> 13);
+        }
+        FILE *fp = fopen(path.c_str(), "wb");
+        if (fp == nullptr || fwrite(contents.data(), 1, size, fp) != size || fclose(fp) != 0) {
+            fprintf(stderr, "Error writing %s\n", path.c_str());
+            exit(8);
+        }
+        hashFiles.push_back(path);
+
+        cases.push_back({"sha1", param, size, [contents]() {
+            unsigned char out[digestLength];
+            SHA1((const unsigned char *)contents.data(), contents.size(), out);
+            keep(out);
+        }});
+        cases.push_back({"sha1File", param, size, [path]() {
+            unsigned char out[digestLength];
+            if (!sha1File(path, out)) {
+                fprintf(stderr, "Error reading %s\n", path.c_str());
+                exit(8);
+            }
+            keep(out);
+        }});
+    }
+
+    FILE *out = stdout;
+    if (!csvFile.empty()) {
+        bool exists = access(csvFile.c_str(), F_OK) == 0;
+        out = fopen(csvFile.c_str(), "a");
+        if (out == nullptr) {
+            fprintf(stderr, "Error opening %s\n", csvFile.c_str());
+            exit(8);
+        }
+        if (!exists) {
+            fprintf(out, "date,benchmark,param,iterations,ns_per_op,bytes_per_op,mb_per_s,allocs_per_op\n");
+        }
+    } else {
+        fprintf(out, "date,benchmark,param,iterations,ns_per_op,bytes_per_op,mb_per_s,allocs_per_op\n");
+    }
+
+    char date[32];
+    time_t now = time(nullptr);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+
+    for (const BenchCase &bench : cases) {
+        if (!filter.empty() && (bench.name + "/" + bench.param).find(filter) == string::npos) {
+            continue;
+        }
+        BenchResult result = runBench(bench.op, (uint64_t)minMillis * 1000000);
+        double mbPerSecond = (result.nsPerOp > 0) ? bench.bytesPerOp / result.nsPerOp * 1e3 : 0;
+        fprintf(out, "%s,%s,%s,%llu,%.1f,%zu,%.1f,%.2f\n", date, bench.name.c_str(), bench.param.c_str(),
+                (unsigned long long)result.iterations, result.nsPerOp, bench.bytesPerOp, mbPerSecond,
+                result.allocsPerOp);
+        fflush(out);
+    }
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    for (const string &path : hashFiles) {
+        unlink(path.c_str());
+    }
+    rmdir(tempDir);
+    return 0;
+}
@@ -0,0 +1,291 @@
+#ifndef __PACKETCODEC_H_INCLUDED__
+#define __PACKETCODEC_H_INCLUDED__
+
+/* The Packet struct, its wire layout and the control and data payloads
+   carried in it. Nothing here touches a socket or the C150 library, so
+   microbench builds against this alone; fileutils.h adds the socket
+   reads and writes around it. */
+
+#include <arpa/inet.h>
+#include <openssl/sha.h>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+using namespace std;
+
+
+struct Packet {
+    bool isFile;            /* Whether packet is a FILE or MESSAGE */
+    uint32_t packetNum;     /* Global number of each packets */
+    uint16_t totalPackets;  /* Count of the total packets being sent for operation (multiple for FILE, 1 for MESSAGE) */
+    uint16_t dataSize;      /* Size of valid data written to packetData */
+    char packetData[498];   /* Data field of packet: filename for 1st file packet of group, file content, or message */
+};
+
+string makeFileName(string dir, string name);
+
+
+Packet createDataPacket(bool isFile, 
+                        size_t packetNum, 
+                        size_t totalPackets, 
+                        const char *data, 
+                        size_t dataSize);
+
+/* Control messages travel in MESSAGE packets as fixed-width binary fields:
+      uint8 opcode | uint8 status | uint32 fileId | digest (HASH only)
+   fileId is the packet number just past the file's last FILE packet, so a
+   message names one transfer attempt of one file regardless of how long
+   the filename is. */
+enum ControlOpcode : uint8_t {
+    CTRL_CHECK = 1,     /* client: hash your copy of fileId */
+    CTRL_HASH = 2,      /* server: here is the digest of fileId */
+    CTRL_RESULT = 3,    /* client: end-to-end check of fileId passed/failed */
+    CTRL_LOG = 4,       /* server: result for fileId recorded */
+    CTRL_FINISHED = 5,  /* either side: all files sent */
+    CTRL_QUERY = 6,     /* client: which of these chunks do you hold? */
+    CTRL_HAVE = 7,      /* server: bitmap of the queried chunks it holds */
+    CTRL_HELLO = 8,     /* fan-out: client looks for servers, servers answer with their id */
+    CTRL_POLL = 9,      /* fan-out client: what are you missing of fileId? */
+    CTRL_NACK = 10,     /* fan-out server: these packet ranges of fileId are missing */
+    CTRL_DONE = 11,     /* fan-out server: all of fileId has arrived */
+    CTRL_MANIFEST = 12, /* client: do you hold these files as they are? */
+    CTRL_HOLD = 13      /* server: bitmap of the manifest entries it holds */
+};
+
+enum ControlStatus : uint8_t { CTRL_FAIL = 0, CTRL_PASS = 1 };
+
+const size_t digestLength = SHA_DIGEST_LENGTH;
+const size_t controlHeaderLength = 6;
+
+struct ControlMessage {
+    uint8_t opcode;
+    uint8_t status;
+    uint32_t fileId;
+    const unsigned char *digest;    /* Points into the parsed packet; null unless HASH */
+    const char *payload;            /* Bytes after the fixed fields, also in the packet */
+    size_t payloadLength;
+};
+
+/* QUERY payload: uint16 first chunk index | entries of digest + uint32 length.
+   HAVE payload:  uint16 first chunk index | uint16 count | bitmap, LSB first */
+const size_t queryEntryLength = digestLength + sizeof(uint32_t);
+const size_t maxQueryEntries = (sizeof(Packet::packetData) - controlHeaderLength - sizeof(uint16_t)) / queryEntryLength;
+
+/* Every FILE packet after the filename starts with one of these */
+enum DataKind : uint8_t {
+    DATA_RAW = 0,       /* file bytes */
+    DATA_CHUNKREF = 1,  /* digests of chunks to copy from the server's chunk store */
+    DATA_ZERO = 2,      /* uint64 length of a run of zeros, left as a hole */
+    DATA_SEEK = 3       /* uint64 offset in the file that the next data goes to */
+};
+
+/* Filename packets start with flags and the uint32 number of packets, name
+   and data, in the file's sequence; totalPackets in the header is only 16 bits */
+enum NameFlags : uint8_t {
+    NAME_LAST = 1,      /* last fragment of the name */
+    NAME_STRIPE = 2     /* a stripe of a file another sequence has created: open it for update */
+};
+const size_t nameHeaderLength = 1 + sizeof(uint32_t);
+
+const size_t maxRefsPerPacket = (sizeof(Packet::packetData) - 1) / digestLength;
+
+Packet createControlPacket(uint8_t opcode,
+                           uint32_t fileId,
+                           uint8_t status = CTRL_FAIL,
+                           const unsigned char *digest = nullptr);
+
+bool parseControlMessage(const Packet &packet, ControlMessage &message);
+
+void appendToPacket(Packet &packet, const void *data, size_t length);
+
+/* isFile, packetNum, totalPackets and dataSize ahead of the data */
+const size_t maxPacketWireSize = 1 + 4 + 2 + 2 + sizeof(Packet::packetData);
+
+size_t serializePacket(const Packet &packet, char *buffer);
+
+/* Decode a received datagram into packet; false, with the reason in error,
+    if it is short or its dataSize does not fit */
+bool decodePacket(const char *buffer, size_t readlen, Packet &packet, const char *&error);
+
+/* Create a message packet that is used for end-to-end check */
+Packet createControlPacket(uint8_t opcode, uint32_t fileId, uint8_t status, const unsigned char *digest) {
+    Packet packet;
+    packet.isFile = false;
+    packet.packetNum = 0;
+    packet.totalPackets = 0;
+    packet.dataSize = controlHeaderLength + (digest != nullptr ? digestLength : 0);
+
+    uint32_t net_fileId = htonl(fileId);
+    packet.packetData[0] = (char)opcode;
+    packet.packetData[1] = (char)status;
+    memcpy(packet.packetData + 2, &net_fileId, sizeof(net_fileId));
+    if (digest != nullptr) {
+        memcpy(packet.packetData + controlHeaderLength, digest, digestLength);
+    }
+
+    return packet;
+}
+
+/* Decode a message packet in place; false if it is not a well formed control message */
+bool parseControlMessage(const Packet &packet, ControlMessage &message) {
+    if (packet.isFile || packet.dataSize < controlHeaderLength) {
+        return false;
+    }
+
+    uint32_t net_fileId;
+    message.opcode = (uint8_t)packet.packetData[0];
+    message.status = (uint8_t)packet.packetData[1];
+    memcpy(&net_fileId, packet.packetData + 2, sizeof(net_fileId));
+    message.fileId = ntohl(net_fileId);
+    message.digest = nullptr;
+    message.payload = packet.packetData + controlHeaderLength;
+    message.payloadLength = packet.dataSize - controlHeaderLength;
+
+    if (message.opcode == CTRL_HASH) {
+        if (packet.dataSize < controlHeaderLength + digestLength) {
+            return false;
+        }
+        message.digest = (const unsigned char *)packet.packetData + controlHeaderLength;
+    }
+
+    return message.opcode >= CTRL_CHECK && message.opcode <= CTRL_HOLD;
+}
+
+/* Add variable-length fields to the end of a packet built above */
+void appendToPacket(Packet &packet, const void *data, size_t length) {
+    if (packet.dataSize + length > sizeof(packet.packetData)) {
+        throw runtime_error("Data size exceeds packetData buffer size");
+    }
+    memcpy(packet.packetData + packet.dataSize, data, length);
+    packet.dataSize += length;
+}
+
+/* Create a data packet used for sending file */
+Packet createDataPacket(bool isFile, size_t packetNum, size_t totalPackets, const char *data, size_t dataSize) {
+    Packet packet;
+    packet.isFile = isFile;
+    packet.packetNum = packetNum;
+    packet.totalPackets = totalPackets;
+    packet.dataSize = dataSize;
+
+    if (dataSize > sizeof(packet.packetData)) {
+        throw runtime_error("Data size exceeds packetData buffer size");
+    }
+
+    memcpy(packet.packetData, data, dataSize);
+    return packet;
+}
+
+/* Lay a Packet out in buffer, which must hold maxPacketWireSize bytes,
+    using network byte order; returns the number of bytes used */
+size_t serializePacket(const Packet &packet, char *buffer) {
+    size_t offset = 0;
+
+    uint8_t isFileByte = packet.isFile ? 1 : 0;
+    memcpy(buffer + offset, &isFileByte, sizeof(isFileByte));
+    offset += sizeof(isFileByte);
+
+    uint32_t net_packetNum = htonl(packet.packetNum);
+    memcpy(buffer + offset, &net_packetNum, sizeof(net_packetNum));
+    offset += sizeof(net_packetNum);
+
+    uint16_t net_totalPackets = htons(packet.totalPackets);
+    memcpy(buffer + offset, &net_totalPackets, sizeof(net_totalPackets));
+    offset += sizeof(net_totalPackets);
+
+    uint16_t net_dataSize = htons(packet.dataSize);
+    memcpy(buffer + offset, &net_dataSize, sizeof(net_dataSize));
+    offset += sizeof(net_dataSize);
+
+    memcpy(buffer + offset, packet.packetData, packet.dataSize);
+    offset += packet.dataSize;
+
+    return offset;
+}
+
+/* Deserializes a received buffer into a Packet struct */
+bool decodePacket(const char *buffer, size_t readlen, Packet &packet, const char *&error) {
+    size_t offset = 0;
+    
+    /* Deserialize isFile */
+    if (readlen < offset + sizeof(uint8_t)) {
+        error = "Incomplete packet received (isFile)";
+        return false;
+    }
+    uint8_t isFileByte;
+    memcpy(&isFileByte, buffer + offset, sizeof(isFileByte));
+    packet.isFile = (isFileByte != 0);
+    offset += sizeof(isFileByte);
+
+    /* Deserialize packetNum */
+    if (readlen < offset + sizeof(uint32_t)) {
+        error = "Incomplete packet received (packetNum)";
+        return false;
+    }
+    uint32_t net_packetNum;
+    memcpy(&net_packetNum, buffer + offset, sizeof(net_packetNum));
+    packet.packetNum = ntohl(net_packetNum);
+    offset += sizeof(net_packetNum);
+
+    /* Deserialize totalPackets */
+    if (readlen < offset + sizeof(uint16_t)) {
+        error = "Incomplete packet received (totalPackets)";
+        return false;
+    }
+    uint16_t net_totalPackets;
+    memcpy(&net_totalPackets, buffer + offset, sizeof(net_totalPackets));
+    packet.totalPackets = ntohs(net_totalPackets);
+    offset += sizeof(net_totalPackets);
+
+    /* Deserialise dataSize */
+    if (readlen < offset + sizeof(uint16_t)) {
+        error = "Incomplete packet received (dataSize)";
+        return false;
+    }
+    uint16_t net_dataSize;
+    memcpy(&net_dataSize, buffer + offset, sizeof(net_dataSize));
+    packet.dataSize = ntohs(net_dataSize);
+    offset += sizeof(net_dataSize);
+
+    /* Check for a buffer overflow */
+    if (packet.dataSize > sizeof(packet.packetData)) {
+        error = "Received packet dataSize exceeds buffer size";
+        return false;
+    }
+
+    /* Ensure packet is complete */
+    if (readlen < offset + packet.dataSize) {
+        error = "Incomplete packet received (packetData)";
+        return false;
+    }
+
+    memcpy(packet.packetData, buffer + offset, packet.dataSize);
+    return true;
+}
+
+
+// ------------------------------------------------------
+//
+//                   makeFileName
+//
+// Put together a directory and a file name, making
+// sure there's a / in between
+//
+// ------------------------------------------------------
+string
+makeFileName(string dir, string name) {
+  stringstream ss;
+
+  ss << dir;
+  // make sure dir name ends in /
+  if (dir.substr(dir.length()-1,1) != "/")
+    ss << '/';
+  ss << name;     // append file name to dir
+  return ss.str();  // return dir/name
+  
+}
+
+#endif
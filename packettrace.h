@@ -0,0 +1,148 @@
+#ifndef __PACKETTRACE_H_INCLUDED__
+#define __PACKETTRACE_H_INCLUDED__
+
+/* Compact binary trace of every datagram a program sends or receives.
+
+   File layout (all integers in network byte order):
+     header:  "FCTR" | uint8 version | uint8 role
+     record:  uint32 microseconds since previous record | uint8 direction |
+              uint16 length | uint8 peer length | peer |
+              length bytes of datagram
+   The peer is the address:port the datagram came from or went to, empty
+   when the socket library cannot say. A read that times out is recorded
+   as TRACE_TIMEOUT with no data. */
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
+
+const uint8_t TRACE_VERSION = 2;
+
+enum TraceRole { TRACE_CLIENT = 1, TRACE_SERVER = 2 };
+enum TraceDirection { TRACE_SEND = 1, TRACE_RECV = 2, TRACE_TIMEOUT = 3 };
+
+struct TraceRecord {
+    uint64_t micros;        /* Microseconds since the trace started */
+    uint8_t direction;
+    std::string peer;
+    std::vector<char> data;
+};
+
+class PacketTrace {
+    FILE *fp;
+    std::chrono::steady_clock::time_point last;
+    std::chrono::steady_clock::time_point lastFlush;
+    uint64_t micros;
+    uint8_t role;
+
+ public:
+    PacketTrace() : fp(nullptr), micros(0), role(0) {}
+    ~PacketTrace() { close(); }
+
+    /* Start a new trace for writing */
+    bool create(const std::string &path, uint8_t traceRole) {
+        fp = fopen(path.c_str(), "wb");
+        if (fp == nullptr) {
+            return false;
+        }
+        role = traceRole;
+        uint8_t header[6] = { 'F', 'C', 'T', 'R', TRACE_VERSION, role };
+        fwrite(header, 1, sizeof(header), fp);
+        last = lastFlush = std::chrono::steady_clock::now();
+        return true;
+    }
+
+    /* Open an existing trace for reading */
+    bool open(const std::string &path) {
+        fp = fopen(path.c_str(), "rb");
+        if (fp == nullptr) {
+            return false;
+        }
+        uint8_t header[6];
+        if (fread(header, 1, sizeof(header), fp) != sizeof(header) ||
+            memcmp(header, "FCTR", 4) != 0 || header[4] != TRACE_VERSION) {
+            close();
+            return false;
+        }
+        role = header[5];
+        micros = 0;
+        return true;
+    }
+
+    uint8_t getRole() const { return role; }
+
+    /* Append one datagram. Flushes at most every 100ms so a killed
+       server loses little of its trace. */
+    void record(uint8_t direction, const char *buf, size_t len, const std::string &peer = "") {
+        if (fp == nullptr) {
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        uint64_t delta = std::chrono::duration_cast<std::chrono::microseconds>(now - last).count();
+        last = now;
+
+        char header[8];
+        uint32_t netDelta = htonl(delta > UINT32_MAX ? UINT32_MAX : (uint32_t)delta);
+        uint16_t netLen = htons((uint16_t)len);
+        size_t peerLength = std::min(peer.size(), (size_t)UINT8_MAX);
+        memcpy(header, &netDelta, sizeof(netDelta));
+        header[4] = (char)direction;
+        memcpy(header + 5, &netLen, sizeof(netLen));
+        header[7] = (char)peerLength;
+        fwrite(header, 1, sizeof(header), fp);
+        fwrite(peer.data(), 1, peerLength, fp);
+        fwrite(buf, 1, len, fp);
+
+        if (now - lastFlush > std::chrono::milliseconds(100)) {
+            fflush(fp);
+            lastFlush = now;
+        }
+    }
+
+    /* Read the next record, returning false at end of trace */
+    bool next(TraceRecord &rec) {
+        char header[8];
+        if (fp == nullptr || fread(header, 1, sizeof(header), fp) != sizeof(header)) {
+            return false;
+        }
+        uint32_t netDelta;
+        uint16_t netLen;
+        memcpy(&netDelta, header, sizeof(netDelta));
+        memcpy(&netLen, header + 5, sizeof(netLen));
+
+        micros += ntohl(netDelta);
+        rec.micros = micros;
+        rec.direction = (uint8_t)header[4];
+        rec.peer.resize((uint8_t)header[7]);
+        if (!rec.peer.empty() && fread(&rec.peer[0], 1, rec.peer.size(), fp) != rec.peer.size()) {
+            return false;
+        }
+        rec.data.resize(ntohs(netLen));
+        return rec.data.empty() || fread(rec.data.data(), 1, rec.data.size(), fp) == rec.data.size();
+    }
+
+    void flush() {
+        if (fp != nullptr) {
+            fflush(fp);
+            lastFlush = std::chrono::steady_clock::now();
+        }
+    }
+
+    void close() {
+        if (fp != nullptr) {
+            fclose(fp);
+            fp = nullptr;
+        }
+    }
+};
+
+/* Trace used by writePacket/readPacket; tracing is off while this is null.
+   Per thread, so that only the thread that set it up is traced */
+thread_local PacketTrace *packetTrace = nullptr;
+
+#endif
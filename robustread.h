@@ -0,0 +1,214 @@
+#ifndef __ROBUSTREAD_H_INCLUDED__
+#define __ROBUSTREAD_H_INCLUDED__
+
+/* Reading a whole file correctly through a nasty file system.
+
+   The file is read in fixed-size chunks. Each chunk is read through
+   independently opened handles until one version of it has a majority
+   of the reads; normally that is the first two reads agreeing, and only
+   chunks that disagree are read again. Each extra read goes through a
+   handle opened for it alone, so its vote does not hang on a handle that
+   has already read. Once more than a small fraction of chunks have
+   disagreed, three agreeing reads are needed before a chunk is trusted,
+   since corruption that common may hit two reads alike.
+   With file nastiness 0 every chunk is read once. Chunks that lie
+   entirely in a hole of a sparse file are not read at all. */
+
+#include "c150nastyfile.h"
+#include "sparse.h"
+#include "bufferpool.h"
+
+#include <sys/stat.h>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace C150NETWORK;
+
+const size_t robustChunkSize = 64 * 1024; /* Bytes voted on together */
+const int robustMaxReads = 15;            /* Give up and take the plurality after this many */
+const int robustAgreeLow = 2;             /* Agreeing reads needed normally */
+const int robustAgreeHigh = 3;            /* ... and once disagreement is common */
+const size_t robustHighRatePerMille = 20; /* Disagreeing chunks per 1000 that count as common */
+
+struct RobustReadStats {
+    size_t chunks;          /* Chunks read */
+    size_t reads;           /* Chunk reads issued, including rereads */
+    size_t disagreements;   /* Chunks whose reads did not all agree */
+    size_t holeChunks;      /* Chunks filled in as zeros without reading */
+};
+
+class RobustReader {
+    int fileNastiness;
+    RobustReadStats stats;
+
+    string path;
+    vector<unique_ptr<NASTYFILE>> handles;  /* For the first robustAgreeLow reads of each chunk */
+    vector<Extent> extents;                 /* Parts of the file holding data */
+
+    /* Distinct versions of the current chunk and how many reads saw each */
+    vector<vector<char>> candidates;
+    vector<int> votes;
+    size_t numCandidates;
+
+    int agreeNeeded() const {
+        return (stats.disagreements * 1000 > stats.chunks * robustHighRatePerMille)
+                   ? robustAgreeHigh : robustAgreeLow;
+    }
+
+    NASTYFILE &handle(int i) {
+        while ((int)handles.size() <= i) {
+            unique_ptr<NASTYFILE> file(new NASTYFILE(fileNastiness));
+            if (file->fopen(path.c_str(), "rb") == nullptr) {
+                throw runtime_error("Error opening input file: " + path);
+            }
+            handles.push_back(move(file));
+        }
+        return *handles[i];
+    }
+
+    void closeHandles() {
+        for (auto &file : handles) {
+            file->fclose();
+        }
+        handles.clear();
+    }
+
+    /* Read one chunk through handle i and count its vote */
+    void readVote(int i, size_t offset, size_t len) {
+        if (numCandidates == candidates.size()) {
+            candidates.emplace_back();
+            votes.push_back(0);
+        }
+        vector<char> &scratch = candidates[numCandidates];
+        scratch.resize(len);
+
+        /* The first reads of each chunk share handles kept open for the
+            whole file; any read past them, which only a disagreement calls
+            for, gets a handle opened for it alone */
+        bool ok;
+        if (i < robustAgreeLow) {
+            NASTYFILE &file = handle(i);
+            ok = file.fseek(offset, SEEK_SET) == 0 && file.fread(scratch.data(), 1, len) == len;
+        } else {
+            NASTYFILE file(fileNastiness);
+            if (file.fopen(path.c_str(), "rb") == nullptr) {
+                throw runtime_error("Error opening input file: " + path);
+            }
+            ok = file.fseek(offset, SEEK_SET) == 0 && file.fread(scratch.data(), 1, len) == len;
+            file.fclose();
+        }
+        if (!ok) {
+            throw runtime_error("Error reading file: " + path);
+        }
+        stats.reads++;
+
+        for (size_t c = 0; c < numCandidates; c++) {
+            if (memcmp(candidates[c].data(), scratch.data(), len) == 0) {
+                votes[c]++;
+                return;
+            }
+        }
+        votes[numCandidates++] = 1;
+    }
+
+    void readChunk(size_t offset, size_t len, char *dest) {
+        numCandidates = 0;
+        stats.chunks++;
+
+        if (fileNastiness == 0) {
+            readVote(0, offset, len);
+            memcpy(dest, candidates[0].data(), len);
+            return;
+        }
+
+        int needed = agreeNeeded();
+        size_t best = 0;
+        int reads = 0;
+        while (reads < robustMaxReads) {
+            readVote(reads++, offset, len);
+            if (reads < needed) {
+                continue;
+            }
+            best = 0;
+            for (size_t c = 1; c < numCandidates; c++) {
+                if (votes[c] > votes[best]) {
+                    best = c;
+                }
+            }
+            if (votes[best] >= needed && votes[best] * 2 > reads) {
+                break;
+            }
+        }
+
+        if (numCandidates > 1) {
+            stats.disagreements++;
+        }
+        memcpy(dest, candidates[best].data(), len);
+    }
+
+ public:
+    RobustReader(int fileNastiness) : fileNastiness(fileNastiness), stats(), numCandidates(0) {}
+
+    /* Read the whole file into a buffer from the shared pool */
+    PooledBuffer readFile(const string &filePath, size_t &fileSize) {
+        fileSize = sizeOf(filePath);
+        PooledBuffer buffer = sharedBufferPool().acquire(fileSize);
+        readInto(filePath, fileSize, buffer.data());
+        return buffer;
+    }
+
+    /* The size readFile reads, as lstat sees it now */
+    static size_t sizeOf(const string &filePath) {
+        struct stat statbuf;
+        if (lstat(filePath.c_str(), &statbuf) != 0) {
+            throw runtime_error("Error stating source file: " + filePath);
+        }
+        return statbuf.st_size;
+    }
+
+    /* Read the first fileSize bytes of the file into dest, for a caller
+        that acquires the buffer on another thread than the one reading */
+    void readInto(const string &filePath, size_t fileSize, char *dest) {
+        readRange(filePath, fileSize, 0, fileSize, dest);
+    }
+
+    /* Read length bytes from offset, a multiple of robustChunkSize, of a
+        file fileSize long into dest, so a file can be read a piece at a time */
+    void readRange(const string &filePath, size_t fileSize, size_t start, size_t length, char *dest) {
+        path = filePath;
+        findDataExtents(filePath, fileSize, extents);
+        size_t cursor = 0;
+        size_t end = min(fileSize, start + length);
+        try {
+            for (size_t offset = start; offset < end; offset += robustChunkSize) {
+                size_t len = min(robustChunkSize, end - offset);
+                if (overlapsExtent(extents, cursor, offset, len)) {
+                    readChunk(offset, len, dest + (offset - start));
+                } else {
+                    memset(dest + (offset - start), 0, len);
+                    stats.holeChunks++;
+                }
+            }
+        } catch (...) {
+            closeHandles();
+            throw;
+        }
+
+        closeHandles();
+    }
+
+    const RobustReadStats &getStats() const { return stats; }
+};
+
+/* One reader per process, so the disagreement rate it adapts to is
+   learned across every file it reads */
+RobustReader &sharedRobustReader(int fileNastiness) {
+    static RobustReader reader(fileNastiness);
+    return reader;
+}
+
+#endif
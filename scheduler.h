@@ -0,0 +1,189 @@
+#ifndef __SCHEDULER_H_INCLUDED__
+#define __SCHEDULER_H_INCLUDED__
+
+/* Building the client's work list: a recursive walk of the source tree,
+   then an ordering of the files by policy and priority class, and an
+   estimate of the time left based on the throughput measured so far. */
+
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+struct TransferItem {
+    string path;        /* Relative to the source directory, '/' separated */
+    uint64_t size;
+    int priorityClass;  /* Lower classes go first */
+};
+
+enum SchedulePolicy {
+    SCHEDULE_WALK,      /* In the order the walk found them */
+    SCHEDULE_SHORTEST,  /* Smallest files first */
+    SCHEDULE_LARGEST    /* Largest files first */
+};
+
+/* Files whose relative path matches pattern (fnmatch, '*' also matches '/')
+   are put in priorityClass; the first matching rule wins */
+struct PriorityRule {
+    string pattern;
+    int priorityClass;
+};
+
+const int defaultPriorityClass = 100;
+
+/* Collect every regular file under root/relDir. Symbolic links, devices
+   and the like are skipped, and so are directories that cannot be read. */
+void walkSourceTree(const string &root, const string &relDir, vector<TransferItem> &items) {
+    string dirPath = relDir.empty() ? root : root + "/" + relDir;
+    DIR *dir = opendir(dirPath.c_str());
+    if (dir == NULL) {
+        fprintf(stderr, "Error opening source directory %s\n", dirPath.c_str());
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if ((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0))
+            continue;
+
+        string relPath = relDir.empty() ? entry->d_name : relDir + "/" + entry->d_name;
+        string fullPath = root + "/" + relPath;
+        struct stat statbuf;
+        if (lstat(fullPath.c_str(), &statbuf) != 0) {
+            continue;
+        }
+
+        if (S_ISDIR(statbuf.st_mode)) {
+            walkSourceTree(root, relPath, items);
+        } else if (S_ISREG(statbuf.st_mode)) {
+            items.push_back({relPath, (uint64_t)statbuf.st_size, defaultPriorityClass});
+        }
+    }
+    closedir(dir);
+}
+
+/* Parse "pattern=class" */
+bool parsePriorityRule(const string &arg, PriorityRule &rule) {
+    size_t eq = arg.rfind('=');
+    if (eq == string::npos || eq == 0 || eq + 1 == arg.size() ||
+        strspn(arg.c_str() + eq + 1, "0123456789") != arg.size() - eq - 1) {
+        return false;
+    }
+    rule.pattern = arg.substr(0, eq);
+    rule.priorityClass = atoi(arg.c_str() + eq + 1);
+    return true;
+}
+
+bool parseSchedulePolicy(const string &arg, SchedulePolicy &policy) {
+    if (arg == "walk") {
+        policy = SCHEDULE_WALK;
+    } else if (arg == "shortest") {
+        policy = SCHEDULE_SHORTEST;
+    } else if (arg == "largest") {
+        policy = SCHEDULE_LARGEST;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/* Assign priority classes, then order by class and, within a class, by policy */
+void scheduleTransfers(vector<TransferItem> &items, SchedulePolicy policy, const vector<PriorityRule> &rules) {
+    for (TransferItem &item : items) {
+        item.priorityClass = defaultPriorityClass;
+        for (const PriorityRule &rule : rules) {
+            if (fnmatch(rule.pattern.c_str(), item.path.c_str(), 0) == 0) {
+                item.priorityClass = rule.priorityClass;
+                break;
+            }
+        }
+    }
+
+    stable_sort(items.begin(), items.end(), [policy](const TransferItem &a, const TransferItem &b) {
+        if (a.priorityClass != b.priorityClass) {
+            return a.priorityClass < b.priorityClass;
+        }
+        switch (policy) {
+            case SCHEDULE_SHORTEST: return a.size < b.size;
+            case SCHEDULE_LARGEST:  return a.size > b.size;
+            default:                return false;
+        }
+    });
+}
+
+/* Estimate of the time left from the files finished so far. Each file is
+   modelled as a fixed cost (name, CHECK and RESULT round trips) plus a
+   cost per byte, fitted by least squares, so that a run of small files
+   does not make the large ones look cheap or the other way round. */
+class TransferProgress {
+    uint64_t totalBytes;
+    size_t totalFiles;
+    uint64_t doneBytes;
+    size_t doneFiles;
+    double elapsedSeconds;
+
+    /* Running sums for the fit of seconds against bytes */
+    double sumX, sumY, sumXX, sumXY;
+
+ public:
+    TransferProgress(const vector<TransferItem> &items)
+        : totalBytes(0), totalFiles(items.size()), doneBytes(0), doneFiles(0), elapsedSeconds(0),
+          sumX(0), sumY(0), sumXX(0), sumXY(0) {
+        for (const TransferItem &item : items) {
+            totalBytes += item.size;
+        }
+    }
+
+    void fileDone(uint64_t bytes, double seconds) {
+        doneBytes += bytes;
+        doneFiles++;
+        elapsedSeconds += seconds;
+
+        double x = bytes;
+        sumX += x;
+        sumY += seconds;
+        sumXX += x * x;
+        sumXY += x * seconds;
+    }
+
+    /* Seconds left, or -1 before anything has finished */
+    double estimatedSecondsLeft() const {
+        if (doneFiles == 0) {
+            return -1;
+        }
+
+        double n = doneFiles;
+        double bytesLeft = totalBytes - doneBytes;
+        double filesLeft = totalFiles - doneFiles;
+        double denominator = n * sumXX - sumX * sumX;
+        if (denominator > 1e-9 * n * sumXX) {
+            double perByte = max(0.0, (n * sumXY - sumX * sumY) / denominator);
+            double perFile = max(0.0, (sumY - perByte * sumX) / n);
+            return bytesLeft * perByte + filesLeft * perFile;
+        }
+
+        /* All files so far the same size, so the cost cannot be split:
+           charging it all to bytes or all to files overestimates, so take
+           the smaller of the two */
+        double byFiles = filesLeft * sumY / n;
+        if (sumX == 0) {
+            return byFiles;
+        }
+        return min(byFiles, bytesLeft * sumY / sumX);
+    }
+
+    double throughput() const { return elapsedSeconds > 0 ? doneBytes / elapsedSeconds : 0; }
+    uint64_t getTotalBytes() const { return totalBytes; }
+    uint64_t getDoneBytes() const { return doneBytes; }
+    size_t getTotalFiles() const { return totalFiles; }
+    size_t getDoneFiles() const { return doneFiles; }
+};
+
+#endif
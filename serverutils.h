@@ -0,0 +1,620 @@
+#ifndef __SERVERUTILS_H_INCLUDED__
+#define __SERVERUTILS_H_INCLUDED__
+
+/* Packet handlers for the file server, shared by fileserver and tracereplay */
+
+#include "c150nastydgmsocket.h"
+#include "c150grading.h"
+#include <fstream>
+#include <cstdlib> 
+#include "fileutils.h"
+#include "chunkstore.h"
+#include "groupcommit.h"
+#include "manifest.h"
+#include <unordered_set>
+#include <cstdio>
+#include <sys/stat.h>
+
+using namespace C150NETWORK;
+
+/* The end-to-end check of the file being received. Once its RESULT is
+   applied the .TMP file may be renamed, or be waiting on a group commit
+   to be, so a repeated CHECK or RESULT is answered from here */
+struct FileCheck {
+    uint32_t fileId;
+    bool hashed;            /* digest holds the server copy's digest */
+    bool resultApplied;
+    uint8_t status;         /* Of the RESULT applied */
+    unsigned char digest[digestLength];
+
+    FileCheck() : fileId(0), hashed(false), resultApplied(false), status(CTRL_FAIL) {}
+};
+
+/* Everything the server tracks about one client */
+struct ServerSession {
+    unordered_set<string> logResult;
+    unordered_set<string> logStart;
+    uint32_t currentPacketNumber;     /* Next FILE packet expected */
+    uint32_t currentFileNameCounter;  /* Next first FILE packet for a file */
+    int packetsWrittenToFile;
+    string currentFileName;
+    string targetName;
+    bool fileRefused;                 /* The current file's name was refused: it is ACKed, not written */
+    NASTYFILE outputFile;
+    ChunkStore chunkStore;
+    FileCheck fileCheck;
+
+    ServerSession(int fileNastiness, ChunkIndex &chunkIndex)
+        : currentPacketNumber(0), currentFileNameCounter(0), packetsWrittenToFile(0), fileRefused(false),
+          outputFile(fileNastiness), chunkStore(chunkIndex) {}
+};
+
+/* True if name is a relative path that stays inside the target directory */
+bool isSafeRelativeName(const string &name);
+
+/* Create the directories leading up to relPath under targetDir */
+bool makeParentDirectories(const string &targetDir, const string &relPath);
+
+void receiveFilename(int &packetsWrittenToFile, 
+                     uint32_t &currentFileNameCounter,
+                     Packet &incomingPacket, 
+                     string &currentFileName,
+                     string &targetName,
+                     bool &fileRefused,
+                     string &targetDir,
+                     unordered_set<string> &logResult,
+                     unordered_set<string> &logStart,
+                     NASTYFILE& outputFile,
+                     ChunkStore &chunkStore);
+
+void writeDataToFile(int &packetsWrittenToFile,
+                     NASTYFILE& outputFile, 
+                     Packet &incomingPacket, 
+                     string &targetName,
+                     ChunkStore &chunkStore);
+
+void acknowledgePacket(C150DgmSocket *sock, Packet &incomingPacket);
+
+void handleFilePacket(C150DgmSocket *sock,
+                      int &packetsWrittenToFile, 
+                      uint32_t &currentFileNameCounter,
+                      uint32_t &currentPacketNumber,
+                      Packet &incomingPacket, 
+                      string &currentFileName,
+                      string &targetName,
+                      bool &fileRefused,
+                      string &targetDir,
+                      unordered_set<string> &logResult,
+                      unordered_set<string> &logStart,
+                      NASTYFILE& outputFile,
+                      ChunkStore &chunkStore);
+
+void handleCheck(C150DgmSocket *sock,
+                 ControlMessage &message,
+                 string &currentFileName,
+                 string &targetName,
+                 unordered_set<string> &logResult, 
+                 int &fileNastiness,
+                 FileCheck &fileCheck,
+                 HeldFiles &heldFiles);
+
+void handleResult(C150DgmSocket *sock, 
+                  ControlMessage &message, 
+                  string &currentFileName, 
+                  unordered_set<string> &logStart, 
+                  string &targetName, 
+                  string &targetDir,
+                  ChunkStore &chunkStore,
+                  FileCheck &fileCheck,
+                  GroupCommit &groupCommit,
+                  const string &clientKey);
+
+void handleQuery(C150DgmSocket *sock,
+                 ControlMessage &message,
+                 ChunkStore &chunkStore);
+
+void handleManifest(C150DgmSocket *sock,
+                    ControlMessage &message,
+                    string &targetDir,
+                    HeldFiles &heldFiles);
+
+void handleMessagePacket(C150DgmSocket *sock,  
+                         string &currentFileName, 
+                         unordered_set<string> &logStart,
+                         unordered_set<string> &logResult,
+                         string &targetName, 
+                         bool &fileRefused,
+                         string &targetDir,
+                         Packet &incomingPacket,
+                         int &fileNastiness,
+                         uint32_t &currentPacketNumber,
+                         uint32_t &currentFileNameCounter,
+                         int &packetsWrittenToFile,
+                         ChunkStore &chunkStore,
+                         FileCheck &fileCheck,
+                         GroupCommit &groupCommit,
+                         const string &clientKey,
+                         HeldFiles &heldFiles);
+
+/* Process a filename packet. The name leads the transmission of a given file and
+    may span several packets, each starting with NameFlags and the length of the 
+    sequence; the .TMP file is opened once the whole name has arrived. A name
+    that cannot be written is refused, leaving the server to serve on */
+void receiveFilename(int &packetsWrittenToFile, 
+                     uint32_t &currentFileNameCounter,
+                     Packet &incomingPacket, 
+                     string &currentFileName,
+                     string &targetName,
+                     bool &fileRefused,
+                     string &targetDir,
+                     unordered_set<string> &logResult,
+                     unordered_set<string> &logStart,
+                     NASTYFILE& outputFile,
+                     ChunkStore &chunkStore) 
+{
+    if (incomingPacket.dataSize < nameHeaderLength) {
+        return;
+    }
+
+    uint8_t flags = (uint8_t)incomingPacket.packetData[0];
+    const char *fragment = incomingPacket.packetData + nameHeaderLength;
+    size_t fragmentLength = incomingPacket.dataSize - nameHeaderLength;
+
+    if (incomingPacket.packetNum == currentFileNameCounter) {
+        uint32_t net_totalPackets;
+        memcpy(&net_totalPackets, incomingPacket.packetData + 1, sizeof(net_totalPackets));
+        packetsWrittenToFile = 0;
+        currentFileNameCounter = incomingPacket.packetNum + ntohl(net_totalPackets);
+        currentFileName.assign(fragment, fragmentLength);
+        targetName.clear();
+        fileRefused = false;
+        chunkStore.beginFile(incomingPacket.packetNum);
+    } else {
+        currentFileName.append(fragment, fragmentLength);
+    }
+
+    if ((flags & NAME_LAST) == 0) {
+        return;     /* More of the name to come */
+    }
+
+    bool stripe = (flags & NAME_STRIPE) != 0;
+    if (stripe) {
+        cout << "File: " << currentFileName << " receiving a stripe" << endl;
+    } else {
+        *GRADING << "File: " << currentFileName << " starting to receive file" << endl;
+        cout << "File: " << currentFileName << " starting to receive file" << endl;
+    }
+
+    logResult.erase(currentFileName);
+    logStart.erase(currentFileName);
+
+    if (!isSafeRelativeName(currentFileName)) {
+        cerr << "Refusing file name " << currentFileName << " outside the target directory" << endl;
+        fileRefused = true;
+        return;
+    }
+
+    if (!makeParentDirectories(targetDir, currentFileName)) {
+        cerr << "Error creating directories for " << currentFileName << " errno=" << strerror(errno) << endl;
+        fileRefused = true;
+        return;
+    }
+
+    targetName = makeFileName(targetDir, (currentFileName + ".TMP"));
+
+    void *fopenretval;
+    fopenretval = outputFile.fopen(targetName.c_str(), stripe ? "r+b" : "wb");
+
+    
+    if (fopenretval == NULL) {
+        cerr << "Error opening input file " << targetName << " errno=" << strerror(errno) << endl;
+        targetName.clear();
+        fileRefused = true;
+    }
+}
+
+bool isSafeRelativeName(const string &name)
+{
+    if (name.empty() || name[0] == '/') {
+        return false;
+    }
+
+    size_t start = 0;
+    while (start <= name.size()) {
+        size_t end = name.find('/', start);
+        if (end == string::npos) {
+            end = name.size();
+        }
+        string component = name.substr(start, end - start);
+        if (component.empty() || component == "." || component == "..") {
+            return false;
+        }
+        start = end + 1;
+    }
+    return true;
+}
+
+bool makeParentDirectories(const string &targetDir, const string &relPath)
+{
+    size_t slash = relPath.find('/');
+    while (slash != string::npos) {
+        string dirPath = makeFileName(targetDir, relPath.substr(0, slash));
+        if (mkdir(dirPath.c_str(), 0777) != 0 && errno != EEXIST) {
+            return false;
+        }
+        slash = relPath.find('/', slash + 1);
+    }
+    return true;
+}
+
+/* Take in packet and write selected portion into file: the bytes it carries,
+    the chunks it names copied out of the chunk store, a run of zeros, or the
+    offset the next of these goes to */
+void writeDataToFile(int &packetsWrittenToFile,
+                     NASTYFILE& outputFile, 
+                     Packet &incomingPacket, 
+                     string &targetName,
+                     ChunkStore &chunkStore)
+{
+    SpanScope span("writeDataToFile", targetName);
+    if (incomingPacket.dataSize < 1) {
+        return;
+    }
+
+    if (incomingPacket.packetData[0] == DATA_SEEK) {
+        uint64_t net_offset;
+        if (incomingPacket.dataSize < 1 + sizeof(net_offset)) {
+            return;
+        }
+        memcpy(&net_offset, incomingPacket.packetData + 1, sizeof(net_offset));
+        if (outputFile.fseek(be64toh(net_offset), SEEK_SET) != 0) {
+            cerr << "Error seeking in file " << targetName << " errno=" << strerror(errno) << endl;
+            exit(16);
+        }
+    } else if (incomingPacket.packetData[0] == DATA_ZERO) {
+        /* Seek past the run so it stays a hole; the file is extended over 
+            any trailing hole when it is closed */
+        uint64_t net_length;
+        if (incomingPacket.dataSize < 1 + sizeof(net_length)) {
+            return;
+        }
+        memcpy(&net_length, incomingPacket.packetData + 1, sizeof(net_length));
+        if (outputFile.fseek(be64toh(net_length), SEEK_CUR) != 0) {
+            cerr << "Error seeking in file " << targetName << " errno=" << strerror(errno) << endl;
+            exit(16);
+        }
+    } else if (incomingPacket.packetData[0] == DATA_CHUNKREF) {
+        for (size_t offset = 1; offset + digestLength <= incomingPacket.dataSize; offset += digestLength) {
+            ChunkDigest digest;
+            memcpy(digest.bytes, incomingPacket.packetData + offset, digestLength);
+
+            /* A missing chunk leaves a short file, which the end-to-end check catches */
+            const vector<char> *chunk = chunkStore.readChunk(digest);
+            if (chunk == nullptr) {
+                cerr << "Chunk missing from store for " << targetName << endl;
+                continue;
+            }
+            size_t len = outputFile.fwrite(chunk->data(), 1, chunk->size());
+            if (len != chunk->size()) {
+                cerr << "Error writing file " << targetName << " errno=" << strerror(errno) << endl;
+                exit(16);
+            }
+        }
+    } else {
+        ssize_t len = outputFile.fwrite(incomingPacket.packetData + 1, 1, incomingPacket.dataSize - 1);
+        if (len != incomingPacket.dataSize - 1) {
+            cerr << "Error writing file " << targetName << " errno=" << strerror(errno) << endl;
+            exit(16);
+        }
+    }
+                        
+    packetsWrittenToFile++;
+}
+
+/* Send ACK packet */
+void acknowledgePacket(C150DgmSocket *sock, Packet &incomingPacket) {
+    Packet ackPacket = createDataPacket(true, incomingPacket.packetNum, 0, "", 0);
+    writePacket(sock, ackPacket);
+}
+
+/* Process incoming FILE packet and send ACK packet */
+void handleFilePacket(C150DgmSocket *sock,
+                      int &packetsWrittenToFile, 
+                      uint32_t &currentFileNameCounter,
+                      uint32_t &currentPacketNumber,
+                      Packet &incomingPacket, 
+                      string &currentFileName,
+                      string &targetName,
+                      bool &fileRefused,
+                      string &targetDir,
+                      unordered_set<string> &logResult,
+                      unordered_set<string> &logStart,
+                      NASTYFILE& outputFile,
+                      ChunkStore &chunkStore)
+{
+    if (currentPacketNumber == incomingPacket.packetNum) {      
+        // Handle packet containing (part of) the filename
+        if (currentFileNameCounter == incomingPacket.packetNum || (targetName.empty() && !fileRefused)) {
+
+            receiveFilename(packetsWrittenToFile, currentFileNameCounter, incomingPacket, 
+                            currentFileName, targetName, fileRefused, targetDir, logResult, logStart,
+                            outputFile, chunkStore);
+    
+        } else if (!fileRefused) {       
+            writeDataToFile(packetsWrittenToFile, outputFile, incomingPacket, targetName, chunkStore);
+        };
+        
+        currentPacketNumber++; // Increment current packet
+
+        /* Close before the last ACK, so that the data is in the file by the
+            time the client moves on to its check, whichever flow carried it */
+        if (currentPacketNumber == currentFileNameCounter && !fileRefused) {
+            SpanScope span("fclose", targetName);
+            long fileEnd = outputFile.ftell();
+            if (outputFile.fclose() != 0 ) {
+                cerr << "Error closing output file " << targetName << 
+                    " errno=" << strerror(errno) << endl;
+                exit(16);
+            }
+
+            /* A file ending in a zero range has its write position past the last
+                byte. Only ever extend: a stripe may end before the rest of the file */
+            struct stat statbuf;
+            if (fileEnd > 0 && stat(targetName.c_str(), &statbuf) == 0 && statbuf.st_size < fileEnd &&
+                truncate(targetName.c_str(), fileEnd) != 0) {
+                cerr << "Error extending output file " << targetName << 
+                    " errno=" << strerror(errno) << endl;
+                exit(16);
+            }
+        }
+
+        acknowledgePacket(sock, incomingPacket);
+
+    /* Send ACK Packet for previous packet if that ACK was never received */
+    } else if (incomingPacket.packetNum == currentPacketNumber - 1 ) {
+        acknowledgePacket(sock, incomingPacket);
+    }
+}
+
+/* Process incoming CHECK packet and send the HASH message containing the digest
+    of the server file. The digest is kept for later MANIFESTs, and for CHECKs
+    repeated after the RESULT, when the file may no longer be at targetName */ 
+void handleCheck(C150DgmSocket *sock,
+                 ControlMessage &message,
+                 string &currentFileName,
+                 string &targetName,
+                 unordered_set<string> &logResult, 
+                 int &fileNastiness,
+                 FileCheck &fileCheck,
+                 HeldFiles &heldFiles)
+{
+    if (fileCheck.fileId == message.fileId && fileCheck.resultApplied) {
+        if (fileCheck.hashed) {
+            writePacket(sock, createControlPacket(CTRL_HASH, message.fileId, CTRL_FAIL, fileCheck.digest));
+        }
+        return;
+    }
+
+    if (logResult.count(currentFileName) == 0) {
+        *GRADING << "File: " << currentFileName << " received, beginning end-to-end check" << endl;
+        cout << "File: " << currentFileName << " received, beginning end-to-end check" << endl;
+        logResult.insert(currentFileName);
+    }
+
+    computeHash(targetName, fileNastiness, fileCheck.digest);
+    heldFiles.remember(targetName, fileCheck.digest);
+    fileCheck.fileId = message.fileId;
+    fileCheck.hashed = true;
+    fileCheck.resultApplied = false;
+
+    Packet messagePacket = createControlPacket(CTRL_HASH, message.fileId, CTRL_FAIL, fileCheck.digest);
+
+    writePacket(sock, messagePacket);
+}
+
+/* Process incoming RESULT packet and send the LOG confirmation message. With
+    group commit, a PASS is queued instead and its LOG sent once the group is
+    durable; targetName stays on the .TMP file until then */
+void handleResult(C150DgmSocket *sock, 
+                  ControlMessage &message, 
+                  string &currentFileName, 
+                  unordered_set<string> &logStart, 
+                  string &targetName, 
+                  string &targetDir,
+                  ChunkStore &chunkStore,
+                  FileCheck &fileCheck,
+                  GroupCommit &groupCommit,
+                  const string &clientKey)
+{
+    /* A repeated RESULT; a pending one's LOG goes out with the group */
+    if (fileCheck.fileId == message.fileId && fileCheck.resultApplied) {
+        if (!groupCommit.isPending(clientKey, message.fileId)) {
+            writePacket(sock, createControlPacket(CTRL_LOG, message.fileId, fileCheck.status));
+        }
+        return;
+    }
+    if (fileCheck.fileId != message.fileId) {
+        fileCheck.fileId = message.fileId;
+        fileCheck.hashed = false;
+    }
+    fileCheck.resultApplied = true;
+    fileCheck.status = message.status;
+
+    bool passed = (message.status == CTRL_PASS);
+    bool deferred = passed && groupCommit.enabled();
+
+    if (deferred) {
+        PendingCommit commit;
+        commit.tempName = targetName;
+        commit.finalName = makeFileName(targetDir, currentFileName);
+        commit.clientKey = clientKey;
+        commit.fileId = message.fileId;
+        commit.chunkStore = &chunkStore;
+#ifdef C150_HAVE_GET_OTHER_END
+        sock->getOtherEnd(commit.peer);
+#endif
+        groupCommit.add(commit);
+    } else if (passed) {
+        // On a PASS, remove .TMP extension and offer the file's chunks for reuse
+        string finalName = makeFileName(targetDir, currentFileName);
+        SpanScope span("rename", finalName);
+        if (rename(targetName.c_str(), finalName.c_str()) != 0) {
+            cout << "ERROR with RENAME" << endl;
+        } else {
+            chunkStore.commitFile(finalName);
+        }
+        targetName = finalName;
+    }
+    
+    if (logStart.count(currentFileName) == 0) {
+        if (passed) {
+            *GRADING << "File: " << currentFileName << " end-to-end check succeeded" << endl;
+            cout << "File: " << currentFileName << " end-to-end check succeeded" << endl;
+        } else {
+            *GRADING << "File: " << currentFileName << " end-to-end check failed" << endl;
+            cout << "File: " << currentFileName << " end-to-end check failed" << endl;
+        }
+        logStart.insert(currentFileName);
+    }
+
+    if (deferred) {
+        return;
+    }
+    Packet logPacket = createControlPacket(CTRL_LOG, message.fileId, message.status);
+    writePacket(sock, logPacket);
+}
+
+/* Process incoming QUERY packet: note the chunks for the coming file and
+    send a HAVE bitmap of the ones already in the chunk store */
+void handleQuery(C150DgmSocket *sock,
+                 ControlMessage &message,
+                 ChunkStore &chunkStore)
+{
+    uint16_t net_first;
+    if (message.payloadLength < sizeof(net_first)) {
+        return;
+    }
+    memcpy(&net_first, message.payload, sizeof(net_first));
+    uint16_t first = ntohs(net_first);
+    uint16_t count = (message.payloadLength - sizeof(net_first)) / queryEntryLength;
+
+    Chunk chunks[maxQueryEntries];
+    unsigned char bitmap[(maxQueryEntries + 7) / 8] = {0};
+    const char *entry = message.payload + sizeof(net_first);
+    for (uint16_t i = 0; i < count && i < maxQueryEntries; i++, entry += queryEntryLength) {
+        uint32_t net_length;
+        memcpy(chunks[i].digest.bytes, entry, digestLength);
+        memcpy(&net_length, entry + digestLength, sizeof(net_length));
+        chunks[i].length = ntohl(net_length);
+        chunks[i].offset = 0;
+        if (chunkStore.has(chunks[i].digest)) {
+            bitmap[i / 8] |= 1 << (i % 8);
+        }
+    }
+
+    chunkStore.addPending(message.fileId, first, chunks, count);
+
+    Packet havePacket = createControlPacket(CTRL_HAVE, message.fileId);
+    uint16_t net_count = htons(count);
+    appendToPacket(havePacket, &net_first, sizeof(net_first));
+    appendToPacket(havePacket, &net_count, sizeof(net_count));
+    appendToPacket(havePacket, bitmap, (count + 7) / 8);
+    writePacket(sock, havePacket);
+}
+
+/* Process incoming MANIFEST packet and send a HOLD bitmap of the files
+    already in the target directory with the same size and digest. Files
+    past manifestHashBudget are left to heldFiles.hashQueued */
+void handleManifest(C150DgmSocket *sock,
+                    ControlMessage &message,
+                    string &targetDir,
+                    HeldFiles &heldFiles)
+{
+    uint32_t first;
+    vector<ManifestEntry> entries;
+    if (!parseManifest(message, first, entries)) {
+        return;
+    }
+
+    vector<unsigned char> bitmap((entries.size() + 7) / 8, 0);
+    size_t budget = manifestHashBudget;
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (isSafeRelativeName(entries[i].name) &&
+            heldFiles.holds(makeFileName(targetDir, entries[i].name), entries[i].size, entries[i].digest, budget)) {
+            bitmap[i / 8] |= 1 << (i % 8);
+        }
+    }
+
+    Packet holdPacket = createControlPacket(CTRL_HOLD, message.fileId);
+    uint32_t net_first = htonl(first);
+    uint16_t net_count = htons(entries.size());
+    appendToPacket(holdPacket, &net_first, sizeof(net_first));
+    appendToPacket(holdPacket, &net_count, sizeof(net_count));
+    appendToPacket(holdPacket, bitmap.data(), bitmap.size());
+    writePacket(sock, holdPacket);
+}
+
+/* Process an incoming Message Packet */
+void handleMessagePacket(C150DgmSocket *sock,  
+                         string &currentFileName, 
+                         unordered_set<string> &logStart,
+                         unordered_set<string> &logResult,
+                         string &targetName, 
+                         bool &fileRefused,
+                         string &targetDir,
+                         Packet &incomingPacket,
+                         int &fileNastiness,
+                         uint32_t &currentPacketNumber,
+                         uint32_t &currentFileNameCounter,
+                         int &packetsWrittenToFile,
+                         ChunkStore &chunkStore,
+                         FileCheck &fileCheck,
+                         GroupCommit &groupCommit,
+                         const string &clientKey,
+                         HeldFiles &heldFiles)
+{
+    ControlMessage message;
+    if (!parseControlMessage(incomingPacket, message)) {
+        return;
+    }
+
+    /* CHECK and RESULT only apply to the file currently being received */
+    bool currentFile = (message.fileId == currentFileNameCounter && !targetName.empty());
+
+    /* A refused file can never pass: a digest of zeros for its CHECK, a FAIL for its RESULT */
+    if (message.fileId == currentFileNameCounter && fileRefused) {
+        if (message.opcode == CTRL_CHECK) {
+            unsigned char noDigest[digestLength] = {0};
+            writePacket(sock, createControlPacket(CTRL_HASH, message.fileId, CTRL_FAIL, noDigest));
+            return;
+        }
+        if (message.opcode == CTRL_RESULT) {
+            writePacket(sock, createControlPacket(CTRL_LOG, message.fileId, CTRL_FAIL));
+            return;
+        }
+    }
+
+    if (message.opcode == CTRL_CHECK && currentFile) {
+        handleCheck(sock, message, currentFileName, targetName, logResult, fileNastiness, fileCheck, heldFiles);
+    }  
+    else if (message.opcode == CTRL_RESULT && currentFile) {
+        handleResult(sock, message, currentFileName, logStart, targetName, targetDir, chunkStore,
+                     fileCheck, groupCommit, clientKey);
+    }
+    else if (message.opcode == CTRL_QUERY) {
+        handleQuery(sock, message, chunkStore);
+    }
+    else if (message.opcode == CTRL_MANIFEST) {
+        handleManifest(sock, message, targetDir, heldFiles);
+    }
+    else if (message.opcode == CTRL_FINISHED) {
+        currentPacketNumber = 0;
+        currentFileNameCounter = 0;
+        packetsWrittenToFile = 0;
+
+        Packet finalPacket = createControlPacket(CTRL_FINISHED, 0);               
+        writePacket(sock, finalPacket);
+    }
+}
+
+#endif
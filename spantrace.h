@@ -0,0 +1,226 @@
+#ifndef __SPANTRACE_H_INCLUDED__
+#define __SPANTRACE_H_INCLUDED__
+
+/* Timeline of where each program spends its time: disk reads, ACK waits,
+   hashing, writes, closes and renames, as spans of [start, end).
+
+   Each thread records into its own fixed-size ring, so recording takes no
+   lock; when a ring is full the oldest spans are overwritten. A thread's
+   ring, spans and all, passes to the next thread started after it exits,
+   so a thread per file does not mean a ring per file. dumpSpans
+   writes every ring as Chrome trace JSON ("X" complete events), which
+   chrome://tracing and ui.perfetto.dev load directly. Rings are read
+   without stopping their writers, so dump once the threads have finished
+   or from the only thread that records. */
+
+#include <stdint.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+const size_t spanRingCapacity = 1 << 16;
+const size_t spanDetailLength = 40;
+
+struct Span {
+    const char *name;               /* String literal */
+    const char *argName;            /* String literal, or null for no numeric argument */
+    int64_t argValue;
+    uint64_t startNanos;
+    uint64_t durationNanos;
+    char detail[spanDetailLength];  /* Usually a file name, keeping its end if too long */
+};
+
+struct SpanRing {
+    std::vector<Span> slots;
+    std::atomic<uint64_t> head;     /* Spans ever recorded by the thread */
+    std::string threadName;
+    int tid;
+
+    SpanRing() : slots(spanRingCapacity), head(0), tid(0) {}
+};
+
+/* Off until startSpanTrace, so the scopes below cost one branch */
+bool spanTracing = false;
+std::string spanTraceFile;
+std::mutex spanRingsMutex;
+std::vector<std::unique_ptr<SpanRing>> spanRings;
+std::vector<SpanRing *> freeSpanRings;
+
+/* Hands the ring back when its thread exits */
+struct SpanRingOwner {
+    SpanRing *ring;
+
+    SpanRingOwner() : ring(nullptr) {}
+    ~SpanRingOwner() {
+        if (ring != nullptr) {
+            std::lock_guard<std::mutex> lock(spanRingsMutex);
+            freeSpanRings.push_back(ring);
+        }
+    }
+};
+thread_local SpanRingOwner threadSpanRing;
+
+uint64_t spanNowNanos() {
+    static const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+/* The calling thread's ring, registered the first time it records */
+SpanRing *spanRing() {
+    if (threadSpanRing.ring == nullptr) {
+        std::lock_guard<std::mutex> lock(spanRingsMutex);
+        if (!freeSpanRings.empty()) {
+            threadSpanRing.ring = freeSpanRings.back();
+            freeSpanRings.pop_back();
+        } else {
+            std::unique_ptr<SpanRing> ring(new SpanRing());
+            ring->tid = (int)spanRings.size() + 1;
+            ring->threadName = (ring->tid == 1) ? "main" : "thread " + std::to_string(ring->tid);
+            threadSpanRing.ring = ring.get();
+            spanRings.push_back(std::move(ring));
+        }
+    }
+    return threadSpanRing.ring;
+}
+
+/* Label the calling thread in the timeline */
+void spanThreadName(const std::string &name) {
+    if (spanTracing) {
+        spanRing()->threadName = name;
+    }
+}
+
+void copySpanDetail(char *to, const char *from) {
+    size_t length = strlen(from);
+    if (length >= spanDetailLength) {
+        from += length - (spanDetailLength - 1);
+    }
+    strcpy(to, from);
+}
+
+void recordSpan(const char *name, uint64_t startNanos, const char *detail,
+                const char *argName, int64_t argValue) {
+    SpanRing *ring = spanRing();
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    Span &span = ring->slots[head % spanRingCapacity];
+    span.name = name;
+    span.argName = argName;
+    span.argValue = argValue;
+    span.startNanos = startNanos;
+    span.durationNanos = spanNowNanos() - startNanos;
+    memcpy(span.detail, detail, spanDetailLength);
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+/* Records a span from construction to destruction */
+class SpanScope {
+    const char *name;
+    const char *argName;
+    int64_t argValue;
+    uint64_t start;
+    char detail[spanDetailLength];
+
+ public:
+    SpanScope(const char *spanName, const std::string &spanDetail)
+        : name(spanName), argName(nullptr), argValue(0), start(0) {
+        if (spanTracing) {
+            copySpanDetail(detail, spanDetail.c_str());
+            start = spanNowNanos();
+        }
+    }
+
+    SpanScope(const char *spanName, const char *spanArgName, int64_t spanArgValue)
+        : name(spanName), argName(spanArgName), argValue(spanArgValue), start(0) {
+        if (spanTracing) {
+            detail[0] = '\0';
+            start = spanNowNanos();
+        }
+    }
+
+    ~SpanScope() {
+        if (spanTracing) {
+            recordSpan(name, start, detail, argName, argValue);
+        }
+    }
+};
+
+void writeJsonString(FILE *fp, const char *s) {
+    fputc('"', fp);
+    for (; *s != '\0'; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            fprintf(fp, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(fp, "\\u%04x", c);
+        } else {
+            fputc(c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+/* Write every ring to the trace file, replacing what was there */
+bool dumpSpans() {
+    if (!spanTracing) {
+        return true;
+    }
+    std::string tempName = spanTraceFile + ".part";
+    FILE *fp = fopen(tempName.c_str(), "w");
+    if (fp == nullptr) {
+        return false;
+    }
+
+    int pid = (int)getpid();
+    bool first = true;
+    size_t overwritten = 0;
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    std::lock_guard<std::mutex> lock(spanRingsMutex);
+    for (const std::unique_ptr<SpanRing> &ring : spanRings) {
+        fprintf(fp, "%s\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",
+                first ? "" : ",", pid, ring->tid);
+        writeJsonString(fp, ring->threadName.c_str());
+        fprintf(fp, "}}");
+        first = false;
+
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t oldest = (head > spanRingCapacity) ? head - spanRingCapacity : 0;
+        overwritten += oldest;
+        for (uint64_t i = oldest; i < head; i++) {
+            const Span &span = ring->slots[i % spanRingCapacity];
+            fprintf(fp, ",\n{\"ph\":\"X\",\"cat\":\"filecopy\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,"
+                        "\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+                    span.name, pid, ring->tid, span.startNanos / 1000.0, span.durationNanos / 1000.0);
+            if (span.detail[0] != '\0') {
+                fprintf(fp, "\"file\":");
+                writeJsonString(fp, span.detail);
+            }
+            if (span.argName != nullptr) {
+                fprintf(fp, "%s\"%s\":%lld", (span.detail[0] != '\0') ? "," : "", span.argName,
+                        (long long)span.argValue);
+            }
+            fprintf(fp, "}}");
+        }
+    }
+    fprintf(fp, "\n],\"otherData\":{\"overwrittenSpans\":%zu}}\n", overwritten);
+
+    bool ok = (fclose(fp) == 0);
+    return ok && rename(tempName.c_str(), spanTraceFile.c_str()) == 0;
+}
+
+/* Turn on span recording; spans go to path at each dumpSpans and at exit */
+void startSpanTrace(const std::string &path) {
+    spanTraceFile = path;
+    spanTracing = true;
+    spanNowNanos();
+    spanRing();
+    atexit([]() { dumpSpans(); });
+}
+
+#endif
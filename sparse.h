@@ -0,0 +1,118 @@
+#ifndef __SPARSE_H_INCLUDED__
+#define __SPARSE_H_INCLUDED__
+
+/* Finding the parts of a file that need not be read or sent: holes in
+   sparse files (SEEK_DATA/SEEK_HOLE) and long runs of zero bytes. */
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+const size_t zeroBlockSize = 4096;  /* Zero runs are whole blocks at this alignment */
+
+struct Extent {
+    uint64_t offset;
+    uint64_t length;
+};
+
+/* List the ranges of the file that hold data. A file system without
+   SEEK_DATA support reports the whole file as data. */
+void findDataExtents(const std::string &path, uint64_t fileSize, std::vector<Extent> &extents) {
+    extents.clear();
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        extents.push_back({0, fileSize});
+        return;
+    }
+
+    off_t pos = 0;
+    while ((uint64_t)pos < fileSize) {
+        off_t dataStart = lseek(fd, pos, SEEK_DATA);
+        if (dataStart < 0) {
+            if (errno != ENXIO) {   /* ENXIO: only a hole remains */
+                extents.clear();
+                extents.push_back({0, fileSize});
+            }
+            break;
+        }
+        off_t holeStart = lseek(fd, dataStart, SEEK_HOLE);
+        if (holeStart < 0 || (uint64_t)holeStart > fileSize) {
+            holeStart = fileSize;
+        }
+        extents.push_back({(uint64_t)dataStart, (uint64_t)(holeStart - dataStart)});
+        pos = holeStart;
+    }
+    close(fd);
+}
+
+/* True if [offset, offset + length) touches any extent. Queries must come
+   in ascending order; cursor remembers where the last one left off. */
+bool overlapsExtent(const std::vector<Extent> &extents, size_t &cursor, uint64_t offset, uint64_t length) {
+    while (cursor < extents.size() && extents[cursor].offset + extents[cursor].length <= offset) {
+        cursor++;
+    }
+    return cursor < extents.size() && extents[cursor].offset < offset + length;
+}
+
+/* True if every byte is zero, sixteen bytes at a time where SSE2 is available */
+bool isAllZero(const char *data, size_t length) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 64 <= length; i += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(data + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(data + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(data + i + 48));
+        __m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, zero)) != 0xFFFF) {
+            return false;
+        }
+    }
+#else
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        if (word != 0) {
+            return false;
+        }
+    }
+#endif
+    for (; i < length; i++) {
+        if (data[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Find runs of zero blocks inside buffer[start, start + length). Blocks
+   are aligned to zeroBlockSize from the start of the buffer, so a run
+   sent as a hole lines up with file system blocks on the server. */
+void findZeroRuns(const char *buffer, size_t start, size_t length, std::vector<Extent> &runs) {
+    runs.clear();
+    size_t end = start + length;
+    size_t block = (start + zeroBlockSize - 1) / zeroBlockSize * zeroBlockSize;
+
+    for (; block + zeroBlockSize <= end; block += zeroBlockSize) {
+        if (!isAllZero(buffer + block, zeroBlockSize)) {
+            continue;
+        }
+        if (!runs.empty() && runs.back().offset + runs.back().length == block) {
+            runs.back().length += zeroBlockSize;
+        } else {
+            runs.push_back({block, zeroBlockSize});
+        }
+    }
+}
+
+#endif
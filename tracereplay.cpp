@@ -0,0 +1,159 @@
+// ------------------------------------------------------
+//
+//                   tracereplay
+//
+// Feed the datagrams from a packet trace through the server
+// handlers (handleFilePacket / handleMessagePacket) in
+// recorded order, with no network involved.
+//
+//   tracereplay <tracefile> <targetdir> [filenastiness]
+//
+// A server trace replays what the server actually received,
+// including duplicates and reordering, with a session per
+// client as the server keeps; a client trace replays
+// everything the client's main socket sent, as if nothing
+// had been lost.
+// Replies the handlers produce are compared with the ones in
+// a server trace, so protocol changes can be checked against
+// identical loss patterns.
+//
+// ------------------------------------------------------
+
+#include "c150dgmsocket.h"
+#include "c150grading.h"
+#include "fileutils.h"
+#include "serverutils.h"
+#include <chrono>
+#include <memory>
+#include <unordered_map>
+
+using namespace C150NETWORK;
+
+const int traceArg = 1;
+const int targetArg = 2;
+const int fileNastinessArg = 3;
+
+/* Socket that keeps what the handlers write instead of sending it */
+class ReplayDgmSocket : public C150DgmSocket {
+ public:
+    vector<vector<char>> written;
+
+    virtual void write(const char *buf, ssize_t lenToWrite) {
+        written.push_back(vector<char>(buf, buf + lenToWrite));
+    }
+};
+
+int main(int argc, char *argv[]) {
+    GRADEME(argc, argv);
+
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "Correct syntax is: %s <tracefile> <targetdir> [filenastiness]\n", argv[0]);
+        exit(1);
+    }
+
+    int fileNastiness = 0;
+    if (argc == 4) {
+        if (strspn(argv[fileNastinessArg], "0123456789") != strlen(argv[fileNastinessArg])) {
+            fprintf(stderr, "Nastiness %s is not numeric\n", argv[fileNastinessArg]);
+            exit(4);
+        }
+        fileNastiness = atoi(argv[fileNastinessArg]);
+    }
+    checkDirectory(argv[targetArg]);
+
+    PacketTrace trace;
+    if (!trace.open(argv[traceArg])) {
+        fprintf(stderr, "Error opening trace file %s\n", argv[traceArg]);
+        exit(8);
+    }
+
+    /* Server traces replay what arrived; client traces replay what was sent */
+    uint8_t inputDirection = (trace.getRole() == TRACE_SERVER) ? TRACE_RECV : TRACE_SEND;
+
+    vector<TraceRecord> inputs;
+    vector<vector<char>> recordedReplies;
+    TraceRecord rec;
+    while (trace.next(rec)) {
+        if (rec.direction == inputDirection) {
+            inputs.push_back(rec);
+        } else if (trace.getRole() == TRACE_SERVER && rec.direction == TRACE_SEND) {
+            recordedReplies.push_back(rec.data);
+        }
+    }
+
+    ReplayDgmSocket sock;
+
+    string targetDir = argv[targetArg];
+    ChunkIndex chunkIndex(fileNastiness);
+    unordered_map<string, unique_ptr<ServerSession>> sessions;
+    unordered_set<string> clients;
+    GroupCommit groupCommit;    /* Off: a replay renames each passed file at once */
+    HeldFiles heldFiles(fileNastiness);
+
+    size_t filePackets = 0;
+    size_t messagePackets = 0;
+    size_t malformed = 0;
+    double fileSeconds = 0;
+    double messageSeconds = 0;
+
+    for (const TraceRecord &input : inputs) {
+        Packet incomingPacket;
+        try {
+            incomingPacket = parsePacket(input.data.data(), input.data.size());
+        } catch (C150Exception&) {
+            malformed++;
+            continue;
+        }
+
+        /* Every datagram of a client trace went to the one server */
+        string key = (trace.getRole() == TRACE_SERVER) ? input.peer : "";
+        clients.insert(key);
+        unique_ptr<ServerSession> &session = sessions[key];
+        if (!session) {
+            session.reset(new ServerSession(fileNastiness, chunkIndex));
+        }
+
+        auto start = chrono::steady_clock::now();
+        if (incomingPacket.isFile) {
+            handleFilePacket(&sock, session->packetsWrittenToFile, session->currentFileNameCounter,
+                             session->currentPacketNumber, incomingPacket, session->currentFileName,
+                             session->targetName, session->fileRefused, targetDir, session->logResult,
+                             session->logStart, session->outputFile, session->chunkStore);
+            fileSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            filePackets++;
+        } else {
+            handleMessagePacket(&sock, session->currentFileName, session->logStart, session->logResult,
+                                session->targetName, session->fileRefused, targetDir, incomingPacket,
+                                fileNastiness, session->currentPacketNumber,
+                                session->currentFileNameCounter, session->packetsWrittenToFile,
+                                session->chunkStore, session->fileCheck, groupCommit, key, heldFiles);
+            messageSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            messagePackets++;
+
+            /* As in the server, a client that has finished starts afresh if it comes back */
+            ControlMessage message;
+            if (parseControlMessage(incomingPacket, message) && message.opcode == CTRL_FINISHED) {
+                sessions.erase(key);
+            }
+        }
+        heldFiles.hashQueued(deferredHashBudget);
+    }
+
+    cout << "Replayed " << inputs.size() << " datagrams from " << clients.size() << " clients: " << filePackets
+         << " file (" << fileSeconds << " s), " << messagePackets << " message (" << messageSeconds
+         << " s), " << malformed << " malformed" << endl;
+
+    if (trace.getRole() == TRACE_SERVER) {
+        size_t matching = 0;
+        while (matching < sock.written.size() && matching < recordedReplies.size() &&
+               sock.written[matching] == recordedReplies[matching]) {
+            matching++;
+        }
+        cout << "Replies: " << sock.written.size() << " replayed, " << recordedReplies.size()
+             << " recorded, first " << matching << " identical" << endl;
+        return (matching == sock.written.size() && matching == recordedReplies.size()) ? 0 : 1;
+    }
+
+    cout << "Replies: " << sock.written.size() << " replayed" << endl;
+    return 0;
+}